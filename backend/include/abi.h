@@ -0,0 +1,35 @@
+#ifndef _ABI_H_
+#define _ABI_H_
+
+/*
+  Representation of values shared between the code generator and the
+  C wrapper. Keep this header plain C.
+*/
+
+#include <stdint.h>
+
+/* a small sum type keeps the constructor index in the low bits of its
+   (aligned) payload pointer */
+#define ESTLC_TAG_BITS 3
+#define ESTLC_TAG_MASK ((((uintptr_t)1) << ESTLC_TAG_BITS) - 1)
+#define ESTLC_TAG(p) ((unsigned)((uintptr_t)(p) & ESTLC_TAG_MASK))
+#define ESTLC_UNTAG(p) ((void *)((uintptr_t)(p) & ~ESTLC_TAG_MASK))
+#define ESTLC_MKTAG(p, idx) ((void *)((uintptr_t)(p) | (uintptr_t)(idx)))
+/* the last index is no constructor: the ref points to a producer of
+   the value, see lazy.h */
+#define ESTLC_LAZY ESTLC_TAG_MASK
+
+/* any other sum points to its index and payload */
+struct estlc_sum {
+  uint32_t idx;
+  void *payload;
+};
+
+/* Int is never boxed: it is carried in the low bits of a ref, and
+   stored at its natural width inside a product */
+typedef uint32_t estlc_int;
+#define ESTLC_INT_BITS 32
+#define ESTLC_INT(r) ((estlc_int)(uintptr_t)(r))
+#define ESTLC_REF(i) ((void *)(uintptr_t)(estlc_int)(i))
+
+#endif
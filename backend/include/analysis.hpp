@@ -0,0 +1,75 @@
+#ifndef _ANALYSIS_HPP_
+#define _ANALYSIS_HPP_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <ast.hpp>
+
+typedef std::map<std::string, const ast::Type *> Scope;
+
+/* the primitives every program sees, as bound by Codegen */
+extern const std::vector<std::string> primitives;
+
+/* the operations of the built-in persistent vector of Ints, type Vec,
+   run by wrapper/vec.c; vempty is the empty one. vfilter takes a
+   predicate, NULL without bool */
+extern const std::vector<std::string> vectorOps;
+const ast::Type *vectorType(const std::string &op, const ast::Type *Bool);
+
+/* e in (par e), asking for e to be evaluated in parallel with the work
+   around it, NULL for any other term. par is reserved, never bound */
+const ast::Term *getPar(const ast::Term *term);
+
+/* e in (memo e), the body of a Func memo, NULL for any other term.
+   memo is reserved like par */
+const ast::Term *getMemo(const ast::Term *term);
+/* whether the function of the fixpoint remembers its results */
+bool isMemo(const ast::Fixpoint *fix);
+
+/* whether the reference is an integer literal, and its value */
+bool isLiteral(const std::string &name, int &num);
+
+/* names referenced but not bound inside the term, literals, par and
+   memo excluded */
+std::set<std::string> freeVariables(const ast::Term *term);
+
+/* the constructors and primitives of the program, with their types */
+Scope globalTypes(const ast::Program &prog);
+
+/* the type of the term with its free variables typed by scope, NULL
+   if it cannot be told */
+const ast::Type *typeOf(const ast::Term *term, const Scope &scope);
+
+/* how many times name occurs free in the term; under is set if one
+   of them is inside a lambda */
+size_t countUses(const ast::Term *term, const std::string &name, bool &under);
+
+/* whether the two terms are the same, node for node */
+bool equalTerms(const ast::Term *a, const ast::Term *b);
+
+/* the number of nodes in the term */
+size_t termSize(const ast::Term *term);
+
+/* a new term, keeping the position of the one it replaces for error
+   messages */
+template<typename T>
+T *at(T *term, const ast::Term *from) {
+  term->nrow = from->nrow;
+  term->ncol = from->ncol;
+  return term;
+}
+
+/* a fresh copy of the term, sharing nothing with it */
+const ast::Term *copyTerm(const ast::Term *term);
+
+/* the term with value in place of the free occurrences of name, NULL
+   if some binder of the term would capture a variable of value */
+const ast::Term *substitute(const ast::Term *term, const std::string &name, const ast::Term *value);
+
+/* a copy of the term with the given nodes replaced by references to
+   the names they map to */
+const ast::Term *replaceNodes(const ast::Term *term, const std::map<const ast::Term *, std::string> &nodes);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _CHEADER_HPP_
+#define _CHEADER_HPP_
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <ast.hpp>
+
+#include "layout.hpp"
+
+/*
+  Writes a C header for the types of a program, laid out as Layout
+  lays them out: for each sum, its tags, a struct per constructor with
+  fields, functions building a value of each constructor, reading the
+  tag and the fields of one, and printing one; for each product, the
+  struct of its fields, functions building one, reading each field and
+  printing one. A host program builds inputs and reads results through
+  it, without copying.
+*/
+class CHeader {
+  Layout &layout;
+  std::map<const ast::Type *, std::string> names;
+
+  std::string getName(const ast::Type *type) const;
+  std::string getFieldType(const ast::Type *type) const;
+  void writeSum(const std::string &name, const ast::SumType *sum, std::ostream &os);
+  void writeDump(const std::string &name, const ast::SumType *sum, std::ostream &os);
+  void writeProduct(const std::string &name, const ast::ProductType *product, std::ostream &os);
+public:
+  CHeader(Layout &layout);
+  void write(const ast::Program &prog, const std::string &guard, std::ostream &os);
+};
+
+#endif
@@ -2,9 +2,11 @@
 #define _CODEGEN_HPP_
 
 #include <map>
+#include <set>
 #include <string>
 #include <ast.hpp>
 #include <vector>
+#include <tuple>
 #include <memory>
 #include <utility>
 
@@ -16,58 +18,243 @@
 #include <debug.hpp>
 
 #include "env.hpp"
+#include "layout.hpp"
+#include "flow.hpp"
+#include "options.hpp"
 
 class Codegen {
   llvm::LLVMContext &context;
   llvm::Module *module;
   llvm::IRBuilder<> builder;
   llvm::DataLayout layout;
+  Layout abi;
 
   std::vector<llvm::Type *> argsType;
-  llvm::Type  *productType, *indexType, *sumType, *closureType;
+  llvm::Type  *productType, *indexType, *sumType;
+  llvm::StructType *closureType;
   llvm::PointerType *PclosureType, *PfuncType, *stackType, *refType;
   llvm::FunctionType *funcType;
 
   const ast::SumType *Bool;
+  const ast::Type *Int;
 
+  /* closure forms of the binary primitives, by name */
+  std::map<std::string, llvm::Constant *> operators;
 
+  /* the functions written in C, the vector operations (see vec.h) and
+     the Externs of the program: the function each one is, called right
+     away when it is given all its arguments, and the closure form it
+     is bound to. A vfilter or vmap by a section (op x) of a primitive
+     the kernels know calls the kernel with op and x instead of
+     applying a closure per element */
+  struct External {
+    llvm::Function *func;
+    llvm::Value *value;
+    const ast::Type *type;
+    size_t arity;
+  };
+  std::map<std::string, External> externs;
+
+  /* a fixpoint compiled to a function taking all its parameters, the
+     value it is known by is the frame to call it with; heavy if it
+     calls itself or another heavy one, i.e. a call may be any amount
+     of work */
+  struct Known {
+    llvm::Function *func;
+    size_t arity;
+    const ast::Type *type;
+    bool heavy;
+  };
+  std::map<llvm::Value *, Known> knowns;
+
+  /* which closures reach each call site, and the code each of them
+     carries: one function per lambda, one per stage of a fixpoint or
+     a global */
+  Flow *flow;
+  std::map<const ast::Term *, std::vector<llvm::Function *> > codes;
+  std::map<std::string, std::vector<llvm::Function *> > globalCodes;
+  /* more targets than this and the call stays indirect */
+  static const size_t maxTargets = 4;
+  /* a site with one target calls it directly; should that lambda or
+     fixpoint be compiled again in another shape, its closures carry
+     other code too, and the call goes through the code pointer loaded
+     with it once the program is generated */
+  std::set<llvm::Function *> recompiled;
+  std::vector<std::pair<llvm::CallInst *, llvm::Value *> > directs;
+
+  /* the functions compiled for a lambda or fixpoint, by the node and
+     what its code depends on in the environment: for each free
+     variable its type, its value if a constant, the function it is
+     known to be if any. A shared node reached again in the same shape
+     only makes a new closure */
+  typedef std::vector<std::tuple<const ast::Type *, llvm::Value *, llvm::Function *> > Shape;
+  struct Compiled {
+    std::vector<llvm::Function *> funcs;
+    Known known;
+    const ast::Type *type;
+  };
+  std::map<std::pair<const ast::Term *, Shape>, Compiled> compiled;
+
+  /* the constructors of the program with the constant closures they
+     are bound to, so that a shadowed name is told apart */
+  struct Constructor {
+    const ast::SumType *sum;
+    uint32_t idx;
+    llvm::Value *value;
+  };
+  std::map<std::string, Constructor> constructors;
+  std::map<std::string, std::pair<const ast::ProductType *, llvm::Value *> > products;
+
+  /* a fixpoint whose recursive calls go into a field of the cell it
+     returns: its body is a loop, each round storing its result into
+     the hole the round before left, then going on with the new
+     arguments and the field of the new cell as the hole */
+  struct Destination {
+    const ast::Abstraction *abs;
+    std::vector<const ast::Abstraction *> params;
+    const ast::Type *result;
+    llvm::Value *self;
+    llvm::BasicBlock *header, *exit;
+    std::vector<llvm::PHINode *> values;
+    llvm::PHINode *hole;
+    /* with -fchunk, the free space cells are taken from: next, end
+       and the size of the chunk to get when it runs out; phis at the
+       header, what the round passes on after a cell */
+    std::vector<llvm::PHINode *> chunks;
+    std::vector<llvm::Value *> heap;
+    /* with -fstream, for a result of a tagged sum: the field a round
+       leaves as the hole is filled with a lazy ref instead, its
+       producer running the function on the arguments of the next
+       round from a frame (root closure, arguments). The result is
+       then made as it is matched */
+    llvm::Function *lazy;
+  };
+  /* cells a destination loop allocates at once, at most */
+  size_t chunk;
+  llvm::Value *generateCell(Destination &dest, llvm::StructType *type);
+
+  /* with -fparallel=1, of the arguments of a call those that may be
+     much work, a call of a Func or one marked (par e), run as tasks of
+     the runtime in wrapper/par.c while the others are computed: a
+     thunk closure over the argument is spawned, and joined before the
+     call is made */
+  bool parallel;
+  const ast::Type *Unit;
+  std::map<const ast::Term *, const ast::Abstraction *> thunks;
+
+  /* with -fstream, a tagged sum may be a producer not yet run (tag
+     ESTLC_LAZY), forced by the runtime where it is matched */
+  bool stream;
+
+  /* a Func memo f, (memo body) under its parameters, is the code of
+     its body behind a function looking the arguments up in a table of
+     the runtime (memo.h) first; only a function capturing nothing is,
+     the others are compiled as usual. Arguments are hashed and
+     compared by structure through sums and products, anything else
+     by its ref, which the table keeps alive */
+  size_t memoSize;
+  bool memoShared;
+  std::map<const ast::Type *, llvm::Function *> hashes, equals;
+  void generateMemo(llvm::Function *func, llvm::Function *code, const std::string &name,
+                    const std::vector<const ast::Abstraction *> &params);
+  llvm::Value *generateHash(llvm::Value *ref, const ast::Type *type);
+  llvm::Value *generateEqual(llvm::Value *a, llvm::Value *b, const ast::Type *type);
+  llvm::Function *getHash(const ast::Type *type);
+  llvm::Function *getEqual(const ast::Type *type);
+  llvm::Value *generateField(llvm::Value *ref, const ast::ProductType *product, unsigned i);
 
   Debug<LEVEL_DEBUG> debug;
 public:
   struct Term {
-    llvm::Function *value;
+    llvm::Value *value;
     const ast::Type *type;
   };
   std::map<const ast::Term *, Term> map;
+  /* functions not compiled again for a node reached before */
+  size_t reused;
+  /* functions given a memo table, and the Funcs memo that were not,
+     each with why */
+  size_t memoized;
+  std::vector<std::string> unmemoized;
+  /* how values are laid out, for what else has to agree with it */
+  Layout &getLayout() { return abi; }
 
+  /*
+    Every generate(term) emits straight-line code for the term at the
+    current insert point and returns the resulting ref; only lambdas
+    get a function of their own.
+  */
   Codegen();
-  Term generate(const ast::Term *const term, Env<llvm::APInt> &env);
-  Term generate(const ast::Application *const app, Env<llvm::APInt> &env);
-  Term generate(const ast::Abstraction *const abs, Env<llvm::APInt> &env);
-  Term generate(const ast::Reference *const ref, Env<llvm::APInt> &env);
-  Term generate(const ast::Deproduct *const dep, Env<llvm::APInt> &env);
-  Term generate(const ast::Desum *const des, Env<llvm::APInt> &env);
-  Term generate(const ast::Fixpoint *const fix, Env<llvm::APInt> &env);
+  explicit Codegen(const Options &options);
+  Term generate(const ast::Term *const term, Env<llvm::Value *> &env);
+  Term generate(const ast::Application *const app, Env<llvm::Value *> &env);
+  Term generate(const ast::Abstraction *const abs, Env<llvm::Value *> &env);
+  Term generate(const ast::Reference *const ref, Env<llvm::Value *> &env);
+  Term generate(const ast::Deproduct *const dep, Env<llvm::Value *> &env);
+  Term generate(const ast::Desum *const des, Env<llvm::Value *> &env);
+  Term generate(const ast::Fixpoint *const fix, Env<llvm::Value *> &env);
   Term generate(const ast::SumType *sum, const uint32_t idx);
   Term generate(const ast::ProductType *product);
 
   Term generate(const ast::Program &prog);
+
+  void collectCaptures(const std::set<std::string> &fv, Env<llvm::Value *> &env, Env<llvm::Value *> &env0,
+                       std::vector<std::string> &names, std::vector<const ast::Type *> &types);
+  Shape getShape(const std::set<std::string> &fv, Env<llvm::Value *> &env);
+  void bindCaptures(llvm::Value *frame, const std::vector<std::string> &names, const std::vector<const ast::Type *> &types,
+                    Env<llvm::Value *> &env, Env<llvm::Value *> &env0);
+  bool isHeavy(const ast::Term *term, Env<llvm::Value *> &env);
+  std::vector<Term> generateArgs(const std::vector<const ast::Term *> &args, Env<llvm::Value *> &env);
+  llvm::Value *generateSpawn(const ast::Term *term, Env<llvm::Value *> &env, const ast::Type *&type);
+  Term generateCall(const Known &known, llvm::Value *frame, const std::vector<const ast::Term *> &args, Env<llvm::Value *> &env);
+  size_t generateFields(const ast::Deproduct *dep, const ast::ProductType *type, llvm::Value *product, Env<llvm::Value *> &env);
+
+  bool hasConsCall(const ast::Term *term, const std::string &self, size_t n);
+  void generateDestination(llvm::Function *func, const Known &known, const ast::Abstraction *abs,
+                           const std::vector<const ast::Abstraction *> &params, const ast::Term *body, const ast::Type *type,
+                           const std::vector<std::string> &names, const std::vector<const ast::Type *> &types,
+                           Env<llvm::Value *> &env, Env<llvm::Value *> &env0);
+  const ast::Type *generateTail(const ast::Term *term, Env<llvm::Value *> &env, Destination &dest);
+  bool getSelfCall(const ast::Term *term, Env<llvm::Value *> &env, const Destination &dest, std::vector<const ast::Term *> &args);
+  void generateLoop(Destination &dest, const std::vector<const ast::Term *> &args, llvm::Value *hole, Env<llvm::Value *> &env);
+  llvm::Value *generateLazy(Destination &dest, const std::vector<const ast::Term *> &args, Env<llvm::Value *> &env);
   
-  void generatePush(llvm::Value *const value, llvm::Value *&stack);
-  llvm::LoadInst *generatePop(llvm::Type *type, llvm::Value *&stack);
-  llvm::Value *generateEval(llvm::Value *eval, llvm::Value *stack);
+  llvm::Value *generateFrameSlot(llvm::Value *frame, const unsigned idx);
+  void generateFrameStore(llvm::Value *frame, const unsigned idx, llvm::Value *value);
+  llvm::Value *generateFrameLoad(llvm::Value *frame, const unsigned idx);
+  llvm::Value *generateApply(llvm::Value *clo, llvm::Value *arg);
+  llvm::Value *generateDispatch(const ast::Application *app, llvm::Value *clo, llvm::Value *arg);
+  const std::vector<llvm::Function *> &getCodes(const ast::Term *term);
+  llvm::Function *getCode(const Flow::Closure &clo);
   llvm::Value *generateMalloc(llvm::Type *type);
   llvm::Value *generateMalloc(llvm::Value *size);
-  llvm::Value *generateMemmove(llvm::Value *dst, llvm::Value *src, llvm::Value *n);
   llvm::Value *generatePrintf(const char *const fmt, llvm::Value *val);
-  llvm::Value *generateClosure(llvm::Value *func, llvm::Value *stack);
-  llvm::Value *generateLoad(llvm::Type *type, llvm::Value *ptr);
-  llvm::Value *generateSum(llvm::Value *idx, llvm::Value *ref);
+  llvm::Value *generateClosure(llvm::Value *func, const std::vector<llvm::Value *> &values);
+  llvm::Constant *generateClosure(llvm::Function *func);
+  llvm::Value *generateSum(const ast::SumType *sum, llvm::Value *idx, llvm::Value *ref);
+  llvm::Constant *generateConstant(const ast::SumType *sum, const uint32_t idx);
+  std::pair<llvm::Value *, llvm::Value *> generateDesum(const ast::SumType *sum, llvm::Value *value);
+  llvm::Value *generateToRef(llvm::Value *value, const ast::Type *type);
+  llvm::Value *generateFromRef(llvm::Value *ref, const ast::Type *type);
 
   std::pair<llvm::Value *, llvm::Value *> generateDeclosure(llvm::Value *clo);
   Term generatePrimitive(const std::string &prim);
+  Term generateOperator(const std::string &prim, llvm::Value *x, llvm::Value *y);
+  bool isOperator(const std::string &name, Env<llvm::Value *> &env);
+  Term generateVector(const std::string &op);
+  Term generateExtern(const std::string &name, const ast::Type *type, const std::string &symbol);
+  llvm::Value *generateExternCall(const std::string &name, const std::vector<llvm::Value *> &args);
+  bool isExtern(const std::string &name, size_t n, Env<llvm::Value *> &env);
+  bool getKernel(const std::string &name, const ast::Term *func, Env<llvm::Value *> &env,
+                 unsigned &code, const ast::Term *&x);
+  llvm::Value *generateKernelCall(const std::string &name, unsigned code, llvm::Value *x, llvm::Value *vec);
+  bool isGlobal(const std::string &name, llvm::Value *value, Env<llvm::Value *> &env);
   llvm::Function *generateBinary(llvm::Function *f0);
 
+  /* identical code folding, once the program is generated: functions
+     and constant closures the same but for their name are made one.
+     Returns how many functions went away */
+  size_t fold();
   void dump();
 };
 
@@ -0,0 +1,79 @@
+#ifndef _DEFOREST_HPP_
+#define _DEFOREST_HPP_
+
+#include <map>
+#include <set>
+#include <list>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ast.hpp>
+
+#include "options.hpp"
+#include "report.hpp"
+
+/*
+  Fuses list traversals so that the lists between them are never
+  built. A traversal is a Func matching on one of its parameters right
+  away, recursing only on fields of what it matched, and passing its
+  other parameters along unchanged.
+  - A traversal F consuming what a traversal G produces, F (G ...),
+    becomes one function F@G: the cases of F are pushed into each
+    result of G, so where G would build a constructor F takes it apart
+    at once, and where G calls itself F@G does.
+  - Two traversals of the same list in the same scope, as the two
+    filters of qsort, become one function G1&G2 going over the list
+    once and returning both results in a pair.
+*/
+class Deforester {
+  struct Traversal {
+    std::string name; //as bound by the let
+    const ast::Abstraction *abs; //calls itself abs->arg
+    std::vector<const ast::Abstraction *> params;
+    size_t k; //the parameter matched on
+    const ast::SumType *sum;
+    const ast::Desum *body;
+    const ast::Type *result;
+  };
+  typedef std::map<std::string, const Traversal *> Traversals;
+  typedef std::set<std::string> Locals;
+
+  /* a call of a traversal with all its arguments */
+  struct Call {
+    const ast::Term *term;
+    const Traversal *t;
+    std::vector<const ast::Term *> args;
+  };
+
+  const Options &options;
+  Report &report;
+  std::map<const std::string, const ast::Type *> types;
+  std::map<std::string, std::pair<const ast::SumType *, size_t> > constructors;
+  std::map<std::string, const ast::ProductType *> products;
+  std::set<std::string> globals;
+  std::list<Traversal> traversals;
+  unsigned fresh;
+
+  std::string getFresh(const std::string &prefix);
+  bool getTraversal(const std::string &name, const ast::Fixpoint *fix, Traversal &t);
+  bool getCall(const ast::Term *term, const Traversals &ts, Call &call);
+  const ast::Term *replaceCalls(const ast::Term *term, const Traversal &t, const std::string &field,
+                                const std::vector<std::string> &statics, const std::string &name,
+                                bool strict, Locals bound);
+  bool isClosed(const ast::Term *term, const Locals &locals, const std::set<std::string> &allowed);
+
+  const ast::Term *transform(const ast::Term *term, Traversals ts, const Locals &locals);
+  const ast::Term *transformBody(const ast::Term *term, const Traversals &ts, const Locals &locals);
+  const ast::Term *transformLet(const ast::Application *app, Traversals ts, const Locals &locals);
+
+  const ast::Term *fuse(const Call &consumer, const Call &producer, const Locals &locals);
+  const ast::Term *push(const ast::Term *term, const Traversal &f, const Traversal &g, const std::string &name,
+                        const std::vector<std::string> &statics, Locals bound);
+  const ast::Term *tuple(const ast::Term *body, const Call &c1, const Call &c2, const Locals &locals);
+  void collectCalls(const ast::Term *term, const Traversals &ts, Locals bound, std::vector<Call> &calls);
+public:
+  Deforester(const Options &options, Report &report);
+  const ast::Program *run(const ast::Program &prog);
+};
+
+#endif
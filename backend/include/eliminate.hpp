@@ -0,0 +1,47 @@
+#ifndef _ELIMINATE_HPP_
+#define _ELIMINATE_HPP_
+
+#include <set>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <ast.hpp>
+
+#include "analysis.hpp"
+#include "options.hpp"
+#include "report.hpp"
+
+/*
+  Common subexpression elimination. In the body of each binder, an
+  application computed more than once on some path is computed once,
+  bound to a fresh name right at the start of the body. Subterms are
+  told apart by a key naming each variable by what binds it, so two
+  occurrences seeing different bindings of a name never meet.
+*/
+class Eliminator {
+  typedef std::set<std::string> Locals;
+
+  /* the occurrences of one subterm in a body, and how many of them
+     one run of the body evaluates at least */
+  struct Group {
+    size_t count;
+    std::vector<const ast::Term *> terms;
+  };
+  typedef std::unordered_map<std::string, Group> Groups;
+
+  const Options &options;
+  Report &report;
+  unsigned fresh;
+  size_t shared;
+
+  std::string getKey(const ast::Term *term, std::vector<std::string> &inner);
+  void collect(const ast::Term *term, Locals bound, Groups &groups);
+
+  const ast::Term *transform(const ast::Term *term, const Scope &scope);
+  const ast::Term *transformBody(const ast::Term *term, const Scope &scope);
+public:
+  Eliminator(const Options &options, Report &report);
+  const ast::Program *run(const ast::Program &prog);
+};
+
+#endif
@@ -6,35 +6,31 @@
 #include <exception>
 #include <debug.hpp>
 
-template<typename ptr_t>
+template<typename value_t>
 class Env {
 public:
   class NotFound : public std::exception {};
-  Env(const ptr_t &base);
-  ptr_t push(const std::string &name, const ast::Type *const type, const ptr_t &size);
-  std::tuple<const std::string, const ast::Type *, const ptr_t> pop();
-  std::pair<const ptr_t , const ast::Type *> find(const std::string &name);
-  ptr_t size();
+  Env();
+  void push(const std::string &name, const ast::Type *const type, const value_t &value);
+  std::tuple<const std::string, const ast::Type *, const value_t> pop();
+  std::pair<const value_t, const ast::Type *> find(const std::string &name);
+  size_t size();
 private:
   Debug<LEVEL_DEBUG> debug;
-  std::vector<std::tuple<const std::string, const ast::Type *, const ptr_t> > stack_;
-  ptr_t size_;
+  std::vector<std::tuple<const std::string, const ast::Type *, const value_t> > stack_;
 };
 
-template<typename ptr_t>
-Env<ptr_t>::Env(const ptr_t &base)
-  :size_(base) {}
+template<typename value_t>
+Env<value_t>::Env() {}
    
-template<typename ptr_t>
-ptr_t Env<ptr_t>::push(const std::string &name, const ast::Type *type, const ptr_t &size) {
+template<typename value_t>
+void Env<value_t>::push(const std::string &name, const ast::Type *type, const value_t &value) {
   debug << this << " push(" << name << ", " << type->to_string() << ")\n";
-  stack_.push_back(std::make_tuple(name, type, size));
-  size_ += size;
-  return size_;
+  stack_.push_back(std::make_tuple(name, type, value));
 }
 
-template<typename ptr_t>
-std::tuple<const std::string, const ast::Type *, const ptr_t> Env<ptr_t>::pop() {
+template<typename value_t>
+std::tuple<const std::string, const ast::Type *, const value_t> Env<value_t>::pop() {
   auto ret = stack_.back();
   debug << this << " pop(" << std::get<0>(ret) << ", " << std::get<1>(ret)->to_string() << ")\n";
 
@@ -42,18 +38,16 @@ std::tuple<const std::string, const ast::Type *, const ptr_t> Env<ptr_t>::pop()
   return ret;
 }
 
-template<typename ptr_t>
-std::pair<const ptr_t, const ast::Type *> Env<ptr_t>::find(const std::string &name) {
-  ptr_t size = size_;
+template<typename value_t>
+std::pair<const value_t, const ast::Type *> Env<value_t>::find(const std::string &name) {
   for (auto i = stack_.rbegin(); i != stack_.rend(); ++i) {
-    size -= std::get<2>(*i);
     if (std::get<0>(*i) == name)
-      return std::make_pair(size, std::get<1>(*i));
+      return std::make_pair(std::get<2>(*i), std::get<1>(*i));
   }
   throw NotFound();
 }
 
-template<typename ptr_t>
-ptr_t Env<ptr_t>::size() {
-  return size_;
+template<typename value_t>
+size_t Env<value_t>::size() {
+  return stack_.size();
 }
@@ -38,3 +38,22 @@ public:
   TypeException(const ast::Type *type);
   const ast::Type *type_;
 };
+
+class PrimitiveException : public std::exception {
+public:
+  PrimitiveException(const std::string &prim);
+  const std::string prim_;
+};
+
+class ExternException : public std::exception {
+public:
+  ExternException(const std::string &name, const std::string &symbol);
+  const std::string name_;
+  const std::string symbol_;
+};
+
+class OptionException : public std::exception {
+public:
+  OptionException(const std::string &option);
+  const std::string option_;
+};
@@ -0,0 +1,58 @@
+#ifndef _FLOW_HPP_
+#define _FLOW_HPP_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ast.hpp>
+
+/*
+  Whole program control flow analysis (0-CFA): which closures may
+  flow to each application site. A closure is known by the term that
+  made it, or by the global it is, and by how many arguments it has
+  taken since.
+*/
+class Flow {
+public:
+  struct Closure {
+    const ast::Term *term; //Abstraction or Fixpoint, NULL for a global
+    std::string name; //the global
+    unsigned stage;
+    bool operator<(const Closure &b) const;
+  };
+
+  struct Set {
+    std::set<Closure> closures;
+    bool top; //anything at all, e.g. out of a data structure
+    Set();
+  };
+
+  /* globals maps every global to the number of arguments it takes */
+  Flow(const ast::Term *term, const std::map<std::string, unsigned> &globals);
+
+  /* closures that may be applied at this site */
+  Set callees(const ast::Application *app) const;
+  /* the parameters of a fixpoint, one per stage */
+  static std::vector<const ast::Abstraction *> getParams(const ast::Fixpoint *fix);
+
+private:
+  typedef std::pair<const ast::Term *, std::string> Binder;
+  typedef std::map<std::string, Binder> Scope;
+
+  std::map<std::string, unsigned> globals;
+  std::map<Binder, Set> store;
+  std::map<const ast::Term *, Set> results;
+  std::map<const ast::Application *, Set> sites;
+  std::set<Closure> escaped;
+  bool changed;
+
+  static void merge(Set &dst, const Set &src);
+  void join(Set &dst, const Set &src);
+  Set analyze(const ast::Term *term, Scope &scope);
+  Set apply(const Set &func, const Set &arg);
+  void escape(const Set &set);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _LAYOUT_HPP_
+#define _LAYOUT_HPP_
+
+#include <map>
+#include <string>
+#include <ast.hpp>
+
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/LLVMContext.h>
+
+#include "abi.h"
+
+/*
+  Decides how values of each ast::Type are represented in memory. The
+  constants it relies on live in abi.h so the C side can follow.
+*/
+class Layout {
+  llvm::LLVMContext &context;
+  const llvm::DataLayout &layout;
+  llvm::PointerType *refType;
+
+  std::map<const ast::SumType *, bool> tagged;
+  std::map<const ast::ProductType *, llvm::StructType *> products;
+public:
+  static const unsigned tagBits = ESTLC_TAG_BITS;
+
+  Layout(llvm::LLVMContext &context, const llvm::DataLayout &layout);
+
+  /* width in bits of a primitive stored unboxed, 0 if it is a ref */
+  unsigned getPrimitiveWidth(const ast::Type *type) const;
+  /* the type a field of this type has inside a product */
+  llvm::Type *getFieldType(const ast::Type *type) const;
+  llvm::StructType *getProductType(const ast::ProductType *product);
+
+  /* whether a value of this type, as a ref, is aligned so that its
+     low bits are free */
+  bool isAligned(const ast::Type *type);
+  bool isTagged(const ast::SumType *sum);
+};
+
+#endif
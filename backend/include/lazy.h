@@ -0,0 +1,27 @@
+#ifndef _LAZY_H_
+#define _LAZY_H_
+
+/*
+  A value of a small sum not made yet. Its ref is the cell tagged
+  ESTLC_LAZY; code compiled with -fstream=1 forces it where it is
+  matched, so a list can be read as the program walks it and dropped
+  behind it. Keep this header plain C.
+*/
+
+#include <stdatomic.h>
+
+struct estlc_lazy {
+  /* 0 not run, 1 running, 2 done */
+  atomic_int state;
+  void *value;
+  /* makes the value from env, may return more lazy refs inside it */
+  void *(*produce)(void *env);
+  void *env;
+};
+
+/* a lazy ref, tagged, for the producer applied to env */
+void *estlc_lazy(void *(*produce)(void *env), void *env);
+/* the value behind a lazy ref, produced on the first call */
+void *estlc_force(void *ref);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+/*
+  The tables of Func memo f: the results of f by its arguments, kept
+  in the collected heap so the arguments stay alive as keys. The code
+  of f hashes the arguments and gives how to compare them; a table of
+  size 0 grows without bound, any other drops the entry least recently
+  used past size. A shared table is one for all threads under a lock,
+  otherwise each thread has its own. Keep this header plain C.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* whether two rows of arguments are the same, structurally */
+typedef int (*estlc_memo_equal)(void *const *a, void *const *b);
+
+/* the table of slot, made on first use; slot is a global of the
+   program, NULL at start */
+void *estlc_memo_table(void **slot, const char *name, unsigned arity, estlc_memo_equal equal,
+                       uint64_t size, int shared);
+/* 1 and the result into value if args are in the table, else 0 */
+int estlc_memo_get(void *table, uint64_t hash, void *const *args, void **value);
+/* copies args, keeps value for them */
+void estlc_memo_put(void *table, uint64_t hash, void *const *args, void *value);
+
+/* hits and misses of each table used so far, one line each */
+void estlc_memo_report(FILE *f);
+
+#endif
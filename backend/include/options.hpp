@@ -0,0 +1,41 @@
+#ifndef _OPTIONS_HPP_
+#define _OPTIONS_HPP_
+
+#include <string>
+
+/* knobs of the backend passes, set from the command line */
+struct Options {
+  /* largest function body, in terms, that may be cloned by
+     specialization; 0 turns specialization off */
+  size_t specializeLimit;
+  /* how many terms the simplifier may add to the program by inlining
+     non-recursive functions */
+  size_t simplifyBudget;
+  /* whether list traversals are fused */
+  bool deforest;
+  /* whether repeated subterms are computed once */
+  bool cse;
+  /* whether generated functions with the same body are made one */
+  bool fold;
+  /* whether independent calls are spawned to the work-stealing pool */
+  bool parallel;
+  /* whether a matched list may still have to be read, see lazy.h */
+  bool stream;
+  /* most cells a list loop allocates at once, below 2 one at a time */
+  size_t chunk;
+  /* entries a Func memo keeps, dropping the least recently used
+     past it; 0 keeps them all */
+  size_t memoSize;
+  /* whether the table of a Func memo is one for all threads rather
+     than one per thread */
+  bool memoShared;
+  /* where to write the C header for the types of the program, none
+     when empty */
+  std::string header;
+
+  Options();
+  /* takes -fname=value flags, throws OptionException on anything else */
+  void parse(int argc, char **argv);
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _PAR_H_
+#define _PAR_H_
+
+/*
+  Fork-join runtime of -fparallel=1 code. A spawned task is a closure
+  taking unit; it may run on any worker until it is joined, joining
+  returns what it returned. Keep this header plain C.
+*/
+
+/* starts the pool, 0 workers is one per core; the calling thread is
+   worker 0 */
+void estlc_par_init(unsigned workers);
+/* stops and waits for the other workers */
+void estlc_par_exit(void);
+
+void *estlc_spawn(void *clo);
+void *estlc_join(void *task);
+
+#endif
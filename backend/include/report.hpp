@@ -0,0 +1,17 @@
+#ifndef _REPORT_HPP_
+#define _REPORT_HPP_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+
+/* what the passes did to the program, printed once it is compiled */
+class Report {
+  std::vector<std::pair<std::string, std::string> > lines;
+public:
+  void add(const std::string &pass, const std::string &line);
+  void print(std::ostream &os) const;
+};
+
+#endif
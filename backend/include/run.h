@@ -0,0 +1,20 @@
+#ifndef _RUN_H_
+#define _RUN_H_
+
+/*
+  Calling a compiled program from C. umain only reads constant
+  globals, so any number of threads may run it at once; each thread
+  allocates from its own free lists in the collector, which has to
+  know the thread. Keep this header plain C.
+*/
+
+extern void *umain(void *arg);
+
+/* call once from the main thread, before any other thread runs code */
+void estlc_init(void);
+/* a thread not started through pthread_create with gc.h included
+   registers itself before calling umain, and leaves when done */
+void estlc_thread_enter(void);
+void estlc_thread_leave(void);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _SIMPLIFY_HPP_
+#define _SIMPLIFY_HPP_
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <ast.hpp>
+
+#include "options.hpp"
+#include "report.hpp"
+
+/*
+  Rewrites the redexes the frontend leaves behind, until none is left:
+  - a lambda applied right away takes its argument in, when that does
+    not duplicate any work;
+  - a non-recursive Func is inlined where it is used, as long as the
+    program does not grow by more than the budget;
+  - a match on a constructor takes its case;
+  - a Deproduct of a product being built binds the fields directly;
+  - a primitive applied to two literals is computed.
+*/
+class Simplifier {
+  typedef std::set<std::string> Locals;
+
+  const Options &options;
+  Report &report;
+
+  /* the sum built by each constructor, and its index there */
+  std::map<std::string, std::pair<const ast::SumType *, size_t> > constructors;
+  std::map<std::string, const ast::ProductType *> products;
+
+  size_t budget;
+  std::map<std::string, size_t> rewrites;
+
+  const ast::Term *simplify(const ast::Term *term, const Locals &locals);
+  const ast::Term *simplifyApplication(const ast::Application *app, const Locals &locals);
+  const ast::Term *simplifyDesum(const ast::Desum *des, const Locals &locals);
+  const ast::Term *simplifyDeproduct(const ast::Deproduct *dep, const Locals &locals);
+  ast::Reference *fold(const std::string &prim, int x, int y, const Locals &locals);
+  bool isGlobal(const std::string &name, const Locals &locals);
+  void count(const std::string &rule);
+public:
+  Simplifier(const Options &options, Report &report);
+  const ast::Program *run(const ast::Program &prog);
+};
+
+#endif
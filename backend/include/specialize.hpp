@@ -0,0 +1,73 @@
+#ifndef _SPECIALIZE_HPP_
+#define _SPECIALIZE_HPP_
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <ast.hpp>
+
+#include "analysis.hpp"
+#include "options.hpp"
+#include "report.hpp"
+
+/*
+  Clones a let-bound fixpoint for the function arguments it is called
+  with. A parameter that every recursive call passes along unchanged
+  is static; when a call site gives it an operator section like
+  (< x), a partially applied constructor or a lambda, the clone has
+  that argument in place and takes what it captured (x, or the free
+  variables of the lambda) as extra parameters instead of a closure.
+*/
+class Specializer {
+  /* a function argument with its dynamic parts taken out */
+  struct Template {
+    std::string key, desc;
+    /* passed by the call site, in the order of the extra parameters */
+    std::vector<const ast::Term *> dynamics;
+    std::vector<const ast::Type *> types;
+    /* the argument over the extra parameters */
+    const ast::Term *term;
+  };
+
+  struct Clone {
+    std::string name; //empty if it could not be made
+    const ast::Type *type;
+    const ast::Term *term;
+  };
+
+  struct Function {
+    std::string name; //as bound by the let
+    const ast::Abstraction *abs;
+    std::vector<const ast::Abstraction *> params;
+    std::vector<bool> statics;
+    std::map<std::string, Clone> clones;
+    std::vector<std::string> order; //keys of clones, as they were made
+  };
+
+  struct Binding {
+    const ast::Type *type; //NULL if not known
+    bool global;
+    Function *func; //a let-bound fixpoint, NULL otherwise
+  };
+  typedef std::map<std::string, Binding> Bindings;
+
+  const Options &options;
+  Report &report;
+  std::list<Function> functions;
+
+  static Scope getScope(const Bindings &bindings);
+  const ast::Term *transform(const ast::Term *term, Bindings &bindings);
+  const ast::Term *transformLet(const ast::Application *app, Bindings &bindings);
+  const ast::Term *transformCall(const ast::Application *app, Bindings &bindings);
+  bool getTemplate(const ast::Term *arg, const std::string &prefix, Bindings &bindings, Template &t);
+  const Clone &getClone(Function &func, const size_t i, const Template &t);
+  const ast::Term *rewriteCalls(const ast::Term *term, const std::string *name, const std::string *param,
+                                const std::string &clone, const size_t n, const size_t i,
+                                const std::vector<std::string> &extras);
+public:
+  Specializer(const Options &options, Report &report);
+  const ast::Program *run(const ast::Program &prog);
+};
+
+#endif
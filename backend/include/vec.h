@@ -0,0 +1,47 @@
+#ifndef _VEC_H_
+#define _VEC_H_
+
+/*
+  The built-in persistent vector of Ints, type Vec: a relaxed radix
+  balanced tree, each operation a new vector sharing all it can with
+  the old one. vempty is the NULL ref. Indices are from 0; one out of
+  range stops the program. Keep this header plain C.
+*/
+
+#include <abi.h>
+
+/* children of a node, elements of a leaf */
+#define ESTLC_VEC_BITS 5
+#define ESTLC_VEC_WIDTH (1 << ESTLC_VEC_BITS)
+
+struct estlc_vec {
+  estlc_int len;
+  /* the height of the root, in ESTLC_VEC_BITS; 0 is a leaf */
+  unsigned shift;
+  void *root;
+};
+
+estlc_int estlc_vlen(struct estlc_vec *v);
+estlc_int estlc_vget(struct estlc_vec *v, estlc_int i);
+struct estlc_vec *estlc_vset(struct estlc_vec *v, estlc_int i, estlc_int x);
+struct estlc_vec *estlc_vpush(struct estlc_vec *v, estlc_int x);
+struct estlc_vec *estlc_vconcat(struct estlc_vec *a, struct estlc_vec *b);
+/* the elements from i up to j, j excluded */
+struct estlc_vec *estlc_vslice(struct estlc_vec *v, estlc_int i, estlc_int j);
+
+/* the elements y for which the closure gives true, and the closure
+   applied to each element */
+struct estlc_vec *estlc_vfilter(void *clo, struct estlc_vec *v);
+struct estlc_vec *estlc_vmap(void *clo, struct estlc_vec *v);
+struct estlc_vec *estlc_vsort(struct estlc_vec *v);
+
+/* the same for the closure a section (op x) of a primitive, y going
+   to (op x y); these run the vector kernels of the CPU */
+enum estlc_vec_op {
+  ESTLC_VEC_LT, ESTLC_VEC_GT, ESTLC_VEC_LE, ESTLC_VEC_GE, ESTLC_VEC_EQ, ESTLC_VEC_NE,
+  ESTLC_VEC_ADD, ESTLC_VEC_SUB
+};
+struct estlc_vec *estlc_vfilter_op(unsigned op, estlc_int x, struct estlc_vec *v);
+struct estlc_vec *estlc_vmap_op(unsigned op, estlc_int x, struct estlc_vec *v);
+
+#endif
@@ -0,0 +1,369 @@
+#include "analysis.hpp"
+#include "exception.hpp"
+
+#include <stdexcept>
+
+const std::vector<std::string> primitives = {"<", ">", "<=", ">=", "=", "==", "<>", "+", "-", "*", "/", "unit"};
+const std::vector<std::string> vectorOps = {"vempty", "vlen", "vget", "vset", "vpush", "vconcat", "vslice",
+                                              "vfilter", "vmap", "vsort"};
+
+const ast::Type *vectorType(const std::string &op, const ast::Type *Bool) {
+  static const ast::Type *Int = new ast::PrimitiveType("Int");
+  static const ast::Type *Vec = new ast::PrimitiveType("Vec");
+  auto arrow = [](const ast::Type *left, const ast::Type *right) {
+    return new ast::FunctionType(left, right);
+  };
+  if (op == "vempty")
+    return Vec;
+  else if (op == "vlen")
+    return arrow(Vec, Int);
+  else if (op == "vget")
+    return arrow(Vec, arrow(Int, Int));
+  else if (op == "vset")
+    return arrow(Vec, arrow(Int, arrow(Int, Vec)));
+  else if (op == "vpush")
+    return arrow(Vec, arrow(Int, Vec));
+  else if (op == "vconcat")
+    return arrow(Vec, arrow(Vec, Vec));
+  else if (op == "vslice")
+    return arrow(Vec, arrow(Int, arrow(Int, Vec)));
+  else if (op == "vfilter")
+    return Bool == NULL ? NULL : arrow(arrow(Int, Bool), arrow(Vec, Vec));
+  else if (op == "vmap")
+    return arrow(arrow(Int, Int), arrow(Vec, Vec));
+  else if (op == "vsort")
+    return arrow(Vec, Vec);
+  throw PrimitiveException(op);
+}
+
+const ast::Term *getPar(const ast::Term *term) {
+  auto app = dynamic_cast<const ast::Application *>(term);
+  auto ref = app == NULL ? NULL : dynamic_cast<const ast::Reference *>(app->func);
+  return ref != NULL && ref->name == "par" ? app->arg : NULL;
+}
+
+const ast::Term *getMemo(const ast::Term *term) {
+  auto app = dynamic_cast<const ast::Application *>(term);
+  auto ref = app == NULL ? NULL : dynamic_cast<const ast::Reference *>(app->func);
+  return ref != NULL && ref->name == "memo" ? app->arg : NULL;
+}
+
+bool isMemo(const ast::Fixpoint *fix) {
+  auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+  if (abs == NULL)
+    return false;
+  const ast::Term *body = abs->term;
+  while (auto abs0 = dynamic_cast<const ast::Abstraction *>(body))
+    body = abs0->term;
+  return getMemo(body) != NULL;
+}
+
+bool isLiteral(const std::string &name, int &num) {
+  size_t idx;
+  try {
+    num = std::stoi(name, &idx, 10);
+  } catch (std::invalid_argument e) {
+    return false;
+  }
+  return idx == name.size();
+}
+
+static void freeVariables(const ast::Term *term, std::set<std::string> &bound, std::set<std::string> &fv);
+
+static void freeVariables(const ast::Term *term, const std::string &name, std::set<std::string> &bound, std::set<std::string> &fv) {
+  //bind name while looking at term
+  bool fresh = bound.insert(name).second;
+  freeVariables(term, bound, fv);
+  if (fresh)
+    bound.erase(name);
+}
+
+static void freeVariables(const ast::Term *term, std::set<std::string> &bound, std::set<std::string> &fv) {
+  int num;
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (!isLiteral(ref->name, num) && ref->name != "par" && ref->name != "memo" && bound.find(ref->name) == bound.end())
+      fv.insert(ref->name);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    freeVariables(abs->term, abs->arg, bound, fv);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    freeVariables(app->func, bound, fv);
+    freeVariables(app->arg, bound, fv);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    freeVariables(des->sum, bound, fv);
+    for (auto pair : des->cases)
+      freeVariables(pair.second, pair.first, bound, fv);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    freeVariables(dep->product, bound, fv);
+    std::set<std::string> bound0(bound);
+    bound0.insert(dep->names.begin(), dep->names.end());
+    freeVariables(dep->term, bound0, fv);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    freeVariables(fix->term, bound, fv);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+std::set<std::string> freeVariables(const ast::Term *term) {
+  std::set<std::string> bound, fv;
+  freeVariables(term, bound, fv);
+  return fv;
+}
+
+Scope globalTypes(const ast::Program &prog) {
+  //the same bindings Codegen makes before the program term
+  Scope scope;
+  for (auto pair : prog.types) {
+    if (auto sum = dynamic_cast<const ast::SumType *>(pair.second)) {
+      for (auto pair0 : sum->types) {
+        auto payload = pair0.first;
+        if (auto product = dynamic_cast<const ast::ProductType *>(payload)) {
+          const ast::Type *type = product;
+          for (auto it = product->types.rbegin(); it != product->types.rend(); ++it)
+            type = new ast::FunctionType(*it, type);
+          scope[product->cons] = type;
+        }
+        auto prim = dynamic_cast<const ast::PrimitiveType *>(payload);
+        if (prim != NULL && (prim->name == "unit" || prim->name == "Unit"))
+          scope[pair0.second] = sum;
+        else
+          scope[pair0.second] = new ast::FunctionType(payload, sum);
+      }
+    } else if (auto product = dynamic_cast<const ast::ProductType *>(pair.second)) {
+      const ast::Type *type = product;
+      for (auto it = product->types.rbegin(); it != product->types.rend(); ++it)
+        type = new ast::FunctionType(*it, type);
+      scope[product->cons] = type;
+    }
+  }
+
+  const ast::Type *Int = new ast::PrimitiveType("Int");
+  auto it = prog.types.find("bool");
+  const ast::Type *Bool = it == prog.types.end() ? NULL : it->second;
+  for (auto prim : primitives) {
+    if (prim == "unit")
+      scope[prim] = new ast::PrimitiveType("unit");
+    else if (prim == "+" || prim == "-" || prim == "*" || prim == "/")
+      scope[prim] = new ast::FunctionType(Int, new ast::FunctionType(Int, Int));
+    else if (Bool != NULL)
+      scope[prim] = new ast::FunctionType(Int, new ast::FunctionType(Int, Bool));
+  }
+  for (auto op : vectorOps)
+    if (auto type = vectorType(op, Bool))
+      scope[op] = type;
+  for (auto pair : prog.externs)
+    scope[pair.first] = pair.second.type;
+  return scope;
+}
+
+const ast::Type *typeOf(const ast::Term *term, const Scope &scope) {
+  static const ast::Type *Int = new ast::PrimitiveType("Int");
+  int num;
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (isLiteral(ref->name, num))
+      return Int;
+    auto it = scope.find(ref->name);
+    return it == scope.end() ? NULL : it->second;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    Scope scope0(scope);
+    scope0[abs->arg] = abs->type;
+    const ast::Type *type = typeOf(abs->term, scope0);
+    return type == NULL ? NULL : new ast::FunctionType(abs->type, type);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    if (auto arg = getPar(app))
+      return typeOf(arg, scope);
+    if (auto body = getMemo(app))
+      return typeOf(body, scope);
+    auto type = dynamic_cast<const ast::FunctionType *>(typeOf(app->func, scope));
+    return type == NULL ? NULL : type->right;
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto type = dynamic_cast<const ast::SumType *>(typeOf(des->sum, scope));
+    if (type == NULL || des->cases.empty() || type->types.size() != des->cases.size())
+      return NULL;
+    Scope scope0(scope);
+    scope0[des->cases[0].first] = type->types[0].first;
+    return typeOf(des->cases[0].second, scope0);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto type = dynamic_cast<const ast::ProductType *>(typeOf(dep->product, scope));
+    if (type == NULL || type->types.size() != dep->names.size())
+      return NULL;
+    Scope scope0(scope);
+    for (size_t i = 0; i < dep->names.size(); ++i)
+      scope0[dep->names[i]] = type->types[i];
+    return typeOf(dep->term, scope0);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+    return abs == NULL ? NULL : abs->type;
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+static size_t countUses(const ast::Term *term, const std::string &name, bool lambda, bool &under) {
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (ref->name != name)
+      return 0;
+    under = under || lambda;
+    return 1;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    return abs->arg == name ? 0 : countUses(abs->term, name, true, under);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    return countUses(app->func, name, lambda, under) + countUses(app->arg, name, lambda, under);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    size_t n = countUses(des->sum, name, lambda, under);
+    for (auto pair : des->cases)
+      if (pair.first != name)
+        n += countUses(pair.second, name, lambda, under);
+    return n;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    size_t n = countUses(dep->product, name, lambda, under);
+    for (auto arg : dep->names)
+      if (arg == name)
+        return n;
+    return n + countUses(dep->term, name, lambda, under);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    return countUses(fix->term, name, true, under);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+size_t countUses(const ast::Term *term, const std::string &name, bool &under) {
+  under = false;
+  return countUses(term, name, false, under);
+}
+
+bool equalTerms(const ast::Term *a, const ast::Term *b) {
+  if (a == b)
+    return true;
+  if (typeid(*a) != typeid(*b))
+    return false;
+  if (auto ref = dynamic_cast<const ast::Reference *>(a)) {
+    return ref->name == static_cast<const ast::Reference *>(b)->name;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(a)) {
+    auto abs0 = static_cast<const ast::Abstraction *>(b);
+    return abs->arg == abs0->arg && *abs->type == *abs0->type && equalTerms(abs->term, abs0->term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(a)) {
+    auto app0 = static_cast<const ast::Application *>(b);
+    return equalTerms(app->func, app0->func) && equalTerms(app->arg, app0->arg);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(a)) {
+    auto des0 = static_cast<const ast::Desum *>(b);
+    if (des->cases.size() != des0->cases.size() || !equalTerms(des->sum, des0->sum))
+      return false;
+    for (size_t i = 0; i < des->cases.size(); ++i)
+      if (des->cases[i].first != des0->cases[i].first || !equalTerms(des->cases[i].second, des0->cases[i].second))
+        return false;
+    return true;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(a)) {
+    auto dep0 = static_cast<const ast::Deproduct *>(b);
+    return dep->names == dep0->names && equalTerms(dep->product, dep0->product) && equalTerms(dep->term, dep0->term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(a)) {
+    return equalTerms(fix->term, static_cast<const ast::Fixpoint *>(b)->term);
+  } else
+    throw TermNotMatch(a, typeid(ast::Term));
+}
+
+size_t termSize(const ast::Term *term) {
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(term))
+    return 1 + termSize(abs->term);
+  else if (auto app = dynamic_cast<const ast::Application *>(term))
+    return 1 + termSize(app->func) + termSize(app->arg);
+  else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    size_t n = 1 + termSize(des->sum);
+    for (auto pair : des->cases)
+      n += termSize(pair.second);
+    return n;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term))
+    return 1 + termSize(dep->product) + termSize(dep->term);
+  else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term))
+    return 1 + termSize(fix->term);
+  return 1;
+}
+
+static const std::string *shadow(const std::string *name, const std::string &arg) {
+  return name != NULL && *name == arg ? NULL : name;
+}
+
+static const ast::Term *substitute(const ast::Term *term, const std::string *name, const ast::Term *value,
+                                   const std::set<std::string> &fv) {
+  //name is NULL once it is shadowed, the rest is only copied
+  auto captures = [&](const std::string &arg, const std::string *name0, const ast::Term *body) {
+    //only a problem if the substitution actually happens below
+    return name0 != NULL && fv.count(arg) && freeVariables(body).count(*name0);
+  };
+
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (name != NULL && ref->name == *name)
+      return copyTerm(value);
+    return at(new ast::Reference(ref->name), term);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    const std::string *name0 = shadow(name, abs->arg);
+    if (captures(abs->arg, name0, abs->term))
+      return NULL;
+    auto body = substitute(abs->term, name0, value, fv);
+    return body == NULL ? NULL : at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    auto func = substitute(app->func, name, value, fv);
+    auto arg = substitute(app->arg, name, value, fv);
+    return func == NULL || arg == NULL ? NULL : at(new ast::Application(func, arg), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto sum = substitute(des->sum, name, value, fv);
+    if (sum == NULL)
+      return NULL;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      const std::string *name0 = shadow(name, pair.first);
+      if (captures(pair.first, name0, pair.second))
+        return NULL;
+      auto term0 = substitute(pair.second, name0, value, fv);
+      if (term0 == NULL)
+        return NULL;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return at(new ast::Desum(sum, cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto product = substitute(dep->product, name, value, fv);
+    if (product == NULL)
+      return NULL;
+    const std::string *name0 = name;
+    for (auto arg : dep->names)
+      name0 = shadow(name0, arg);
+    for (auto arg : dep->names)
+      if (captures(arg, name0, dep->term))
+        return NULL;
+    auto body = substitute(dep->term, name0, value, fv);
+    return body == NULL ? NULL : at(new ast::Deproduct(product, dep->names, body), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = substitute(fix->term, name, value, fv);
+    return body == NULL ? NULL : at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *copyTerm(const ast::Term *term) {
+  return substitute(term, NULL, NULL, std::set<std::string>());
+}
+
+const ast::Term *substitute(const ast::Term *term, const std::string &name, const ast::Term *value) {
+  return substitute(term, &name, value, freeVariables(value));
+}
+
+const ast::Term *replaceNodes(const ast::Term *term, const std::map<const ast::Term *, std::string> &nodes) {
+  auto it = nodes.find(term);
+  if (it != nodes.end())
+    return at(new ast::Reference(it->second), term);
+  if (dynamic_cast<const ast::Reference *>(term)) {
+    return copyTerm(term);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    return at(new ast::Abstraction(abs->arg, abs->type, replaceNodes(abs->term, nodes)), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    return at(new ast::Application(replaceNodes(app->func, nodes), replaceNodes(app->arg, nodes)), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases)
+      cases.push_back(std::make_pair(pair.first, replaceNodes(pair.second, nodes)));
+    return at(new ast::Desum(replaceNodes(des->sum, nodes), cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    return at(new ast::Deproduct(replaceNodes(dep->product, nodes), dep->names, replaceNodes(dep->term, nodes)), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    return at(new ast::Fixpoint(replaceNodes(fix->term, nodes)), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
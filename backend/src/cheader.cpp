@@ -0,0 +1,240 @@
+#include "cheader.hpp"
+
+#include <vector>
+
+/* the name of a constructor and its fields; one without is unit */
+static std::string getCons(const std::pair<const ast::Type *, const std::string> &pair,
+                           std::vector<const ast::Type *> &fields) {
+  auto product = dynamic_cast<const ast::ProductType *>(pair.first);
+  fields = product == NULL ? std::vector<const ast::Type *>() : product->types;
+  return product == NULL ? pair.second : product->cons;
+}
+
+CHeader::CHeader(Layout &layout)
+  :layout(layout) {}
+
+std::string CHeader::getName(const ast::Type *type) const {
+  auto it = names.find(type);
+  return it == names.end() ? "" : it->second;
+}
+
+/* a declaration of name as a value of type */
+static std::string declare(const std::string &type, const std::string &name) {
+  return type + (type.back() == '*' ? "" : " ") + name;
+}
+
+std::string CHeader::getFieldType(const ast::Type *type) const {
+  //what Layout::getFieldType makes of it
+  if (layout.getPrimitiveWidth(type) != 0)
+    return "estlc_int";
+  auto prim = dynamic_cast<const ast::PrimitiveType *>(type);
+  if (prim != NULL && prim->name == "Vec")
+    return "struct estlc_vec *";
+  std::string name = getName(type);
+  if (!name.empty())
+    return "struct " + name + " *";
+  return "void *";
+}
+
+void CHeader::writeSum(const std::string &name, const ast::SumType *sum, std::ostream &os) {
+  bool tagged = layout.isTagged(sum);
+  os << "/* " << name << (tagged ? ", the tag in the low bits of the payload" : ", a cell of tag and payload")
+     << " */\n";
+  os << "enum {\n";
+  std::vector<const ast::Type *> fields;
+  for (size_t i = 0; i < sum->types.size(); ++i)
+    os << "  " << name << "_tag_" << getCons(sum->types[i], fields) << " = " << i << ",\n";
+  os << "};\n\n";
+
+  os << "static inline unsigned " << name << "_tag(const struct " << name << " *v) {\n";
+  //a result of a program compiled with -fstream=1 may be lazy
+  if (tagged)
+    os << "  return ESTLC_TAG(estlc_force((void *)v));\n";
+  else
+    os << "  return ((const struct estlc_sum *)v)->idx;\n";
+  os << "}\n\n";
+
+  for (size_t i = 0; i < sum->types.size(); ++i) {
+    std::string cons0 = getCons(sum->types[i], fields);
+    std::string cons = name + "_" + cons0;
+    size_t n = fields.size();
+
+    //a constructor without fields has a NULL payload
+    if (n > 0) {
+      os << "struct " << cons << " {\n";
+      for (size_t j = 0; j < n; ++j)
+        os << "  " << declare(getFieldType(fields[j]), "f" + std::to_string(j)) << ";\n";
+      os << "};\n\n";
+
+      os << "static inline struct " << cons << " *" << name << "_get_" << cons0
+         << "(const struct " << name << " *v) {\n";
+      if (tagged)
+        os << "  return (struct " << cons << " *)ESTLC_UNTAG(estlc_force((void *)v));\n";
+      else
+        os << "  return (struct " << cons << " *)((const struct estlc_sum *)v)->payload;\n";
+      os << "}\n\n";
+    }
+
+    os << "static inline struct " << name << " *" << name << "_make_" << cons0 << "(";
+    for (size_t j = 0; j < n; ++j)
+      os << (j == 0 ? "" : ", ") << declare(getFieldType(fields[j]), "f" + std::to_string(j));
+    os << (n == 0 ? "void" : "") << ") {\n";
+    if (n > 0) {
+      os << "  struct " << cons << " *p = (struct " << cons << " *)ESTLC_ALLOC(sizeof(struct " << cons << "));\n";
+      for (size_t j = 0; j < n; ++j)
+        os << "  p->f" << j << " = f" << j << ";\n";
+    } else
+      os << "  void *p = NULL;\n";
+    if (tagged)
+      os << "  return (struct " << name << " *)ESTLC_MKTAG(p, " << i << ");\n";
+    else {
+      os << "  struct estlc_sum *s = (struct estlc_sum *)ESTLC_ALLOC(sizeof(struct estlc_sum));\n";
+      os << "  s->idx = " << i << ";\n";
+      os << "  s->payload = p;\n";
+      os << "  return (struct " << name << " *)s;\n";
+    }
+    os << "}\n\n";
+  }
+}
+
+void CHeader::writeDump(const std::string &name, const ast::SumType *sum, std::ostream &os) {
+  //the last field of the same type is a loop, a long list is no
+  //deeper than a short one
+  os << "static inline void " << name << "_dump(FILE *f, const struct " << name << " *v) {\n";
+  os << "  unsigned long depth = 0;\n";
+  os << "  for (;;) {\n";
+  os << "    switch (" << name << "_tag(v)) {\n";
+  std::vector<const ast::Type *> fields;
+  for (auto pair : sum->types) {
+    std::string cons0 = getCons(pair, fields);
+    size_t n = fields.size();
+    os << "    case " << name << "_tag_" << cons0 << ": {\n";
+    if (n == 0) {
+      os << "      fputs(\"" << cons0 << "\", f);\n";
+      os << "      break;\n";
+      os << "    }\n";
+      continue;
+    }
+    std::string cons = name + "_" + cons0;
+    os << "      const struct " << cons << " *p = " << name << "_get_" << cons0 << "(v);\n";
+    os << "      fputs(\"(" << cons0 << "\", f);\n";
+    for (size_t j = 0; j < n; ++j) {
+      auto type = fields[j];
+      os << "      fputc(' ', f);\n";
+      if (j + 1 == n && type == sum) {
+        os << "      v = p->f" << j << ";\n";
+        os << "      ++depth;\n";
+        os << "      continue;\n";
+        break;
+      }
+      if (layout.getPrimitiveWidth(type) != 0)
+        os << "      fprintf(f, \"%u\", (unsigned)p->f" << j << ");\n";
+      else if (!getName(type).empty())
+        os << "      " << getName(type) << "_dump(f, p->f" << j << ");\n";
+      else
+        os << "      fputs(\"_\", f);\n";
+      if (j + 1 == n) {
+        os << "      fputc(')', f);\n";
+        os << "      break;\n";
+      }
+    }
+    os << "    }\n";
+  }
+  os << "    }\n";
+  os << "    break;\n";
+  os << "  }\n";
+  os << "  while (depth-- > 0)\n";
+  os << "    fputc(')', f);\n";
+  os << "}\n\n";
+}
+
+void CHeader::writeProduct(const std::string &name, const ast::ProductType *product, std::ostream &os) {
+  //the ref is the cell of the fields itself
+  size_t n = product->types.size();
+  os << "/* " << name << ", built by " << product->cons << ", a cell of its fields */\n";
+  os << "struct " << name << " {\n";
+  for (size_t j = 0; j < n; ++j)
+    os << "  " << declare(getFieldType(product->types[j]), "f" + std::to_string(j)) << ";\n";
+  os << "};\n\n";
+
+  for (size_t j = 0; j < n; ++j) {
+    std::string type = getFieldType(product->types[j]);
+    os << "static inline " << declare(type, name + "_get_f" + std::to_string(j))
+       << "(const struct " << name << " *v) {\n";
+    os << "  return v->f" << j << ";\n";
+    os << "}\n\n";
+  }
+
+  os << "static inline struct " << name << " *" << name << "_make_" << product->cons << "(";
+  for (size_t j = 0; j < n; ++j)
+    os << (j == 0 ? "" : ", ") << declare(getFieldType(product->types[j]), "f" + std::to_string(j));
+  os << (n == 0 ? "void" : "") << ") {\n";
+  os << "  struct " << name << " *p = (struct " << name << " *)ESTLC_ALLOC(sizeof(struct " << name << "));\n";
+  for (size_t j = 0; j < n; ++j)
+    os << "  p->f" << j << " = f" << j << ";\n";
+  os << "  return p;\n";
+  os << "}\n\n";
+
+  os << "static inline void " << name << "_dump(FILE *f, const struct " << name << " *v) {\n";
+  os << "  fputs(\"(" << product->cons << "\", f);\n";
+  for (size_t j = 0; j < n; ++j) {
+    auto type = product->types[j];
+    os << "  fputc(' ', f);\n";
+    if (layout.getPrimitiveWidth(type) != 0)
+      os << "  fprintf(f, \"%u\", (unsigned)v->f" << j << ");\n";
+    else if (!getName(type).empty())
+      os << "  " << getName(type) << "_dump(f, v->f" << j << ");\n";
+    else
+      os << "  fputs(\"_\", f);\n";
+  }
+  os << "  fputc(')', f);\n";
+  os << "}\n\n";
+}
+
+void CHeader::write(const ast::Program &prog, const std::string &guard, std::ostream &os) {
+  //bool is built in, it may be a keyword in C
+  std::vector<std::pair<std::string, const ast::SumType *> > sums;
+  std::vector<std::pair<std::string, const ast::ProductType *> > products;
+  std::vector<std::string> all;
+  for (auto pair : prog.types)
+    if (auto sum = dynamic_cast<const ast::SumType *>(pair.second)) {
+      std::string name = pair.first == "bool" ? "estlc_bool" : pair.first;
+      names[sum] = name;
+      sums.push_back(std::make_pair(name, sum));
+      all.push_back(name);
+    } else if (auto product = dynamic_cast<const ast::ProductType *>(pair.second)) {
+      names[product] = pair.first;
+      products.push_back(std::make_pair(pair.first, product));
+      all.push_back(pair.first);
+    }
+
+  os << "#ifndef " << guard << "\n";
+  os << "#define " << guard << "\n\n";
+  os << "/* generated by the ESTLC backend, do not edit */\n\n";
+  os << "#include <stdio.h>\n";
+  os << "#include <stdlib.h>\n\n";
+  os << "#include <abi.h>\n";
+  os << "#include <lazy.h>\n";
+  os << "#include <vec.h>\n\n";
+  os << "/* where values built here come from; a field may hold a value of\n";
+  os << "   the program, so the collector has to see them */\n";
+  os << "#ifndef ESTLC_ALLOC\n";
+  os << "#include <gc.h>\n";
+  os << "#define ESTLC_ALLOC(n) GC_MALLOC(n)\n";
+  os << "#endif\n\n";
+
+  for (auto name : all)
+    os << "struct " << name << ";\n";
+  for (auto name : all)
+    os << "static inline void " << name << "_dump(FILE *f, const struct " << name << " *v);\n";
+  os << "\n";
+
+  for (auto pair : products)
+    writeProduct(pair.first, pair.second, os);
+  for (auto pair : sums)
+    writeSum(pair.first, pair.second, os);
+  for (auto pair : sums)
+    writeDump(pair.first, pair.second, os);
+
+  os << "#endif\n";
+}
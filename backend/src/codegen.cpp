@@ -1,9 +1,14 @@
 #include "codegen.hpp"
 #include "exception.hpp"
+#include "analysis.hpp"
+#include "vec.h"
 
+#include <set>
+#include <algorithm>
 #include <vector>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IR/Function.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include <cstdarg>
 
@@ -13,10 +18,16 @@
 using namespace llvm;
 
 Codegen::Codegen()
+  : Codegen(Options()) {}
+
+Codegen::Codegen(const Options &options)
   : context(getGlobalContext()),
     module(new Module("", context)),
     builder(context),
-    layout(module) {
+    layout(module),
+    abi(context, layout),
+    chunk(options.chunk), parallel(options.parallel), stream(options.stream),
+    memoSize(options.memoSize), memoShared(options.memoShared) {
   module->setTargetTriple("x86_64-pc-linux-gnu");
 
   refType = PointerType::get(IntegerType::get(context, 8), 0);
@@ -34,20 +45,28 @@ Codegen::Codegen()
   
   stackType = PointerType::get(IntegerType::get(context, 8), 0);
   
+  //a function takes the frame of its closure and the argument
   elems.clear();
   elems.push_back(stackType);
+  elems.push_back(refType);
   funcType = FunctionType::get(refType, elems, false);
   PfuncType = PointerType::get(funcType, 0);
   
+  //a closure is its frame: the code pointer, then the captured values
   elems.clear();
   elems.push_back(PointerType::get(funcType, 0));
-  elems.push_back(stackType);
   closureType = StructType::get(context, elems);
 
   PclosureType = PointerType::get(closureType, 0);
+
+  Int = new ast::PrimitiveType("Int");
+  Unit = new ast::PrimitiveType("unit");
+  flow = NULL;
+  reused = 0;
+  memoized = 0;
     }
 
-Codegen::Term Codegen::generate(const ast::Term *term, Env<APInt> &env) {
+Codegen::Term Codegen::generate(const ast::Term *term, Env<Value *> &env) {
   Term term0;
   if (const ast::Application *app = dynamic_cast<const ast::Application *>(term))
     term0 = generate(app, env);
@@ -71,164 +90,236 @@ Codegen::Term Codegen::generate(const ast::Term *term, Env<APInt> &env) {
 }
 
 
-Codegen::Term Codegen::generate(const ast::Application *app, Env<APInt> &env) {
+Codegen::Term Codegen::generate(const ast::Application *app, Env<Value *> &env) {
+  //(par e) on its own is e, it is only spawned as an argument
+  if (auto arg = getPar(app))
+    return generate(arg, env);
+  //so is (memo e) anywhere but as the body of a fixpoint
+  if (auto body = getMemo(app))
+    return generate(body, env);
+
+  //a lambda applied right away is a let, the argument is bound as it is
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(app->func)) {
+    Term arg = generate(app->arg, env);
+    if (*abs->type != *arg.type)
+      throw TypeNotMatch(TermException(app->arg, arg.type), abs->type);
+    env.push(abs->arg, abs->type, arg.value);
+    Term term = generate(abs->term, env);
+    env.pop();
+    return term;
+  }
+
+  //an operator applied to both operands is computed in place
+  auto app0 = dynamic_cast<const ast::Application *>(app->func);
+  auto op = app0 == NULL ? NULL : dynamic_cast<const ast::Reference *>(app0->func);
+  if (op != NULL && isOperator(op->name, env)) {
+    auto xy = generateArgs({app0->arg, app->arg}, env);
+    Term x = xy[0], y = xy[1];
+    if (*x.type != *Int)
+      throw TypeNotMatch(TermException(app0->arg, x.type), Int);
+    if (*y.type != *Int)
+      throw TypeNotMatch(TermException(app->arg, y.type), Int);
+    return generateOperator(op->name, x.value, y.value);
+  }
+
+  //a saturated call of a known function is a direct call
+  std::vector<const ast::Term *> args;
+  const ast::Term *head = app;
+  while (auto app1 = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app1->arg);
+    head = app1->func;
+  }
+  //so is a function written in C
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  if (ref != NULL && isExtern(ref->name, args.size(), env)) {
+    //a filter or map by a section of a primitive runs a kernel instead
+    unsigned code;
+    const ast::Term *x;
+    if (getKernel(ref->name, args[0], env, code, x)) {
+      auto terms = generateArgs({x, args[1]}, env);
+      if (*terms[0].type != *Int)
+        throw TypeNotMatch(TermException(x, terms[0].type), Int);
+      const ast::Type *type = externs[ref->name].type;
+      const ast::Type *Vec = static_cast<const ast::FunctionType *>(type)->right;
+      Vec = static_cast<const ast::FunctionType *>(Vec)->left;
+      if (*terms[1].type != *Vec)
+        throw TypeNotMatch(TermException(args[1], terms[1].type), Vec);
+      return Term{generateKernelCall(ref->name, code, terms[0].value, terms[1].value), Vec};
+    }
+    auto terms = generateArgs(args, env);
+    const ast::Type *type = externs[ref->name].type;
+    std::vector<Value *> values;
+    for (size_t i = 0; i < terms.size(); ++i) {
+      auto func_type = static_cast<const ast::FunctionType *>(type);
+      if (*terms[i].type != *func_type->left)
+        throw TypeNotMatch(TermException(args[i], terms[i].type), func_type->left);
+      values.push_back(terms[i].value);
+      type = func_type->right;
+    }
+    return Term{generateExternCall(ref->name, values), type};
+  }
+  if (ref != NULL) {
+    int num;
+    if (!isLiteral(ref->name, num)) {
+      Value *stack = env.find(ref->name).first;
+      auto it = knowns.find(stack);
+      if (it != knowns.end() && args.size() >= it->second.arity)
+        return generateCall(it->second, stack, args, env);
+    }
+  }
+
   Term func = generate(app->func, env);
   Term arg = generate(app->arg, env);
 
   //type check
-  const ast::FunctionType *func_type = static_cast<const ast::FunctionType *>(func.type);
+  const ast::FunctionType *func_type = dynamic_cast<const ast::FunctionType *>(func.type);
   if (func_type == NULL)
     throw ClassNotMatch(TermException(app->func, func.type), typeid(ast::FunctionType));
-  if (*func_type->left != *arg.type){
-	  //std::cout << ((ast::Reference *)(app->func))->name << std::endl;
+  if (*func_type->left != *arg.type)
 	  throw TypeNotMatch(TermException(app->arg, arg.type), func_type->left);
-	  // Yunhao
-	  const std::string left = (((const ast::FunctionType *)arg.type))->left->to_string();
-	  if (left.compare("unit") != 0)
-		  throw TypeNotMatch(TermException(app->arg, arg.type), func_type->left);
-	  else{
-		  std::cout << "Warning: unit->xxx is converted to xxx directly" << std::endl;
-	  }
-  }
-
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, func_type->to_string(), module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f);
-  builder.SetInsertPoint(bb);
 
-  Value *stack = f->arg_begin();
-
-  Value *call0 = generateEval(func.value, stack);
-  generatePrintf("call0 = %p\n", call0);
-  Value *call1 = generateEval(arg.value, stack);
-
-  auto pair = generateDeclosure(call0);
-  Value *func0 = pair.first;
-  Value *stack0 = pair.second;
-
-  generatePush(call1, stack0);
-
-  Value *call = generateEval(func0, stack0);
-
-  builder.CreateRet(call);
-
-  verifyFunction(*f);
-  return Term{f, func_type->right};
+  Value *call = generateDispatch(app, func.value, arg.value);
+  return Term{call, func_type->right};
 }
 
-Codegen::Term Codegen::generate(const ast::Reference *ref, Env<APInt> &env) {
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "ref " + ref->name, module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f);
-  builder.SetInsertPoint(bb);
-  Value *stack = f->arg_begin();
-  Value *value;
-  const ast::Type *type;
-
-  size_t idx;
-  
+Codegen::Term Codegen::generate(const ast::Reference *ref, Env<Value *> &env) {
   int num;
-  try {
-    num = std::stoi(ref->name, &idx, 10);
-  } catch (std::invalid_argument e) {
-    idx = 0;
+  if (isLiteral(ref->name, num)) {
+    Value *value = generateToRef(ConstantInt::get(context, APInt(32, num)), Int);
+    return Term{value, Int};
   }
-  if (idx == ref->name.size()) {
-    value = generateMalloc(IntegerType::get(context, 32));
-	//Value *value_casted = builder.CreateBitCast(value, refType);
-    builder.CreateStore(ConstantInt::get(context, APInt(32, num)), value);
-	value = builder.CreateBitCast(value, refType);
 
-    type = new ast::PrimitiveType("Int");
-  } else {
-    auto v = env.find(ref->name);
-    
-    Value *v_p = builder.CreateInBoundsGEP(stack, ConstantInt::get(context, v.first - env.size()));
-    Value *v_p_c = builder.CreateBitCast(v_p, PointerType::get(refType, 0));
-    
-    value = builder.CreateLoad(refType, v_p_c);
-    type = v.second;
-  }
-  builder.CreateRet(value);
-  std::cout << ref->name << std::endl;
-  verifyFunction(*f);
-  return Term{f, type};
+  //a variable is just the value it was bound to
+  auto v = env.find(ref->name);
+  return Term{v.first, v.second};
 }
 
-Codegen::Term Codegen::generate(const ast::Abstraction *const abs, Env<APInt> &env) {
-  env.push(abs->arg, abs->type, APInt(32, layout.getPointerSize()));
-  Term term = generate(abs->term, env);
-  env.pop();
+void Codegen::collectCaptures(const std::set<std::string> &fv, Env<Value *> &env, Env<Value *> &env0,
+                              std::vector<std::string> &names, std::vector<const ast::Type *> &types) {
+  //globals are constants and are simply bound again, the rest has to
+  //be captured
+  for (auto name : fv) {
+    auto v = env.find(name);
+    if (isa<Constant>(v.first))
+      env0.push(name, v.second, v.first);
+    else {
+      names.push_back(name);
+      types.push_back(v.second);
+    }
+  }
+}
 
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "abs " + abs->arg, module);
-  BasicBlock *bb = BasicBlock::Create(getGlobalContext(), "", f);
-  builder.SetInsertPoint(bb);
-  Value *stack = f->arg_begin();
+Codegen::Shape Codegen::getShape(const std::set<std::string> &fv, Env<Value *> &env) {
+  Shape shape;
+  for (auto name : fv) {
+    auto v = env.find(name);
+    auto it = knowns.find(v.first);
+    shape.push_back(std::make_tuple(v.second, isa<Constant>(v.first) ? v.first : NULL,
+                                    it == knowns.end() ? NULL : it->second.func));
+  }
+  return shape;
+}
 
-  Value *stack_begin = builder.CreateGEP(stack, ConstantInt::get(context, -env.size()));
-  Value *stack0_begin = generateMalloc(ConstantInt::get(context, APInt(64, 4096)));
-  Value *size = ConstantInt::get(context, env.size());
-  generateMemmove(stack0_begin, stack_begin, size);
-  Value *stack0 = builder.CreateGEP(stack0_begin, size);
+void Codegen::bindCaptures(Value *stack, const std::vector<std::string> &names, const std::vector<const ast::Type *> &types,
+                           Env<Value *> &env, Env<Value *> &env0) {
+  for (size_t i = 0; i < names.size(); ++i) {
+    Value *v = generateFrameLoad(stack, i);
+    env0.push(names[i], types[i], v);
+    //a captured known function is still known
+    auto it = knowns.find(env.find(names[i]).first);
+    if (it != knowns.end())
+      knowns[v] = it->second;
+  }
+}
 
-  Value *clo = generateClosure(term.value, stack0);
+Codegen::Term Codegen::generate(const ast::Abstraction *const abs, Env<Value *> &env) {
+  //the closure captures the free variables of the body
+  std::set<std::string> fv = freeVariables(abs->term);
+  fv.erase(abs->arg);
+
+  Env<Value *> env0;
+  std::vector<std::string> names;
+  std::vector<const ast::Type *> types;
+  collectCaptures(fv, env, env0, names, types);
+
+  auto key = std::make_pair(static_cast<const ast::Term *>(abs), getShape(fv, env));
+  auto it = compiled.find(key);
+  if (it != compiled.end())
+    ++reused;
+  else {
+    //call sites may already know the function, unless this lambda was
+    //compiled before in another shape
+    Function *f = getCodes(abs)[0];
+    if (!f->empty()) {
+      recompiled.insert(f);
+      f = Function::Create(funcType, Function::InternalLinkage, "abs " + abs->arg, module);
+    }
+    auto ip = builder.saveIP();
+    BasicBlock *bb = BasicBlock::Create(context, "", f);
+    builder.SetInsertPoint(bb);
+    Function::arg_iterator args = f->arg_begin();
+    Value *stack = args++;
+    Value *arg = args;
 
-  builder.CreateRet(clo);
-  verifyFunction(*f);
-  return Term{f, new ast::FunctionType(abs->type, term.type)};
+    bindCaptures(stack, names, types, env, env0);
+    env0.push(abs->arg, abs->type, arg);
 
+    Term term = generate(abs->term, env0);
+    builder.CreateRet(term.value);
+    verifyFunction(*f);
+    builder.restoreIP(ip);
+    const ast::Type *type = new ast::FunctionType(abs->type, term.type);
+    it = compiled.insert(std::make_pair(key, Compiled{std::vector<Function *>(1, f), Known(), type})).first;
+  }
+  Function *f = it->second.funcs[0];
+  const ast::Type *type = it->second.type;
+
+  //nothing captured, the closure is a constant
+  if (names.empty())
+    return Term{generateClosure(f), type};
+
+  std::vector<Value *> values;
+  for (auto name : names)
+    values.push_back(env.find(name).first);
+  Value *clo = generateClosure(f, values);
+  return Term{clo, type};
 }
-Codegen::Term Codegen::generate(const ast::Deproduct *const dep, Env<APInt> &env) {
+
+Codegen::Term Codegen::generate(const ast::Deproduct *const dep, Env<Value *> &env) {
 
   Term product = generate(dep->product, env);
   const ast::ProductType *type = dynamic_cast<const ast::ProductType *>(product.type);
   if (type == NULL)
     throw ClassNotMatch(TermException(dep->product, product.type), typeid(ast::ProductType));
 
-  auto n = dep->names.size();
-  if (type->types.size() != n)
-    throw NumberNotMatch(TermException(dep->product, type), n);
-
-  std::vector<Type *> elems;
-  for (size_t i = 0; i < n; ++i) {
-    elems.push_back(refType);
-    env.push(dep->names[i], type->types[i], APInt(64, layout.getTypeAllocSize(refType)));
-  }
-  StructType *productType = StructType::get(context, elems);
-
+  auto n = generateFields(dep, type, product.value, env);
   Term term = generate(dep->term, env);
   for (unsigned i = 0; i < n; ++i)
     (void)env.pop();
 
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "dep", module);
-  BasicBlock *bb = BasicBlock::Create(getGlobalContext(), "", f);
-  builder.SetInsertPoint(bb);
-
-  Value *stack = f->arg_begin();
+  return Term{term.value, term.type};
+}
 
-  Value *size = ConstantInt::get(context, env.size());
-  Value *stack_begin = builder.CreateGEP(stack, ConstantInt::get(context, -env.size()));
-  Value *stack0_begin = generateMalloc(ConstantInt::get(context, APInt(64, 4096)));
-  generateMemmove(stack0_begin, stack_begin, size);
-  Value *stack0 = builder.CreateGEP(stack0_begin, size);
+/* binds the fields to the names of dep, for the caller to pop */
+size_t Codegen::generateFields(const ast::Deproduct *dep, const ast::ProductType *type, Value *product, Env<Value *> &env) {
+  auto n = dep->names.size();
+  if (type->types.size() != n)
+    throw NumberNotMatch(TermException(dep->product, type), n);
 
-  
-  Value *p = generateEval(product.value, stack);
-  Value *p_c = builder.CreateBitCast(p, PointerType::get(productType, 0));
+  StructType *productType = abi.getProductType(type);
+  Value *p_c = builder.CreateBitCast(product, PointerType::get(productType, 0));
   Value *index[2] = {ConstantInt::get(context, APInt(32, 0))};
   for (size_t i = 0; i < n; ++i) {
     index[1] = ConstantInt::get(context, APInt(32, i));
     Value *v_p = builder.CreateGEP(p_c, index);
-    Value *v = builder.CreateLoad(refType, v_p);
-    generatePush(v, stack0);
+    //primitive fields are inline, load them as they are
+    Value *v = builder.CreateLoad(productType->getElementType(i), v_p);
+    env.push(dep->names[i], type->types[i], generateToRef(v, type->types[i]));
   }
-
-  Value *call = generateEval(term.value, stack0);
-  builder.CreateRet(call);
-  verifyFunction(*f);
-
-  return Term{f, term.type};
+  return n;
 }
 
-Codegen::Term Codegen::generate(const ast::Desum *const des, Env<APInt> &env) {
+Codegen::Term Codegen::generate(const ast::Desum *const des, Env<Value *> &env) {
   Term sum = generate(des->sum, env);
   auto type = dynamic_cast<const ast::SumType *>(sum.type);
   if (type == NULL)
@@ -237,14 +328,30 @@ Codegen::Term Codegen::generate(const ast::Desum *const des, Env<APInt> &env) {
   if (n != des->cases.size())
     throw NumberNotMatch(TermException(des->sum, sum.type), des->cases.size());
 
-  std::vector<Constant *> consts;
+  auto pair = generateDesum(type, sum.value);
+  Value *idx = pair.first;
+  Value *ref = pair.second;
+
+  //each case is a block, they meet again at end
+  Function *f = builder.GetInsertBlock()->getParent();
+  BasicBlock *bad = BasicBlock::Create(context, "", f);
+  BasicBlock *end = BasicBlock::Create(context, "", f);
+  SwitchInst *sw = builder.CreateSwitch(idx, bad, n);
+
+  std::vector<std::pair<Value *, BasicBlock *> > incomings;
   const ast::Type *termtype = NULL;
   for (size_t i = 0; i < n ; ++i) {
     std::pair<const std::string, const ast::Term *> pair = des->cases[i];
-    env.push(pair.first, type->types[i].first, APInt(64, layout.getTypeAllocSize(refType)));
+    BasicBlock *bb = BasicBlock::Create(context, "", f);
+    sw->addCase(ConstantInt::get(context, APInt(32, i)), bb);
+    builder.SetInsertPoint(bb);
+
+    env.push(pair.first, type->types[i].first, ref);
     Term term = generate(pair.second, env);
     env.pop();
-    consts.push_back(term.value);
+    incomings.push_back(std::make_pair(term.value, builder.GetInsertBlock()));
+    builder.CreateBr(end);
+
     if (termtype == NULL)
       termtype = term.type;
 	  else if (*termtype != *term.type){
@@ -252,72 +359,112 @@ Codegen::Term Codegen::generate(const ast::Desum *const des, Env<APInt> &env) {
 	  }
   }
 
-  
-  Constant *jt = ConstantVector::get(consts);
-
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "desum ", module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f);
-  builder.SetInsertPoint(bb);
+  builder.SetInsertPoint(bad);
+  builder.CreateUnreachable();
 
+  builder.SetInsertPoint(end);
+  PHINode *phi = builder.CreatePHI(refType, n);
+  for (auto incoming : incomings)
+    phi->addIncoming(incoming.first, incoming.second);
 
-  Value *stack = f->arg_begin();
-
-  Value *size = ConstantInt::get(context, env.size());
-  Value *stack_begin = builder.CreateGEP(stack, ConstantInt::get(context, -env.size()));
-  Value *stack0_begin = generateMalloc(ConstantInt::get(context, APInt(64, 4096)));
-  generateMemmove(stack0_begin, stack_begin, size);
-  Value *stack0 = builder.CreateGEP(stack0_begin, size);
-
-  Value *call = generateEval(sum.value, stack);
-  Value *value = builder.CreateBitCast(call, PointerType::get(sumType, 0));
-  generatePrintf("begin Desum [%p]\n", value);
+  return Term{phi, termtype};
+}
 
-  //read the first 4 bytes of index
-  Value *index[2];
-  index[0] = ConstantInt::get(context, APInt(32, 0));
-  index[1] = ConstantInt::get(context, APInt(32, 0));
-  Value *idx_p = builder.CreateGEP(value, index);
-  index[1] = ConstantInt::get(context, APInt(32, 1));
-  Value *ref_p = builder.CreateGEP(value, index);
+Value *Codegen::generateFrameSlot(Value *stack, const unsigned idx) {
+  //the first slot is taken by the code pointer
+  Value *stack_c = builder.CreateBitCast(stack, PointerType::get(refType, 0));
+  return builder.CreateInBoundsGEP(stack_c, ConstantInt::get(context, APInt(32, idx + 1)));
+}
 
-  Value *idx = builder.CreateLoad(indexType, idx_p);
-  Value *ref = builder.CreateLoad(refType, ref_p);
+void Codegen::generateFrameStore(Value *stack, const unsigned idx, Value *value) {
+  (void)builder.CreateStore(value, generateFrameSlot(stack, idx));
+}
 
-  //read the function pointer
-  Value *func = builder.CreateExtractElement(jt, idx);
+Value *Codegen::generateFrameLoad(Value *stack, const unsigned idx) {
+  return builder.CreateLoad(refType, generateFrameSlot(stack, idx));
+}
 
-  //call it.
+Value *Codegen::generateApply(Value *clo, Value *arg) {
+  auto pair = generateDeclosure(clo);
+  Value *func = pair.first;
+  Value *stack = pair.second;
+  return builder.CreateCall(func, {stack, arg});
+}
 
-  //then we push the remainer into the stack
-  generatePush(ref, stack0);
-    
-  Value *casecall = generateEval(func, stack0);
-  builder.CreateRet(casecall);
-  verifyFunction(*f);
+Value *Codegen::generateDispatch(const ast::Application *app, Value *clo, Value *arg) {
+  std::vector<Function *> targets;
+  if (flow != NULL) {
+    Flow::Set callees = flow->callees(app);
+    if (!callees.top && callees.closures.size() <= maxTargets)
+      for (auto callee : callees.closures)
+        if (Function *target = getCode(callee))
+          targets.push_back(target);
+  }
+  if (targets.empty())
+    return generateApply(clo, arg);
+
+  auto pair = generateDeclosure(clo);
+  Value *func = pair.first;
+  Value *stack = pair.second;
+  if (targets.size() == 1) {
+    CallInst *call = builder.CreateCall(targets[0], {stack, arg});
+    directs.push_back(std::make_pair(call, func));
+    return call;
+  }
 
-  return Term{f, termtype};
+  /* test the code pointer against each target the analysis found, a
+     match is a direct call; a closure compiled twice still carries
+     code of its own, so the indirect call stays as the last case */
+  Function *f = builder.GetInsertBlock()->getParent();
+  BasicBlock *end = BasicBlock::Create(context, "", f);
+  std::vector<std::pair<Value *, BasicBlock *> > incomings;
+  for (auto target : targets) {
+    BasicBlock *yes = BasicBlock::Create(context, "", f);
+    BasicBlock *no = BasicBlock::Create(context, "", f);
+    builder.CreateCondBr(builder.CreateICmpEQ(func, target), yes, no);
+    builder.SetInsertPoint(yes);
+    incomings.push_back(std::make_pair(builder.CreateCall(target, {stack, arg}), yes));
+    builder.CreateBr(end);
+    builder.SetInsertPoint(no);
+  }
+  incomings.push_back(std::make_pair(builder.CreateCall(func, {stack, arg}), builder.GetInsertBlock()));
+  builder.CreateBr(end);
+
+  builder.SetInsertPoint(end);
+  PHINode *phi = builder.CreatePHI(refType, incomings.size());
+  for (auto incoming : incomings)
+    phi->addIncoming(incoming.first, incoming.second);
+  return phi;
 }
 
-void Codegen::generatePush(Value *const value, Value *&stack) {
-  Value *stack_c = builder.CreateBitCast(stack, PointerType::get(value->getType(), 0));
-  generatePrintf("Store [%p] ", stack_c);
-  generatePrintf("= %p\n", value);
-  (void)builder.CreateStore(value, stack_c);
-  stack = builder.CreateInBoundsGEP(stack, ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(value->getType()))));
+const std::vector<Function *> &Codegen::getCodes(const ast::Term *term) {
+  //declared on first sight, the body comes when the term is compiled
+  auto it = codes.find(term);
+  if (it != codes.end())
+    return it->second;
+  std::vector<Function *> &funcs = codes[term];
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(term))
+    funcs.push_back(Function::Create(funcType, Function::InternalLinkage, "abs " + abs->arg, module));
+  else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term))
+    for (auto param : Flow::getParams(fix))
+      funcs.push_back(Function::Create(funcType, Function::InternalLinkage, "abs " + param->arg, module));
+  return funcs;
 }
 
-LoadInst *Codegen::generatePop(Type *const type, Value *&stack) {
-	// Yunhao
-	// add (int16_t)
-  stack = builder.CreateInBoundsGEP(stack, ConstantInt::get(context, APInt(64, -(int16_t)layout.getTypeAllocSize(type))));
-  Value *stack_c = builder.CreateBitCast(stack, PointerType::get(type, 0));
-  return builder.CreateLoad(type, stack_c);
+Function *Codegen::getCode(const Flow::Closure &clo) {
+  if (clo.term == NULL) {
+    auto it = globalCodes.find(clo.name);
+    if (it == globalCodes.end() || clo.stage >= it->second.size())
+      return NULL;
+    return it->second[clo.stage];
+  }
+  auto &funcs = getCodes(clo.term);
+  return clo.stage < funcs.size() ? funcs[clo.stage] : NULL;
 }
 
 
 Codegen::Term Codegen::generate(const ast::Program &prog) {
-  Env<APInt> env(APInt(layout.getTypeAllocSizeInBits(refType), 0));
-  std::vector<Term> funcs;
+  Env<Value *> env;
   /*
   //generate bool
   std::vector<std::pair<const ast::Type *, const std::string>> types;
@@ -335,6 +482,17 @@ Codegen::Term Codegen::generate(const ast::Program &prog) {
   // generate construcotr for tyeps
 
   //for (const ast::Type *type : prog.types) {
+  //how many arguments each global takes, for the flow analysis
+  std::map<std::string, unsigned> arities;
+  auto arity = [](const ast::Type *type) {
+    unsigned n = 0;
+    while (auto func_type = dynamic_cast<const ast::FunctionType *>(type)) {
+      ++n;
+      type = func_type->right;
+    }
+    return n;
+  };
+
   for (const std::pair<const std::string, const ast::Type *> pair1 : prog.types){
   	const ast::Type* type = pair1.second;
 	/*
@@ -367,114 +525,107 @@ Codegen::Term Codegen::generate(const ast::Program &prog) {
 		  // Yunhao
 		  if (auto product = dynamic_cast<const ast::ProductType *>(pair.first)){
 			  Term term = generate(product);
-			  funcs.push_back(term);
-			  env.push(product->cons, term.type, APInt(64, layout.getTypeAllocSize(term.value->getType())));
+			  env.push(product->cons, term.type, term.value);
+			  arities[product->cons] = arity(term.type);
+			  products[product->cons] = std::make_pair(product, term.value);
 		  }
 
 		  Term term = generate(sum, idx++);
-		  funcs.push_back(term);
-		  env.push(pair.second, term.type, APInt(64, layout.getTypeAllocSize(term.value->getType())));
+		  env.push(pair.second, term.type, term.value);
+		  arities[pair.second] = arity(term.type);
+		  constructors[pair.second] = Constructor{sum, idx - 1, term.value};
       }
     } else if (auto product = dynamic_cast<const ast::ProductType *>(type)) {
       Term term = generate(product);
-      funcs.push_back(term);
-      env.push(product->cons, term.type, APInt(64, layout.getTypeAllocSize(term.value->getType())));
+      env.push(product->cons, term.type, term.value);
+      arities[product->cons] = arity(term.type);
+      products[product->cons] = std::make_pair(product, term.value);
     } else {
       throw TypeException(type);
     }
 
   }
 
-  std::string prims[] = {"<", ">=", "+", "=", "-", "unit"};
-  for (auto prim : prims) {
+  for (auto prim : primitives) {
     Term term = generatePrimitive(prim);
-    funcs.push_back(term);
-    env.push(prim, term.type, APInt(64, layout.getTypeAllocSize(term.value->getType())));
+    env.push(prim, term.type, term.value);
+    arities[prim] = arity(term.type);
+  }
+  for (auto op : vectorOps) {
+    Term term = generateVector(op);
+    if (term.type == NULL)
+      continue;
+    env.push(op, term.type, term.value);
+    arities[op] = arity(term.type);
+  }
+  for (auto pair : prog.externs) {
+    Term term = generateExtern(pair.first, pair.second.type, pair.second.symbol);
+    env.push(pair.first, term.type, term.value);
+    arities[pair.first] = arity(term.type);
   }
 
-  Term term = generate(prog.term, env);
+  flow = new Flow(prog.term, arities);
 
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "umain", module);
+  Function *f = Function::Create(FunctionType::get(refType, {refType}, false),
+                                 Function::ExternalLinkage, "umain", module);
   Value *arg = f->arg_begin();
   BasicBlock *bb = BasicBlock::Create(context, "", f);
   builder.SetInsertPoint(bb);
 
-  Value *stack = generateMalloc(ConstantInt::get(context, APInt(64, 4096)));
-  for (auto term : funcs) {
-    // call the functions that will generator constructor for us.
-    // the arg is NULL, since the process generating constructor does
-    // not need any other informations.
-    Value *clo = builder.CreateCall(term.value, ConstantPointerNull::get(stackType));
-    generatePush(clo, stack);
-  }
-  
-  //now call the main term
-  CallInst *call = builder.CreateCall(term.value, {stack});
+  //the constructors and primitives are constants, nothing to set up
+  Term term = generate(prog.term, env);
   const ast::FunctionType *type = dynamic_cast<const ast::FunctionType *>(term.type);
   if (type == NULL)
     throw new ClassNotMatch(TermException(prog.term, term.type), typeid(ast::FunctionType));
-  auto pair = generateDeclosure(call);
-  Value *func0 = pair.first;
-  Value *stack0 = pair.second;
-  
-  generatePush(arg, stack0);
-  Value *ret = builder.CreateCall(func0, {stack0});
+
+  //now apply the main term
+  Value *ret = generateApply(term.value, arg);
   builder.CreateRet(ret);
   verifyFunction(*f);
+
+  for (auto direct : directs)
+    if (recompiled.count(direct.first->getCalledFunction())) {
+      CallInst *call = direct.first;
+      builder.SetInsertPoint(call);
+      Value *indirect = builder.CreateCall(direct.second, {call->getArgOperand(0), call->getArgOperand(1)});
+      call->replaceAllUsesWith(indirect);
+      call->eraseFromParent();
+    }
+
+  //targets that were never compiled never make a closure either
+  for (auto pair : codes)
+    for (auto func : pair.second)
+      if (func->empty()) {
+        builder.SetInsertPoint(BasicBlock::Create(context, "", func));
+        builder.CreateUnreachable();
+      }
   return Term{f, term.type};
 }
 
 Codegen::Term Codegen::generate(const ast::SumType *sum, const uint32_t idx) {
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, sum->types[idx].second, module);
-  {
-    BasicBlock *bb = BasicBlock::Create(context, "", f);
-    builder.SetInsertPoint(bb);
+  //a constructor without payload is the value itself
+  const ast::Type *payload = sum->types[idx].first;
+  if (auto prim = dynamic_cast<const ast::PrimitiveType *>(payload))
+    if (prim->name == "unit" || prim->name == "Unit")
+      return Term{generateConstant(sum, idx), sum};
 
-    Value* m = generateMalloc(sumType);
-
-    Value *stack = f->arg_begin();
-    LoadInst *ref = generatePop(refType, stack);
-
-    std::vector<Value *> idxs;
-    idxs.push_back(ConstantInt::get(context, APInt(32, 0)));
-    idxs.push_back(ConstantInt::get(context, APInt(32, 0)));
-  
-    Value *idx_p = builder.CreateGEP(m, idxs);
-
-    idxs.clear();
-    idxs.push_back(ConstantInt::get(context, APInt(32, 0)));
-    idxs.push_back(ConstantInt::get(context, APInt(32, 1)));
-    Value *ref_p = builder.CreateGEP(m, idxs);
-
-    builder.CreateStore(ConstantInt::get(context, APInt(32, idx)), idx_p);
-    builder.CreateStore(ref, ref_p);
-
-    Value *m_c = builder.CreateBitCast(m, refType);
-    builder.CreateRet(m_c);
-    verifyFunction(*f);
-  }
-
-  Function *f0 = Function::Create(funcType, Function::ExternalLinkage, "ret " + sum->types[idx].second, module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f0);
+  Function *f = Function::Create(funcType, Function::InternalLinkage, sum->types[idx].second, module);
+  BasicBlock *bb = BasicBlock::Create(context, "", f);
   builder.SetInsertPoint(bb);
-  
 
-  Value *stack = generateMalloc(refType);
-  Value *stack_c = builder.CreateBitCast(stack, refType);
+  Function::arg_iterator args = f->arg_begin();
+  Value *ref = ++args;
 
-  Value *clo = generateClosure(f, stack_c);
-
-  Value *clo_c = builder.CreateBitCast(clo, refType);
-
-  builder.CreateRet(clo_c);
-  verifyFunction(*f0);
+  Value *m = generateSum(sum, ConstantInt::get(context, APInt(32, idx)), ref);
+  builder.CreateRet(m);
+  verifyFunction(*f);
   
-  ast::Type *type = new ast::FunctionType(sum->types[idx].first, sum);
-  return Term{f0, type};
+  globalCodes[sum->types[idx].second] = std::vector<Function *>(1, f);
+  ast::Type *type = new ast::FunctionType(payload, sum);
+  return Term{generateClosure(f), type};
 }
 
 Value *Codegen::generateMalloc(Value *size) {
-  generatePrintf("begin Malloc for size %u\n", size);
   static Function *malloc = NULL;
   if (malloc == NULL) {
     std::vector<Type*> types(1, IntegerType::get(context, 64));
@@ -483,349 +634,1188 @@ Value *Codegen::generateMalloc(Value *size) {
   }
   Value *args[1] = {size};
   CallInst *call = builder.CreateCall(malloc, args);
-  generatePrintf("end Malloc = %p\n", call);
-  return call;
-
-}
-
-Value *Codegen::generateMemmove(Value *dst, Value *src, Value *n) {
-  static Function *memmove = NULL;
-  if (memmove == NULL) {
-    FunctionType *type = FunctionType::get(refType, {refType, refType, IntegerType::get(context, 64)}, false);
-    memmove = Function::Create(type, Function::ExternalLinkage, "memmove", module);
-  }
-  CallInst *call = builder.CreateCall(memmove, {dst, src, n});
   return call;
 
 }
 
 Value *Codegen::generateMalloc(Type *type) {
-  generatePrintf("begin Malloc for type\n", ConstantPointerNull::get(stackType));
   Value *m = generateMalloc(ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(type))));
-  generatePrintf("end Malloc = %p\n", m);
   return builder.CreateBitCast(m, PointerType::get(type, 0));  
 }
 
-Value *Codegen::generateClosure(Value *func, Value *stack) {
-  generatePrintf("begin Clo [%p] ", func);
-  generatePrintf("[%p]\n", stack);
-  Value *m = generateMalloc(closureType);
-  std::vector<Value *> idx;
-  idx.push_back(ConstantInt::get(context, APInt(32, 0)));
-  idx.push_back(ConstantInt::get(context, APInt(32, 0)));
-  Value *func_p = builder.CreateGEP(m, idx);
+Value *Codegen::generateClosure(Value *func, const std::vector<Value *> &values) {
+  //one block is both the closure and its frame
+  Value *m = generateMalloc(ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(refType) * (values.size() + 1))));
+  Value *func_p = builder.CreateBitCast(m, PointerType::get(PfuncType, 0));
+  builder.CreateStore(func, func_p);
 
-  idx.clear();
-  idx.push_back(ConstantInt::get(context, APInt(32, 0)));
-  idx.push_back(ConstantInt::get(context, APInt(32, 1)));
-  Value *stack_p = builder.CreateGEP(m, idx);
+  //NULL slots are left for the caller to fill
+  for (size_t i = 0; i < values.size(); ++i)
+    if (values[i] != NULL)
+      generateFrameStore(m, i, values[i]);
+  return m;
+}
 
-  builder.CreateStore(func, func_p);
-  builder.CreateStore(stack, stack_p);
-  //normally we want a refType
-  Value *m_c = builder.CreateBitCast(m, refType);
+Constant *Codegen::generateClosure(Function *func) {
+  //a closure with an empty frame never changes, keep it in a global
+  std::vector<Constant *> elems;
+  elems.push_back(func);
+  Constant *clo = ConstantStruct::get(closureType, elems);
+  GlobalVariable *clo_p = new GlobalVariable(*module,
+                                             closureType,
+                                             true,
+                                             GlobalValue::InternalLinkage,
+                                             clo,
+                                             "clo " + func->getName().str());
+  return ConstantExpr::getBitCast(clo_p, refType);
+}
 
-  generatePrintf("end Clo [%p]\n", m);
-  return m_c;
+Constant *Codegen::generateConstant(const ast::SumType *sum, const uint32_t idx) {
+  if (abi.isTagged(sum)) {
+    Constant *idx_c = ConstantInt::get(layout.getIntPtrType(context), idx);
+    return ConstantExpr::getIntToPtr(idx_c, refType);
+  }
+  std::vector<Constant *> elems;
+  elems.push_back(ConstantInt::get(context, APInt(32, idx)));
+  elems.push_back(ConstantPointerNull::get(refType));
+  Constant *value = ConstantStruct::get(cast<StructType>(sumType), elems);
+  GlobalVariable *value_p = new GlobalVariable(*module,
+                                               sumType,
+                                               true,
+                                               GlobalValue::InternalLinkage,
+                                               value,
+                                               sum->types[idx].second);
+  return ConstantExpr::getBitCast(value_p, refType);
 }
 
 Codegen::Term Codegen::generate(const ast::ProductType *const product) {
-  Env<APInt> env(APInt(layout.getTypeAllocSizeInBits(refType), 0));
   size_t n = product->types.size();
-  std::vector<Type *> elems;
-  for (unsigned i = 0; i < n; ++i) {
-    env.push(std::to_string(i), product->types[i], APInt(64, layout.getTypeAllocSize(refType)));
-    elems.push_back(refType);
-  }
+  //no field to fill in, any ref will do
+  if (n == 0)
+    return Term{ConstantPointerNull::get(refType), product};
 
-  /* generate the actually working function */
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, product->cons, module);
   const ast::Type *type = product;
-  {
+  for (int i = n - 1; i >= 0; --i)
+    type = new ast::FunctionType(product->types[i], type);
+
+  /* the constructor is curried: stage i finds the former fields in
+     its frame and takes the i-th as argument */
+  std::vector<Function *> stages;
+  for (size_t i = 0; i < n; ++i) {
+    std::string name = i + 1 == n ? product->cons : product->cons + std::to_string(i + 1);
+    stages.push_back(Function::Create(funcType, Function::InternalLinkage, name, module));
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    Function *f = stages[i];
     BasicBlock *bb = BasicBlock::Create(context, "", f);
     builder.SetInsertPoint(bb);
+    Function::arg_iterator args = f->arg_begin();
+    Value *stack = args++;
+    Value *arg = args;
+
+    std::vector<Value *> values;
+    for (unsigned j = 0; j < i; ++j)
+      values.push_back(generateFrameLoad(stack, j));
+    values.push_back(arg);
+
+    if (i + 1 < n) {
+      Value *clo = generateClosure(stages[i + 1], values);
+      builder.CreateRet(clo);
+    } else {
+      /* generate the actually working function */
+      StructType *productType = abi.getProductType(product);
+      Value *m = generateMalloc(productType);
+      for (unsigned j = 0; j < n; ++j) {
+        std::vector<Value *> idx;
+        idx.push_back(ConstantInt::get(context, APInt(32, 0)));
+        idx.push_back(ConstantInt::get(context, APInt(32, j)));
+        Value *p = builder.CreateGEP(m, idx);
+        //store the value to the m, primitives at their natural width
+        builder.CreateStore(generateFromRef(values[j], product->types[j]), p);
+      }
+      Value *m_c = builder.CreateBitCast(m, refType);
+      builder.CreateRet(m_c);
+    }
+    verifyFunction(*f);
+  }
 
-    Type *productType = StructType::get(context, elems);
+  globalCodes[product->cons] = stages;
+  return Term{generateClosure(stages[0]), type};
+}
 
-    Value *m = generateMalloc(productType);
-    Value *stack = f->arg_begin();
+Function *Codegen::generateBinary(Function *f0) {
+  //take the first operand, and wait for the second one
+  Function *f = Function::Create(funcType, Function::InternalLinkage, "binary", module);
+  BasicBlock *bb = BasicBlock::Create(context, "", f);
+  builder.SetInsertPoint(bb);
 
-    for (int i = n - 1; i >=0; --i) {
-      type = new ast::FunctionType(product->types[i], type);
-      //calculate the address in m
-    
-      std::vector<Value *> idx;
-      idx.push_back(ConstantInt::get(context, APInt(32, 0)));
-      idx.push_back(ConstantInt::get(context, APInt(32, i)));
-      Value *p = builder.CreateGEP(m, idx);
+  Function::arg_iterator args = f->arg_begin();
+  Value *x = ++args;
 
-      //get the value from the stack
-      Value *v_p = builder.CreateGEP(stack, ConstantInt::get(context, env.find(std::to_string(i)).first - env.size()));
-      Value *v_p_c = builder.CreateBitCast(v_p, PointerType::get(refType, 0));
-      Value *v = generateLoad(refType, v_p_c);
+  Value *clo = generateClosure(f0, {x});
+  builder.CreateRet(clo);
+  verifyFunction(*f);
+  return f;
+}
 
-      //store the value to the m
-      builder.CreateStore(v, p);
-    }
-    Value *m_c = builder.CreateBitCast(m, refType);
-    builder.CreateRet(m_c);
-    verifyFunction(*f);
+Codegen::Term Codegen::generatePrimitive(const std::string &prim) {
+	if (prim == "unit"){
+		return Term{ ConstantPointerNull::get(refType), new ast::PrimitiveType("unit") };
+	}
+
+  //the closure form, only used when the operator is passed as a value
+  Function *f = Function::Create(funcType, Function::InternalLinkage, prim, module);
+  BasicBlock *bb = BasicBlock::Create(context, "", f);
+  builder.SetInsertPoint(bb);
+  Function::arg_iterator args = f->arg_begin();
+  Value *stack = args++;
+
+  Value *y = args;
+  Value *x = generateFrameLoad(stack, 0);
+  Term ret = generateOperator(prim, x, y);
+  builder.CreateRet(ret.value);
+  verifyFunction(*f);
+
+  Function *f0 = generateBinary(f);
+  Constant *clo = generateClosure(f0);
+  operators[prim] = clo;
+  globalCodes[prim] = {f0, f};
+  return Term{clo, new ast::FunctionType(Int, new ast::FunctionType(Int, ret.type))};
+}
+
+Codegen::Term Codegen::generateOperator(const std::string &prim, Value *x, Value *y) {
+  Value *x_v = generateFromRef(x, Int);
+  Value *y_v = generateFromRef(y, Int);
+
+  Value *res;
+  if (prim == "+")
+    res = builder.CreateAdd(x_v, y_v);
+  else if (prim == "-")
+    res = builder.CreateSub(x_v, y_v);
+  else if (prim == "*")
+    res = builder.CreateMul(x_v, y_v);
+  else if (prim == "/") {
+    //x / 0 is 0, divided by 1 so the division itself never traps
+    Value *zero = ConstantInt::get(y_v->getType(), 0);
+    Value *isZero = builder.CreateICmpEQ(y_v, zero);
+    Value *q = builder.CreateUDiv(x_v, builder.CreateSelect(isZero, ConstantInt::get(y_v->getType(), 1), y_v));
+    res = builder.CreateSelect(isZero, zero, q);
+  }
+  else {
+    //the rest are comparisons, giving a bool
+    if (prim == "<")
+      res = builder.CreateICmpULT(x_v, y_v);
+    else if (prim == ">")
+      res = builder.CreateICmpUGT(x_v, y_v);
+    else if (prim == "<=")
+      res = builder.CreateICmpULE(x_v, y_v);
+    else if (prim == ">=")
+      res = builder.CreateICmpUGE(x_v, y_v);
+    else if (prim == "=" || prim == "==")
+      res = builder.CreateICmpEQ(x_v, y_v);
+    else if (prim == "<>")
+      res = builder.CreateICmpNE(x_v, y_v);
+    else
+      throw PrimitiveException(prim);
+    return Term{generateSum(Bool, res, ConstantPointerNull::get(refType)), Bool};
   }
+  return Term{generateToRef(res, Int), Int};
+}
 
+Codegen::Term Codegen::generateVector(const std::string &op) {
+  const ast::Type *type = vectorType(op, Bool);
+  if (type == NULL)
+    return Term{NULL, NULL};
+  //the empty vector is the NULL ref
+  if (op == "vempty")
+    return Term{ConstantPointerNull::get(refType), type};
+
+  return generateExtern(op, type, "estlc_" + op);
+}
 
-  /* now we will generate a serialize of useless function to be
-     friendly to other components */
-  for (auto i = n - 1; i > 0; --i) {
-    Function *f0 = Function::Create(funcType, Function::ExternalLinkage, product->cons + std::to_string(i), module);
-    BasicBlock *bb = BasicBlock::Create(context, "", f0);
+Codegen::Term Codegen::generateExtern(const std::string &name, const ast::Type *type, const std::string &symbol) {
+  std::vector<Type *> types;
+  const ast::Type *result = type;
+  while (auto func_type = dynamic_cast<const ast::FunctionType *>(result)) {
+    types.push_back(abi.getFieldType(func_type->left));
+    result = func_type->right;
+  }
+  //the runtime or another Extern may have declared it already; a
+  //function of the program itself that has the name gives it up
+  FunctionType *func_type = FunctionType::get(abi.getFieldType(result), types, false);
+  Function *func = module->getFunction(symbol);
+  if (func != NULL && func->hasLocalLinkage()) {
+    func->setName(symbol + " local");
+    func = NULL;
+  }
+  if (func == NULL)
+    func = Function::Create(func_type, Function::ExternalLinkage, symbol, module);
+  else if (func->getFunctionType() != func_type || !func->isDeclaration())
+    throw ExternException(name, symbol);
+  size_t n = types.size();
+  externs[name] = External{func, NULL, type, n};
+
+  //the closure form is curried as a constructor is; its stages are
+  //the program's own, under names no C symbol has
+  std::vector<Function *> stages;
+  for (size_t i = 0; i < n; ++i) {
+    std::string stage = "extern " + (i + 1 == n ? name : name + std::to_string(i + 1));
+    stages.push_back(Function::Create(funcType, Function::InternalLinkage, stage, module));
+  }
+  for (size_t i = 0; i < n; ++i) {
+    Function *f = stages[i];
+    BasicBlock *bb = BasicBlock::Create(context, "", f);
     builder.SetInsertPoint(bb);
-    Value *stack = f0->arg_begin();
+    Function::arg_iterator args = f->arg_begin();
+    Value *stack = args++;
+
+    std::vector<Value *> values;
+    for (unsigned j = 0; j < i; ++j)
+      values.push_back(generateFrameLoad(stack, j));
+    values.push_back(args);
+    if (i + 1 < n)
+      builder.CreateRet(generateClosure(stages[i + 1], values));
+    else
+      builder.CreateRet(generateExternCall(name, values));
+    verifyFunction(*f);
+  }
 
-    
-    Value *stack_begin = builder.CreateGEP(stack, ConstantInt::get(context, -env.find(std::to_string(i)).first));
-    Value *stack0_begin = generateMalloc(ConstantInt::get(context, APInt(64, 4096)));
-    Value *size = ConstantInt::get(context, env.find(std::to_string(i)).first);
-    generateMemmove(stack0_begin, stack_begin, size);
-    Value *stack0 = builder.CreateGEP(stack0_begin, size);
+  globalCodes[name] = stages;
+  Constant *clo = generateClosure(stages[0]);
+  externs[name].value = clo;
+  return Term{clo, type};
+}
 
-    Value *clo = generateClosure(f, stack0);
-    builder.CreateRet(clo);
-    verifyFunction(*f0);
-    f = f0;
+Value *Codegen::generateExternCall(const std::string &name, const std::vector<Value *> &args) {
+  const External &external = externs[name];
+  const ast::Type *type = external.type;
+  std::vector<Value *> values;
+  for (auto arg : args) {
+    auto func_type = static_cast<const ast::FunctionType *>(type);
+    values.push_back(generateFromRef(arg, func_type->left));
+    type = func_type->right;
   }
+  return generateToRef(builder.CreateCall(external.func, values), type);
+}
 
-  Function *f0 = Function::Create(funcType, Function::ExternalLinkage, "ret " + product->cons, module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f0);
-  builder.SetInsertPoint(bb);
-  Value *stack = generateMalloc(ConstantInt::get(context, env.size()));
+bool Codegen::getKernel(const std::string &name, const ast::Term *func, Env<Value *> &env,
+                        unsigned &code, const ast::Term *&x) {
+  static const std::map<std::string, unsigned> filters = {
+    {"<", ESTLC_VEC_LT}, {">", ESTLC_VEC_GT}, {"<=", ESTLC_VEC_LE}, {">=", ESTLC_VEC_GE},
+    {"=", ESTLC_VEC_EQ}, {"==", ESTLC_VEC_EQ}, {"<>", ESTLC_VEC_NE}
+  };
+  static const std::map<std::string, unsigned> maps = {{"+", ESTLC_VEC_ADD}, {"-", ESTLC_VEC_SUB}};
+  if (name != "vfilter" && name != "vmap")
+    return false;
+  //an Extern of the same name is not the vector operation
+  if (externs[name].func->getName() != "estlc_" + name)
+    return false;
+  auto app = dynamic_cast<const ast::Application *>(func);
+  auto op = app == NULL ? NULL : dynamic_cast<const ast::Reference *>(app->func);
+  if (op == NULL || !isOperator(op->name, env))
+    return false;
+  auto &ops = name == "vfilter" ? filters : maps;
+  auto it = ops.find(op->name);
+  if (it == ops.end())
+    return false;
+  code = it->second;
+  x = app->arg;
+  return true;
+}
 
-  Value *clo = generateClosure(f, stack);
-  
-  builder.CreateRet(clo);
-  verifyFunction(*f0);
-  
-  return Term{f0, type};
+Value *Codegen::generateKernelCall(const std::string &name, unsigned code, Value *x, Value *vec) {
+  std::string symbol = "estlc_" + name + "_op";
+  Function *func = module->getFunction(symbol);
+  if (func == NULL) {
+    Type *i32 = IntegerType::get(context, 32);
+    FunctionType *func_type = FunctionType::get(refType, {i32, abi.getFieldType(Int), refType}, false);
+    func = Function::Create(func_type, Function::ExternalLinkage, symbol, module);
+  }
+  Value *code_v = ConstantInt::get(context, APInt(32, code));
+  return builder.CreateCall(func, {code_v, generateFromRef(x, Int), vec});
 }
 
-Function *Codegen::generateBinary(Function *f0) {
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "binary", module);
-  {
-  BasicBlock *bb = BasicBlock::Create(context, "", f);
-  builder.SetInsertPoint(bb);
+bool Codegen::isExtern(const std::string &name, size_t n, Env<Value *> &env) {
+  auto it = externs.find(name);
+  if (it == externs.end() || it->second.arity == 0 || it->second.arity != n)
+    return false;
+  try {
+    return env.find(name).first == it->second.value;
+  } catch (Env<Value *>::NotFound e) {
+    return false;
+  }
+}
 
-  Value *stack = f->arg_begin();
+bool Codegen::isGlobal(const std::string &name, Value *value, Env<Value *> &env) {
+  try {
+    return env.find(name).first == value;
+  } catch (Env<Value *>::NotFound e) {
+    return false;
+  }
+}
 
-  Value *x = generatePop(refType, stack);
-  
-  Value *stack0 = generateMalloc(ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(refType) * 2)));
-  generatePush(x, stack0);
+bool Codegen::isOperator(const std::string &name, Env<Value *> &env) {
+  auto it = operators.find(name);
+  if (it == operators.end())
+    return false;
+  //it may well be shadowed by a variable
+  try {
+    return env.find(name).first == it->second;
+  } catch (Env<Value *>::NotFound e) {
+    return false;
+  }
+}
 
-  Value *clo = generateClosure(f0, stack0);
-  builder.CreateRet(clo);
+Codegen::Term Codegen::generate(const ast::Fixpoint *const fix, Env<Value *> &env) {
+  const ast::Abstraction *abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+  if (abs == NULL)
+    throw TermNotMatch(fix->term, typeid(ast::Abstraction));
+
+  //the lambdas right under the fixpoint are its parameters
+  std::vector<const ast::Abstraction *> params;
+  const ast::Term *body = abs->term;
+  while (auto abs0 = dynamic_cast<const ast::Abstraction *>(body)) {
+    params.push_back(abs0);
+    body = abs0->term;
   }
-  verifyFunction(*f);
-  Function *f1 = Function::Create(funcType, Function::ExternalLinkage, "f1", module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f1);
-  builder.SetInsertPoint(bb);
-  Value *m = generateMalloc(ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(refType))));
-  Value *clo = generateClosure(f, m);
-  builder.CreateRet(clo);
-  verifyFunction(*f1);
-  return f1;
+  if (params.empty())
+    throw TermNotMatch(abs->term, typeid(ast::Abstraction));
+  size_t n = params.size();
+  const ast::Term *memo = getMemo(body);
+  if (memo != NULL)
+    body = memo;
+
+  const ast::Type *type = abs->type;
+  for (auto param : params) {
+    auto func_type = dynamic_cast<const ast::FunctionType *>(type);
+    if (func_type == NULL)
+      throw ClassNotMatch(TermException(param, type), typeid(ast::FunctionType));
+    if (*func_type->left != *param->type)
+      throw TypeNotMatch(TermException(param, param->type), func_type->left);
+    type = func_type->right;
+  }
+
+  Env<Value *> env0;
+  std::vector<std::string> names;
+  std::vector<const ast::Type *> types;
+  std::set<std::string> fv = freeVariables(fix);
+  collectCaptures(fv, env, env0, names, types);
+
+  auto key = std::make_pair(static_cast<const ast::Term *>(fix), getShape(fv, env));
+  auto it = compiled.find(key);
+  if (it != compiled.end())
+    ++reused;
+  else {
+    /* the function itself takes all its parameters at once, with the
+       root closure as frame; that closure is also the value of the
+       function inside its body */
+    std::vector<Type *> elems(1, stackType);
+    elems.insert(elems.end(), n, refType);
+    Function *func = Function::Create(FunctionType::get(refType, elems, false),
+                                      Function::InternalLinkage, abs->arg, module);
+    bool heavy = freeVariables(abs->term).count(abs->arg) > 0 || isHeavy(body, env);
+    Known known = {func, n, abs->type, heavy};
+    //the results depend on the arguments alone when nothing is captured
+    bool memoize = memo != NULL && names.empty();
+    if (memo != NULL && !names.empty()) {
+      std::string why = abs->arg + " not memoized, it captures";
+      for (auto name : names)
+        why += " " + name;
+      unmemoized.push_back(why);
+    }
+    if (!memoize && hasConsCall(body, abs->arg, n)) {
+      auto ip = builder.saveIP();
+      generateDestination(func, known, abs, params, body, type, names, types, env, env0);
+      builder.restoreIP(ip);
+    } else {
+      auto ip = builder.saveIP();
+      //a memo function calls itself through the table too
+      Function *code = func;
+      if (memoize)
+        code = Function::Create(func->getFunctionType(), Function::InternalLinkage, abs->arg + " body", module);
+      BasicBlock *bb = BasicBlock::Create(context, "", code);
+      builder.SetInsertPoint(bb);
+      Function::arg_iterator args = code->arg_begin();
+      Value *stack = args++;
+
+      bindCaptures(stack, names, types, env, env0);
+      env0.push(abs->arg, abs->type, stack);
+      knowns[stack] = known;
+      for (auto param : params)
+        env0.push(param->arg, param->type, args++);
+
+      Term term = generate(body, env0);
+      if (*term.type != *type)
+        throw TypeNotMatch(TermException(body, term.type), type);
+      builder.CreateRet(term.value);
+      verifyFunction(*code);
+      if (memoize)
+        generateMemo(func, code, abs->arg, params);
+      builder.restoreIP(ip);
+    }
+
+    /* the curried stages, only reached when the function escapes: the
+       root closure holds the captures, stage i holds the root and the
+       first i arguments */
+    auto ip = builder.saveIP();
+    std::vector<Function *> stages = getCodes(fix);
+    if (!stages[0]->empty()) {
+      recompiled.insert(stages.begin(), stages.end());
+      stages.clear();
+      for (auto param : params)
+        stages.push_back(Function::Create(funcType, Function::InternalLinkage, "abs " + param->arg, module));
+    }
+    for (size_t i = 0; i < n; ++i) {
+      Function *f = stages[i];
+      BasicBlock *bb = BasicBlock::Create(context, "", f);
+      builder.SetInsertPoint(bb);
+      Function::arg_iterator args = f->arg_begin();
+      Value *stack = args++;
+      Value *arg = args;
+
+      std::vector<Value *> values;
+      values.push_back(i == 0 ? stack : generateFrameLoad(stack, 0));
+      for (unsigned j = 1; j <= i; ++j)
+        values.push_back(generateFrameLoad(stack, j));
+      values.push_back(arg);
+
+      if (i + 1 < n)
+        builder.CreateRet(generateClosure(stages[i + 1], values));
+      else
+        builder.CreateRet(builder.CreateCall(func, values));
+      verifyFunction(*f);
+    }
+    builder.restoreIP(ip);
+    it = compiled.insert(std::make_pair(key, Compiled{stages, known, abs->type})).first;
+  }
+  const std::vector<Function *> &stages = it->second.funcs;
+
+  Value *clo;
+  if (names.empty())
+    clo = generateClosure(stages[0]);
+  else {
+    std::vector<Value *> values;
+    for (auto name : names)
+      values.push_back(env.find(name).first);
+    clo = generateClosure(stages[0], values);
+  }
+  knowns[clo] = it->second.known;
+
+  return Term{clo, abs->type};
 }
 
-Codegen::Term Codegen::generatePrimitive(const std::string &prim) {
-	if (prim == "unit"){
-		Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-		BasicBlock *bb = BasicBlock::Create(context, "", f);
-		builder.SetInsertPoint(bb);
-		builder.CreateRet(ConstantPointerNull::get(refType));
-
-		verifyFunction(*f);
-		return Term{ generateBinary(f), new ast::PrimitiveType("unit") };
-	} else if (prim == "<") {
-    Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-    BasicBlock *bb = BasicBlock::Create(context, "", f);
-    builder.SetInsertPoint(bb);
-    Value *stack = f->arg_begin();
+void Codegen::generateMemo(Function *func, Function *code, const std::string &name,
+                           const std::vector<const ast::Abstraction *> &params) {
+  size_t n = params.size();
+  Type *i32 = IntegerType::get(context, 32);
+  Type *i64 = IntegerType::get(context, 64);
+  PointerType *rowType = PointerType::get(refType, 0);
+
+  //whether two rows of arguments are the same
+  FunctionType *equal_type = FunctionType::get(i32, {rowType, rowType}, false);
+  Function *equal = Function::Create(equal_type, Function::InternalLinkage, name + " equal", module);
+  builder.SetInsertPoint(BasicBlock::Create(context, "", equal));
+  Function::arg_iterator rows = equal->arg_begin();
+  Value *a = rows++, *b = rows;
+  Value *same = ConstantInt::getTrue(context);
+  for (size_t i = 0; i < n; ++i) {
+    Value *idx = ConstantInt::get(context, APInt(32, i));
+    Value *x = builder.CreateLoad(refType, builder.CreateGEP(a, idx));
+    Value *y = builder.CreateLoad(refType, builder.CreateGEP(b, idx));
+    same = builder.CreateAnd(same, generateEqual(x, y, params[i]->type));
+  }
+  builder.CreateRet(builder.CreateZExt(same, i32));
+  verifyFunction(*equal);
 
-    Value *y = generatePop(refType, stack);
-    Value *y_v = generateLoad(IntegerType::get(context, 32), y);
-    Value *x = generatePop(refType, stack);
-    Value *x_v = generateLoad(IntegerType::get(context, 32), x);
+  Function *table_f = module->getFunction("estlc_memo_table");
+  if (table_f == NULL) {
+    FunctionType *type = FunctionType::get(refType, {rowType, refType, i32, PointerType::get(equal_type, 0), i64, i32}, false);
+    table_f = Function::Create(type, Function::ExternalLinkage, "estlc_memo_table", module);
+  }
+  Function *get = module->getFunction("estlc_memo_get");
+  if (get == NULL) {
+    FunctionType *type = FunctionType::get(i32, {refType, i64, rowType, rowType}, false);
+    get = Function::Create(type, Function::ExternalLinkage, "estlc_memo_get", module);
+  }
+  Function *put = module->getFunction("estlc_memo_put");
+  if (put == NULL) {
+    FunctionType *type = FunctionType::get(Type::getVoidTy(context), {refType, i64, rowType, refType}, false);
+    put = Function::Create(type, Function::ExternalLinkage, "estlc_memo_put", module);
+  }
 
-    Value *res = builder.CreateICmpULT(x_v, y_v);
-    Value *ret = generateSum(res, ConstantPointerNull::get(refType));
-    builder.CreateRet(ret);
-    verifyFunction(*f);
+  BasicBlock *entry = BasicBlock::Create(context, "", func);
+  BasicBlock *hit = BasicBlock::Create(context, "", func);
+  BasicBlock *miss = BasicBlock::Create(context, "", func);
+  builder.SetInsertPoint(entry);
+  GlobalVariable *slot = new GlobalVariable(*module, refType, false, GlobalValue::InternalLinkage,
+                                            ConstantPointerNull::get(refType), name + " memo");
+  Value *table = builder.CreateCall(table_f, {slot, builder.CreateGlobalStringPtr(name),
+                                              ConstantInt::get(i32, n), equal,
+                                              ConstantInt::get(i64, memoSize), ConstantInt::get(i32, memoShared)});
+
+  std::vector<Value *> values;
+  for (auto it = func->arg_begin(); it != func->arg_end(); ++it)
+    values.push_back(&*it);
+  Value *row = builder.CreateAlloca(refType, ConstantInt::get(i32, n));
+  Value *hash = ConstantInt::get(i64, 0);
+  for (size_t i = 0; i < n; ++i) {
+    builder.CreateStore(values[i + 1], builder.CreateGEP(row, ConstantInt::get(context, APInt(32, i))));
+    hash = builder.CreateMul(builder.CreateXor(hash, generateHash(values[i + 1], params[i]->type)),
+                             ConstantInt::get(i64, 0x100000001b3ULL));
+  }
+  Value *slot_v = builder.CreateAlloca(refType);
+  Value *found = builder.CreateCall(get, {table, hash, row, slot_v});
+  builder.CreateCondBr(builder.CreateICmpNE(found, ConstantInt::get(i32, 0)), hit, miss);
 
-    return Term{generateBinary(f), new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                     new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                                           Bool))};
-  } else if (prim == ">=") {
-    Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-    BasicBlock *bb = BasicBlock::Create(context, "", f);
-    builder.SetInsertPoint(bb);
-    Value *stack = f->arg_begin();
+  builder.SetInsertPoint(hit);
+  builder.CreateRet(builder.CreateLoad(refType, slot_v));
 
-    Value *y = generatePop(refType, stack);
-    Value *y_v = generateLoad(IntegerType::get(context, 32), y);
-    Value *x = generatePop(refType, stack);
-    Value *x_v = generateLoad(IntegerType::get(context, 32), x);
+  builder.SetInsertPoint(miss);
+  Value *value = builder.CreateCall(code, values);
+  builder.CreateCall(put, {table, hash, row, value});
+  builder.CreateRet(value);
+  verifyFunction(*func);
+  ++memoized;
+}
 
-    Value *res = builder.CreateICmpUGE(x_v, y_v);
-    Value *ret = generateSum(res, ConstantPointerNull::get(refType));
-    builder.CreateRet(ret);
-    verifyFunction(*f);
+Value *Codegen::generateHash(Value *ref, const ast::Type *type) {
+  Type *i64 = IntegerType::get(context, 64);
+  //an Int is its own hash, as is any ref not looked into
+  if (dynamic_cast<const ast::SumType *>(type) == NULL && dynamic_cast<const ast::ProductType *>(type) == NULL)
+    return builder.CreatePtrToInt(ref, i64);
+  return builder.CreateCall(getHash(type), {ref});
+}
 
-    return Term{generateBinary(f), new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                     new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                                           Bool))};
-  } else if (prim == "+") {
-    Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-    BasicBlock *bb = BasicBlock::Create(context, "", f);
-    builder.SetInsertPoint(bb);
-    Value *stack = f->arg_begin();
+Value *Codegen::generateEqual(Value *a, Value *b, const ast::Type *type) {
+  if (dynamic_cast<const ast::SumType *>(type) == NULL && dynamic_cast<const ast::ProductType *>(type) == NULL)
+    return builder.CreateICmpEQ(a, b);
+  return builder.CreateCall(getEqual(type), {a, b});
+}
 
-    Value *y = generatePop(refType, stack);
-    Value *y_v = generateLoad(IntegerType::get(context, 32), y);
-    Value *x = generatePop(refType, stack);
-    Value *x_v = generateLoad(IntegerType::get(context, 32), x);
+/* the product a case of sum carries if its last field is sum again,
+   which the hash and the comparison go on with in a loop */
+static const ast::ProductType *getSpine(const ast::SumType *sum, size_t i) {
+  auto product = dynamic_cast<const ast::ProductType *>(sum->types[i].first);
+  if (product == NULL || product->types.empty() || product->types.back() != sum)
+    return NULL;
+  return product;
+}
 
-    Value *res = builder.CreateAdd(x_v, y_v);
-    Value *ret = generateSum(res, ConstantPointerNull::get(refType));
-    builder.CreateRet(ret);
-    verifyFunction(*f);
+Value *Codegen::generateField(Value *ref, const ast::ProductType *product, unsigned i) {
+  StructType *productType = abi.getProductType(product);
+  Value *p_c = builder.CreateBitCast(ref, PointerType::get(productType, 0));
+  Value *index[2] = {ConstantInt::get(context, APInt(32, 0)), ConstantInt::get(context, APInt(32, i))};
+  Value *v_p = builder.CreateGEP(p_c, index);
+  return generateToRef(builder.CreateLoad(productType->getElementType(i), v_p), product->types[i]);
+}
 
-    return Term{generateBinary(f), new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                         new ast::FunctionType(new ast::PrimitiveType("Int"),
-														 new ast::PrimitiveType("Int"))) };
+Function *Codegen::getHash(const ast::Type *type) {
+  auto it = hashes.find(type);
+  if (it != hashes.end())
+    return it->second;
+  Type *i64 = IntegerType::get(context, 64);
+  Function *f = Function::Create(FunctionType::get(i64, {refType}, false), Function::InternalLinkage,
+                                 "hash", module);
+  //a recursive type hashes its parts by the same function
+  hashes[type] = f;
+  auto ip = builder.saveIP();
+  BasicBlock *entry = BasicBlock::Create(context, "", f);
+  builder.SetInsertPoint(entry);
+  Value *ref = f->arg_begin();
+  auto mix = [&](Value *h, Value *x) {
+    return builder.CreateMul(builder.CreateXor(h, x), ConstantInt::get(i64, 0x100000001b3ULL));
+  };
+
+  if (auto sum = dynamic_cast<const ast::SumType *>(type)) {
+    //a last field of the same type is the next round, a long list is
+    //no deeper than a short one
+    BasicBlock *loop = BasicBlock::Create(context, "", f);
+    builder.CreateBr(loop);
+    builder.SetInsertPoint(loop);
+    PHINode *ref_phi = builder.CreatePHI(refType, 2);
+    PHINode *h_phi = builder.CreatePHI(i64, 2);
+    ref_phi->addIncoming(ref, entry);
+    h_phi->addIncoming(ConstantInt::get(i64, 0), entry);
+    auto pair = generateDesum(sum, ref_phi);
+    BasicBlock *bad = BasicBlock::Create(context, "", f);
+    BasicBlock *end = BasicBlock::Create(context, "", f);
+    SwitchInst *sw = builder.CreateSwitch(pair.first, bad, sum->types.size());
+    builder.SetInsertPoint(end);
+    PHINode *phi = builder.CreatePHI(i64, sum->types.size());
+    for (size_t i = 0; i < sum->types.size(); ++i) {
+      BasicBlock *bb = BasicBlock::Create(context, "", f);
+      sw->addCase(ConstantInt::get(context, APInt(32, i)), bb);
+      builder.SetInsertPoint(bb);
+      Value *h = mix(h_phi, ConstantInt::get(i64, i));
+      if (auto product = getSpine(sum, i)) {
+        unsigned last = product->types.size() - 1;
+        for (unsigned j = 0; j < last; ++j)
+          h = mix(h, generateHash(generateField(pair.second, product, j), product->types[j]));
+        ref_phi->addIncoming(generateField(pair.second, product, last), builder.GetInsertBlock());
+        h_phi->addIncoming(h, builder.GetInsertBlock());
+        builder.CreateBr(loop);
+        continue;
+      }
+      h = mix(h, generateHash(pair.second, sum->types[i].first));
+      phi->addIncoming(h, builder.GetInsertBlock());
+      builder.CreateBr(end);
+    }
+    builder.SetInsertPoint(bad);
+    builder.CreateUnreachable();
+    builder.SetInsertPoint(end);
+    builder.CreateRet(phi);
+  } else {
+    auto product = static_cast<const ast::ProductType *>(type);
+    Value *h = ConstantInt::get(i64, 0);
+    for (size_t i = 0; i < product->types.size(); ++i)
+      h = mix(h, generateHash(generateField(ref, product, i), product->types[i]));
+    builder.CreateRet(h);
+  }
+  verifyFunction(*f);
+  builder.restoreIP(ip);
+  return f;
+}
 
+Function *Codegen::getEqual(const ast::Type *type) {
+  auto it = equals.find(type);
+  if (it != equals.end())
+    return it->second;
+  Type *i1 = Type::getInt1Ty(context);
+  Function *f = Function::Create(FunctionType::get(i1, {refType, refType}, false), Function::InternalLinkage,
+                                 "equal", module);
+  equals[type] = f;
+  auto ip = builder.saveIP();
+  BasicBlock *entry = BasicBlock::Create(context, "", f);
+  BasicBlock *loop = BasicBlock::Create(context, "", f);
+  BasicBlock *yes = BasicBlock::Create(context, "", f);
+  BasicBlock *no = BasicBlock::Create(context, "", f);
+  BasicBlock *walk = BasicBlock::Create(context, "", f);
+  Function::arg_iterator args = f->arg_begin();
+  Value *a0 = args++, *b0 = args;
+  //the same ref is the same value, shared parts end the walk early; a
+  //last field of the same type is compared in the next round
+  builder.SetInsertPoint(entry);
+  builder.CreateBr(loop);
+  builder.SetInsertPoint(loop);
+  PHINode *a = builder.CreatePHI(refType, 2);
+  PHINode *b = builder.CreatePHI(refType, 2);
+  a->addIncoming(a0, entry);
+  b->addIncoming(b0, entry);
+  builder.CreateCondBr(builder.CreateICmpEQ(a, b), yes, walk);
+  builder.SetInsertPoint(walk);
+
+  if (auto sum = dynamic_cast<const ast::SumType *>(type)) {
+    auto x = generateDesum(sum, a);
+    auto y = generateDesum(sum, b);
+    BasicBlock *cases = BasicBlock::Create(context, "", f);
+    BasicBlock *bad = BasicBlock::Create(context, "", f);
+    builder.CreateCondBr(builder.CreateICmpEQ(x.first, y.first), cases, no);
+    builder.SetInsertPoint(cases);
+    SwitchInst *sw = builder.CreateSwitch(x.first, bad, sum->types.size());
+    for (size_t i = 0; i < sum->types.size(); ++i) {
+      BasicBlock *bb = BasicBlock::Create(context, "", f);
+      sw->addCase(ConstantInt::get(context, APInt(32, i)), bb);
+      builder.SetInsertPoint(bb);
+      auto product = getSpine(sum, i);
+      if (product == NULL) {
+        builder.CreateCondBr(generateEqual(x.second, y.second, sum->types[i].first), yes, no);
+        continue;
+      }
+      unsigned last = product->types.size() - 1;
+      for (unsigned j = 0; j < last; ++j) {
+        Value *same = generateEqual(generateField(x.second, product, j), generateField(y.second, product, j),
+                                    product->types[j]);
+        BasicBlock *next = BasicBlock::Create(context, "", f);
+        builder.CreateCondBr(same, next, no);
+        builder.SetInsertPoint(next);
+      }
+      a->addIncoming(generateField(x.second, product, last), builder.GetInsertBlock());
+      b->addIncoming(generateField(y.second, product, last), builder.GetInsertBlock());
+      builder.CreateBr(loop);
+    }
+    builder.SetInsertPoint(bad);
+    builder.CreateUnreachable();
+  } else {
+    auto product = static_cast<const ast::ProductType *>(type);
+    for (size_t i = 0; i < product->types.size(); ++i) {
+      Value *x = generateField(a, product, i);
+      Value *y = generateField(b, product, i);
+      BasicBlock *next = BasicBlock::Create(context, "", f);
+      builder.CreateCondBr(generateEqual(x, y, product->types[i]), next, no);
+      builder.SetInsertPoint(next);
+    }
+    builder.CreateBr(yes);
   }
-  else if (prim == "-") {
-	  Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-	  BasicBlock *bb = BasicBlock::Create(context, "", f);
-	  builder.SetInsertPoint(bb);
-	  Value *stack = f->arg_begin();
 
-	  Value *y = generatePop(refType, stack);
-	  Value *y_v = generateLoad(IntegerType::get(context, 32), y);
-	  Value *x = generatePop(refType, stack);
-	  Value *x_v = generateLoad(IntegerType::get(context, 32), x);
+  builder.SetInsertPoint(yes);
+  builder.CreateRet(ConstantInt::getTrue(context));
+  builder.SetInsertPoint(no);
+  builder.CreateRet(ConstantInt::getFalse(context));
+  verifyFunction(*f);
+  builder.restoreIP(ip);
+  return f;
+}
 
-	  Value *res = builder.CreateSub(x_v, y_v);
-	  Value *ret = generateSum(res, ConstantPointerNull::get(refType));
-	  builder.CreateRet(ret);
-	  verifyFunction(*f);
+bool Codegen::hasConsCall(const ast::Term *term, const std::string &self, size_t n) {
+  //whether some result of the function is a constructor around a call
+  //of the function itself
+  auto isSelfCall = [&](const ast::Term *term0) {
+    size_t m = 0;
+    while (auto app = dynamic_cast<const ast::Application *>(term0)) {
+      ++m;
+      term0 = app->func;
+    }
+    auto ref = dynamic_cast<const ast::Reference *>(term0);
+    return ref != NULL && ref->name == self && m == n;
+  };
+  if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    for (auto pair : des->cases)
+      if (pair.first != self && hasConsCall(pair.second, self, n))
+        return true;
+    return false;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    for (auto name : dep->names)
+      if (name == self)
+        return false;
+    return hasConsCall(dep->term, self, n);
+  }
+  auto app = dynamic_cast<const ast::Application *>(term);
+  if (app == NULL)
+    return false;
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(app->func))
+    return abs->arg != self && hasConsCall(abs->term, self, n);
+  auto ref = dynamic_cast<const ast::Reference *>(app->func);
+  if (ref == NULL || constructors.find(ref->name) == constructors.end())
+    return false;
+  const ast::Term *head = app->arg;
+  while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+    if (isSelfCall(app0->arg))
+      return true;
+    head = app0->func;
+  }
+  return false;
+}
 
-	  return Term{ generateBinary(f), new ast::FunctionType(new ast::PrimitiveType("Int"),
-		  new ast::FunctionType(new ast::PrimitiveType("Int"),
-		  new ast::PrimitiveType("Int"))) };
+void Codegen::generateDestination(Function *func, const Known &known, const ast::Abstraction *abs,
+                                  const std::vector<const ast::Abstraction *> &params, const ast::Term *body,
+                                  const ast::Type *type, const std::vector<std::string> &names,
+                                  const std::vector<const ast::Type *> &types, Env<Value *> &env,
+                                  Env<Value *> &env0) {
+  //the loop takes the hole to fill after the arguments
+  size_t n = params.size();
+  std::vector<Type *> elems(1, stackType);
+  elems.insert(elems.end(), n, refType);
+  elems.push_back(PointerType::get(refType, 0));
+  Function *loop = Function::Create(FunctionType::get(Type::getVoidTy(context), elems, false),
+                                    Function::InternalLinkage, abs->arg + " loop", module);
+
+  auto sum = dynamic_cast<const ast::SumType *>(type);
+  Function *lazy = NULL;
+  if (stream && sum != NULL && abi.isTagged(sum)) {
+    lazy = Function::Create(FunctionType::get(refType, {refType}, false), Function::InternalLinkage,
+                            abs->arg + " lazy", module);
+    builder.SetInsertPoint(BasicBlock::Create(context, "", lazy));
+    Value *frame = lazy->arg_begin();
+    std::vector<Value *> values;
+    for (size_t i = 0; i <= n; ++i)
+      values.push_back(generateFrameLoad(frame, i));
+    builder.CreateRet(builder.CreateCall(func, values));
+    verifyFunction(*lazy);
+  }
 
+  //the function itself only makes room for its result
+  BasicBlock *bb = BasicBlock::Create(context, "", func);
+  builder.SetInsertPoint(bb);
+  Value *slot = builder.CreateAlloca(refType);
+  std::vector<Value *> values;
+  for (auto it = func->arg_begin(); it != func->arg_end(); ++it)
+    values.push_back(&*it);
+  values.push_back(slot);
+  builder.CreateCall(loop, values);
+  builder.CreateRet(builder.CreateLoad(refType, slot));
+  verifyFunction(*func);
+
+  BasicBlock *entry = BasicBlock::Create(context, "", loop);
+  BasicBlock *header = BasicBlock::Create(context, "", loop);
+  BasicBlock *exit = BasicBlock::Create(context, "", loop);
+  builder.SetInsertPoint(entry);
+  Function::arg_iterator args = loop->arg_begin();
+  Value *stack = args++;
+
+  //env0 already has the constants the function uses
+  bindCaptures(stack, names, types, env, env0);
+  env0.push(abs->arg, abs->type, stack);
+  knowns[stack] = known;
+  builder.CreateBr(header);
+
+  builder.SetInsertPoint(header);
+  Destination dest = {abs, params, type, stack, header, exit, {}, NULL, {}, {}, lazy};
+  for (auto param : params) {
+    PHINode *phi = builder.CreatePHI(refType, 2);
+    phi->addIncoming(args++, entry);
+    dest.values.push_back(phi);
+    env0.push(param->arg, param->type, phi);
+  }
+  dest.hole = builder.CreatePHI(PointerType::get(refType, 0), 2);
+  dest.hole->addIncoming(args, entry);
+  if (chunk > 1) {
+    Type *intptrType = layout.getIntPtrType(context);
+    for (auto init : {ConstantPointerNull::get(refType), ConstantPointerNull::get(refType)}) {
+      dest.chunks.push_back(builder.CreatePHI(refType, 2));
+      dest.chunks.back()->addIncoming(init, entry);
+    }
+    dest.chunks.push_back(builder.CreatePHI(intptrType, 2));
+    dest.chunks.back()->addIncoming(ConstantInt::get(intptrType, 0), entry);
+    dest.heap.assign(dest.chunks.begin(), dest.chunks.end());
   }
-  else if (prim == "=") {
-    Function *f = Function::Create(funcType, Function::ExternalLinkage, prim, module);
-    BasicBlock *bb = BasicBlock::Create(context, "", f);
-    builder.SetInsertPoint(bb);
-    Value *stack = f->arg_begin();
 
-    Value *y = generatePop(refType, stack);
-    Value *y_v = generateLoad(IntegerType::get(context, 32), y);
-    Value *x = generatePop(refType, stack);
-    Value *x_v = generateLoad(IntegerType::get(context, 32), x);
+  const ast::Type *type0 = generateTail(body, env0, dest);
+  if (*type0 != *type)
+    throw TypeNotMatch(TermException(body, type0), type);
+  builder.SetInsertPoint(exit);
+  builder.CreateRetVoid();
+  verifyFunction(*loop);
+}
 
-    Value *res = builder.CreateICmpEQ(x_v, y_v);
-    Value *ret = generateSum(res, ConstantPointerNull::get(refType));
-    builder.CreateRet(ret);
-    verifyFunction(*f);
+const ast::Type *Codegen::generateTail(const ast::Term *term, Env<Value *> &env, Destination &dest) {
+  //the cases of a match each end the round on their own, nothing meets
+  if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    Term sum = generate(des->sum, env);
+    auto type = dynamic_cast<const ast::SumType *>(sum.type);
+    if (type == NULL)
+      throw ClassNotMatch(TermException(des->sum, sum.type), typeid(ast::SumType));
+    size_t n = type->types.size();
+    if (n != des->cases.size())
+      throw NumberNotMatch(TermException(des->sum, sum.type), des->cases.size());
+
+    auto pair = generateDesum(type, sum.value);
+    Function *f = builder.GetInsertBlock()->getParent();
+    BasicBlock *bad = BasicBlock::Create(context, "", f);
+    SwitchInst *sw = builder.CreateSwitch(pair.first, bad, n);
+    const ast::Type *termtype = NULL;
+    for (size_t i = 0; i < n; ++i) {
+      BasicBlock *bb = BasicBlock::Create(context, "", f);
+      sw->addCase(ConstantInt::get(context, APInt(32, i)), bb);
+      builder.SetInsertPoint(bb);
+      env.push(des->cases[i].first, type->types[i].first, pair.second);
+      const ast::Type *type0 = generateTail(des->cases[i].second, env, dest);
+      env.pop();
+      if (termtype == NULL)
+        termtype = type0;
+      else if (*termtype != *type0)
+        throw TypeNotMatch(TermException(des->cases[i].second, type0), termtype);
+    }
+    builder.SetInsertPoint(bad);
+    builder.CreateUnreachable();
+    return termtype;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    Term product = generate(dep->product, env);
+    auto type = dynamic_cast<const ast::ProductType *>(product.type);
+    if (type == NULL)
+      throw ClassNotMatch(TermException(dep->product, product.type), typeid(ast::ProductType));
+    auto n = generateFields(dep, type, product.value, env);
+    const ast::Type *type0 = generateTail(dep->term, env, dest);
+    for (unsigned i = 0; i < n; ++i)
+      (void)env.pop();
+    return type0;
+  }
 
-    return Term{generateBinary(f), new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                         new ast::FunctionType(new ast::PrimitiveType("Int"),
-                                                                               Bool))};
+  auto app = dynamic_cast<const ast::Application *>(term);
+  if (auto abs = app == NULL ? NULL : dynamic_cast<const ast::Abstraction *>(app->func)) {
+    Term arg = generate(app->arg, env);
+    if (*abs->type != *arg.type)
+      throw TypeNotMatch(TermException(app->arg, arg.type), abs->type);
+    env.push(abs->arg, abs->type, arg.value);
+    const ast::Type *type = generateTail(abs->term, env, dest);
+    env.pop();
+    return type;
+  }
 
+  //a call of the function itself is the next round, same hole
+  std::vector<const ast::Term *> args;
+  if (getSelfCall(term, env, dest, args)) {
+    generateLoop(dest, args, dest.hole, env);
+    return dest.result;
   }
 
-  
-  return Term{NULL, NULL};
+  /* a constructor around such a call: the cell is built with that
+     field left empty and goes into the hole, the field is the hole of
+     the next round */
+  auto ref = app == NULL ? NULL : dynamic_cast<const ast::Reference *>(app->func);
+  auto it = ref == NULL ? constructors.end() : constructors.find(ref->name);
+  if (it != constructors.end() && isGlobal(ref->name, it->second.value, env)) {
+    std::vector<const ast::Term *> fields;
+    const ast::Term *head = app->arg;
+    while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+      fields.insert(fields.begin(), app0->arg);
+      head = app0->func;
+    }
+    const ast::SumType *sum = it->second.sum;
+    uint32_t idx = it->second.idx;
+    auto cons = dynamic_cast<const ast::Reference *>(head);
+    auto it0 = cons == NULL ? products.end() : products.find(cons->name);
+    if (it0 != products.end() && isGlobal(cons->name, it0->second.second, env) &&
+        it0->second.first == sum->types[idx].first && fields.size() == it0->second.first->types.size()) {
+      const ast::ProductType *product = it0->second.first;
+      StructType *productType = abi.getProductType(product);
+      size_t hole = fields.size();
+      for (size_t j = fields.size(); j-- > 0; )
+        if (productType->getElementType(j) == refType && getSelfCall(fields[j], env, dest, args)) {
+          hole = j;
+          break;
+        }
+      if (hole < fields.size()) {
+        std::vector<Value *> values(fields.size(), NULL);
+        for (size_t j = 0; j < fields.size(); ++j)
+          if (j != hole) {
+            Term field = generate(fields[j], env);
+            if (*field.type != *product->types[j])
+              throw TypeNotMatch(TermException(fields[j], field.type), product->types[j]);
+            values[j] = generateFromRef(field.value, product->types[j]);
+          }
+        //a lazy round makes one cell, there is nothing to take in turn
+        Value *m = chunk > 1 && dest.lazy == NULL ? generateCell(dest, productType) : generateMalloc(productType);
+        Value *index[2] = {ConstantInt::get(context, APInt(32, 0))};
+        for (size_t j = 0; j < fields.size(); ++j)
+          if (j != hole) {
+            index[1] = ConstantInt::get(context, APInt(32, j));
+            builder.CreateStore(values[j], builder.CreateGEP(m, index));
+          }
+        Value *cell = generateSum(sum, ConstantInt::get(context, APInt(32, idx)), builder.CreateBitCast(m, refType));
+        builder.CreateStore(cell, dest.hole);
+        index[1] = ConstantInt::get(context, APInt(32, hole));
+        if (dest.lazy != NULL) {
+          builder.CreateStore(generateLazy(dest, args, env), builder.CreateGEP(m, index));
+          builder.CreateBr(dest.exit);
+          return sum;
+        }
+        generateLoop(dest, args, builder.CreateGEP(m, index), env);
+        dest.heap.assign(dest.chunks.begin(), dest.chunks.end());
+        return sum;
+      }
+    }
+  }
+
+  Term value = generate(term, env);
+  builder.CreateStore(value.value, dest.hole);
+  builder.CreateBr(dest.exit);
+  return value.type;
 }
-  
 
-Codegen::Term Codegen::generate(const ast::Fixpoint *const fix, Env<llvm::APInt> &env) {
-  const ast::Abstraction *abs = dynamic_cast<const ast::Abstraction *>(fix->term);
-  if (abs == NULL)
-    throw TermNotMatch(fix->term, typeid(ast::Abstraction));
-  env.push(abs->arg, abs->type, APInt(64, layout.getTypeAllocSize(refType)));
-  Term term = generate(abs->term, env);
-  if (*term.type != *abs->type)
-    throw TypeNotMatch(TermException(abs->term, term.type), abs->type);
+bool Codegen::getSelfCall(const ast::Term *term, Env<Value *> &env, const Destination &dest,
+                          std::vector<const ast::Term *> &args) {
+  args.clear();
+  const ast::Term *head = term;
+  while (auto app = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app->arg);
+    head = app->func;
+  }
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  return ref != NULL && ref->name == dest.abs->arg && args.size() == dest.params.size() &&
+    isGlobal(ref->name, dest.self, env);
+}
 
-  const ast::FunctionType *type = dynamic_cast<const ast::FunctionType *>(term.type);
-  if (type == NULL)
-    throw ClassNotMatch(TermException(abs->term, term.type), typeid(ast::FunctionType));
-
-  Value *Gclo_p = new GlobalVariable(*module,
-                                     refType,
-                                      false,
-                                     GlobalValue::InternalLinkage,
-                                     ConstantPointerNull::get(PclosureType),
-                                      "Gclo " + abs->arg);
-
-  Function *co = Function::Create(funcType, Function::ExternalLinkage, "co " + abs->arg, module);
-  {
-    BasicBlock *bb = BasicBlock::Create(context, "", co);
-    builder.SetInsertPoint(bb);
-    Value *stack = co->arg_begin();
+void Codegen::generateLoop(Destination &dest, const std::vector<const ast::Term *> &args, Value *hole, Env<Value *> &env) {
+  std::vector<Value *> values;
+  for (size_t i = 0; i < args.size(); ++i) {
+    Term arg = generate(args[i], env);
+    if (*arg.type != *dest.params[i]->type)
+      throw TypeNotMatch(TermException(args[i], arg.type), dest.params[i]->type);
+    values.push_back(arg.value);
+  }
+  BasicBlock *bb = builder.GetInsertBlock();
+  for (size_t i = 0; i < values.size(); ++i)
+    dest.values[i]->addIncoming(values[i], bb);
+  dest.hole->addIncoming(hole, bb);
+  for (size_t i = 0; i < dest.chunks.size(); ++i)
+    dest.chunks[i]->addIncoming(dest.heap[i], bb);
+  builder.CreateBr(dest.header);
+}
 
-    Value *x = generatePop(refType, stack);
-    Value *stack0 = generatePop(stackType, stack);
+Value *Codegen::generateLazy(Destination &dest, const std::vector<const ast::Term *> &args, Env<Value *> &env) {
+  std::vector<Value *> values(1, dest.self);
+  for (size_t i = 0; i < args.size(); ++i) {
+    Term arg = generate(args[i], env);
+    if (*arg.type != *dest.params[i]->type)
+      throw TypeNotMatch(TermException(args[i], arg.type), dest.params[i]->type);
+    values.push_back(arg.value);
+  }
+  Value *frame = generateClosure(builder.CreateBitCast(dest.lazy, PfuncType), values);
+  Function *lazy = module->getFunction("estlc_lazy");
+  if (lazy == NULL)
+    lazy = Function::Create(FunctionType::get(refType, {dest.lazy->getType(), refType}, false),
+                            Function::ExternalLinkage, "estlc_lazy", module);
+  return builder.CreateCall(lazy, {dest.lazy, frame});
+}
 
-    Value *clo = generateEval(term.value, stack0);
-    auto pair = generateDeclosure(clo);
-    Value *func1 = pair.first;
-    Value *stack1 = pair.second;
+Value *Codegen::generateCell(Destination &dest, StructType *type) {
+  /* the cells of one run of the loop are taken in turn from chunks,
+     each twice the one before up to chunk cells, so that a list is
+     mostly contiguous and allocated a few times only */
+  Type *intptrType = layout.getIntPtrType(context);
+  uint64_t stride = (layout.getTypeAllocSize(type) + ESTLC_TAG_MASK) & ~(uint64_t)ESTLC_TAG_MASK;
+  Value *stride_c = ConstantInt::get(intptrType, stride);
+  Value *next = dest.heap[0], *end = dest.heap[1], *size = dest.heap[2];
+
+  Function *f = builder.GetInsertBlock()->getParent();
+  BasicBlock *entry = builder.GetInsertBlock();
+  BasicBlock *refill = BasicBlock::Create(context, "", f);
+  BasicBlock *take = BasicBlock::Create(context, "", f);
+  Value *left = builder.CreateSub(builder.CreatePtrToInt(end, intptrType), builder.CreatePtrToInt(next, intptrType));
+  builder.CreateCondBr(builder.CreateICmpULT(left, stride_c), refill, take);
+
+  builder.SetInsertPoint(refill);
+  Value *first = ConstantInt::get(intptrType, 2 * stride);
+  Value *bytes = builder.CreateSelect(builder.CreateICmpULT(size, first), first, size);
+  Value *m = generateMalloc(bytes);
+  Value *end0 = builder.CreateGEP(m, bytes);
+  Value *most = ConstantInt::get(intptrType, chunk * stride);
+  Value *twice = builder.CreateShl(bytes, 1);
+  Value *size0 = builder.CreateSelect(builder.CreateICmpULT(twice, most), twice, most);
+  builder.CreateBr(take);
+
+  builder.SetInsertPoint(take);
+  PHINode *cell = builder.CreatePHI(refType, 2);
+  cell->addIncoming(next, entry);
+  cell->addIncoming(m, refill);
+  PHINode *end1 = builder.CreatePHI(refType, 2);
+  end1->addIncoming(end, entry);
+  end1->addIncoming(end0, refill);
+  PHINode *size1 = builder.CreatePHI(intptrType, 2);
+  size1->addIncoming(size, entry);
+  size1->addIncoming(size0, refill);
+  dest.heap = {builder.CreateGEP(cell, stride_c), end1, size1};
+  return builder.CreateBitCast(cell, PointerType::get(type, 0));
+}
 
-    Value *Gclo = builder.CreateLoad(refType, Gclo_p);
-    generatePush(Gclo, stack1);
-    generatePush(x, stack1);
+bool Codegen::isHeavy(const ast::Term *term, Env<Value *> &env) {
+  //a call of a Func that loops may be any amount of work, the rest is
+  //cheap; a lambda is no work until it is called
+  if (getPar(term) != NULL)
+    return true;
+  if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    std::vector<const ast::Term *> args;
+    const ast::Term *head = app;
+    while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+      args.push_back(app0->arg);
+      head = app0->func;
+    }
+    int num;
+    auto ref = dynamic_cast<const ast::Reference *>(head);
+    if (ref != NULL && !isLiteral(ref->name, num)) {
+      //a name bound inside the term is not in env, and is not a Func
+      try {
+        auto it = knowns.find(env.find(ref->name).first);
+        if (it != knowns.end() && args.size() >= it->second.arity && it->second.heavy)
+          return true;
+      } catch (Env<Value *>::NotFound e) {}
+    }
+    for (auto arg : args)
+      if (isHeavy(arg, env))
+        return true;
+    return ref == NULL && isHeavy(head, env);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    if (isHeavy(des->sum, env))
+      return true;
+    for (auto pair : des->cases)
+      if (isHeavy(pair.second, env))
+        return true;
+    return false;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    return isHeavy(dep->product, env) || isHeavy(dep->term, env);
+  }
+  return false;
+}
 
-    Value *ret = generateEval(func1, stack1);
-    builder.CreateRet(ret);
+std::vector<Codegen::Term> Codegen::generateArgs(const std::vector<const ast::Term *> &args, Env<Value *> &env) {
+  //what is marked par is spawned; calls are when two or more of them
+  //would otherwise run one after the other. The last one is left to
+  //run here while the tasks do
+  std::vector<bool> spawned(args.size(), false);
+  if (parallel) {
+    std::vector<size_t> heavy;
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (getPar(args[i]) != NULL)
+        spawned[i] = true;
+      else if (isHeavy(args[i], env))
+        heavy.push_back(i);
+    }
+    if (heavy.size() >= 2)
+      for (auto i : heavy)
+        spawned[i] = true;
+    if (!args.empty() && std::find(spawned.begin(), spawned.end(), false) == spawned.end())
+      spawned.back() = false;
   }
-  verifyFunction(*co);
 
-  Function *f = Function::Create(funcType, Function::ExternalLinkage, "fix " + abs->arg, module);
-  BasicBlock *bb = BasicBlock::Create(context, "", f);
-  builder.SetInsertPoint(bb);
-  Value *stack = f->arg_begin();
-  
-  Value *stack_co = generateMalloc(ConstantInt::get(context, APInt(64, layout.getTypeAllocSize(refType) * 4)));
-  generatePush(stack, stack_co);
-  
-  
-  Value *clo = generateClosure(co, stack_co);
-  builder.CreateStore(clo, Gclo_p);
+  std::vector<Term> terms(args.size());
+  std::vector<Value *> tasks(args.size(), NULL);
+  for (size_t i = 0; i < args.size(); ++i)
+    if (spawned[i])
+      tasks[i] = generateSpawn(args[i], env, terms[i].type);
+  for (size_t i = 0; i < args.size(); ++i)
+    if (!spawned[i])
+      terms[i] = generate(args[i], env);
+  if (std::find(spawned.begin(), spawned.end(), true) == spawned.end())
+    return terms;
+
+  Function *join = module->getFunction("estlc_join");
+  if (join == NULL)
+    join = Function::Create(FunctionType::get(refType, {refType}, false), Function::ExternalLinkage,
+                            "estlc_join", module);
+  for (size_t i = 0; i < args.size(); ++i)
+    if (spawned[i])
+      terms[i].value = builder.CreateCall(join, {tasks[i]});
+  return terms;
+}
 
-  builder.CreateRet(clo);
-  verifyFunction(*f);
-  env.pop();
-  return Term{f, abs->type};
+Value *Codegen::generateSpawn(const ast::Term *term, Env<Value *> &env, const ast::Type *&type) {
+  //the task is a closure taking unit, run by the runtime as any other
+  if (auto arg = getPar(term))
+    term = arg;
+  auto &thunk = thunks[term];
+  if (thunk == NULL)
+    thunk = at(new ast::Abstraction("#par", Unit, term), term);
+  Term clo = generate(thunk, env);
+  type = dynamic_cast<const ast::FunctionType *>(clo.type)->right;
+
+  Function *spawn = module->getFunction("estlc_spawn");
+  if (spawn == NULL)
+    spawn = Function::Create(FunctionType::get(refType, {refType}, false), Function::ExternalLinkage,
+                             "estlc_spawn", module);
+  return builder.CreateCall(spawn, {clo.value});
 }
 
-std::pair<Value *, Value *> Codegen::generateDeclosure(Value *clo) {
-  generatePrintf("begin Declo [%p]\n", clo);
-  Value *clo_c = builder.CreateBitCast(clo, PclosureType);
-  Value *index[2] = {ConstantInt::get(context, APInt(32, 0))};
-  index[1] = ConstantInt::get(context, APInt(32, 0));
-  Value *func_p = builder.CreateGEP(clo_c, index);
-  index[1] = ConstantInt::get(context, APInt(32, 1));
-  Value *stack_p = builder.CreateGEP(clo_c, index);
+Codegen::Term Codegen::generateCall(const Known &known, Value *stack, const std::vector<const ast::Term *> &args, Env<Value *> &env) {
+  std::vector<Value *> values(1, stack);
+  Value *value = NULL;
+  const ast::Type *type = known.type;
+  auto terms = generateArgs(args, env);
+  for (size_t i = 0; i < args.size(); ++i) {
+    Term arg = terms[i];
+    auto func_type = dynamic_cast<const ast::FunctionType *>(type);
+    if (func_type == NULL)
+      throw ClassNotMatch(TermException(args[i], type), typeid(ast::FunctionType));
+    if (*func_type->left != *arg.type)
+      throw TypeNotMatch(TermException(args[i], arg.type), func_type->left);
+    type = func_type->right;
+
+    //the extra arguments go to whatever the call returned
+    if (i < known.arity) {
+      values.push_back(arg.value);
+      if (i + 1 == known.arity)
+        value = builder.CreateCall(known.func, values);
+    } else
+      value = generateApply(value, arg.value);
+  }
+  return Term{value, type};
+}
 
-  generatePrintf("Load [%p]\n", func_p);
+std::pair<Value *, Value *> Codegen::generateDeclosure(Value *clo) {
+  //the closure itself is the frame, only the code needs a load
+  Value *func_p = builder.CreateBitCast(clo, PointerType::get(PfuncType, 0));
   Value *func = builder.CreateLoad(PfuncType, func_p);
-  generatePrintf("Load [%p]\n", stack_p);
-  Value *stack = builder.CreateLoad(stackType, stack_p);
-  generatePrintf("end Declo [%p]\n", clo);
-  return std::make_pair(func, stack);
+  return std::make_pair(func, clo);
 }
 
 Value *Codegen::generatePrintf(const char *const fmt, Value *val) {
@@ -842,28 +1832,66 @@ Value *Codegen::generatePrintf(const char *const fmt, Value *val) {
   return builder.CreateCall(printf, args);
 }
 
-Value *Codegen::generateEval(Value *eval, Value *stack) {
-  generatePrintf("begin eval [%p]", eval);
-  generatePrintf("with stack %p\n", stack);
-  Value *ret = builder.CreateCall(eval, {stack});
-  generatePrintf("end eval [%p] ", eval);
-  generatePrintf("= %p\n", ret);
-  return ret;
-}
-
-Value *Codegen::generateLoad(Type *type, Value *ptr) {
-  //comment this out since this disables LLVM type checking.
-  //very dangerous.
-  Value *ptr_c = builder.CreateBitCast(ptr, PointerType::get(type, 0));
-  Value *val = builder.CreateLoad(type, ptr_c);
-  return val;
+size_t Codegen::fold() {
+  //folding some functions may make their callers the same, so until
+  //nothing changes
+  size_t folded = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    std::map<std::string, GlobalValue *> bodies;
+    std::vector<GlobalValue *> values;
+    for (auto &func : *module)
+      values.push_back(&func);
+    for (auto it = module->global_begin(); it != module->global_end(); ++it)
+      values.push_back(&*it);
+    for (auto value : values) {
+      //only what nothing outside can name, all but umain
+      if (value->isDeclaration() || !value->hasLocalLinkage())
+        continue;
+      //the printed body leaves the name out; a function calling itself
+      //names itself and is only folded with itself
+      std::string body;
+      raw_string_ostream os(body);
+      value->getType()->print(os);
+      if (auto func = dyn_cast<Function>(value)) {
+        for (auto &bb : *func)
+          bb.print(os);
+      } else {
+        auto var = cast<GlobalVariable>(value);
+        if (!var->isConstant())
+          continue;
+        os << " = ";
+        var->getInitializer()->print(os);
+      }
+      os.flush();
+      auto it = bodies.find(body);
+      if (it == bodies.end()) {
+        bodies[body] = value;
+        continue;
+      }
+      value->replaceAllUsesWith(it->second);
+      if (isa<Function>(value))
+        ++folded;
+      value->eraseFromParent();
+      changed = true;
+    }
+  }
+  return folded;
 }
 
 void Codegen::dump() {
   module->dump();
 }
 
-Value *Codegen::generateSum(Value *idx, Value *ref) {
+Value *Codegen::generateSum(const ast::SumType *type, Value *idx, Value *ref) {
+  if (abi.isTagged(type)) {
+    //put the index into the low bits of the payload pointer
+    Type *intptrType = layout.getIntPtrType(context);
+    Value *ref_i = builder.CreatePtrToInt(ref, intptrType);
+    Value *idx_c = builder.CreateIntCast(idx, intptrType, false);
+    return builder.CreateIntToPtr(builder.CreateOr(ref_i, idx_c), refType);
+  }
+
   Value *sum = generateMalloc(sumType);
   Value *index[2] = {ConstantInt::get(context, APInt(32, 0))};
   
@@ -880,3 +1908,66 @@ Value *Codegen::generateSum(Value *idx, Value *ref) {
 
   return sum_c;
 }
+
+std::pair<Value *, Value *> Codegen::generateDesum(const ast::SumType *type, Value *sum) {
+  if (abi.isTagged(type)) {
+    //mask the index out of the pointer, no memory access
+    Type *intptrType = layout.getIntPtrType(context);
+    Value *sum_i = builder.CreatePtrToInt(sum, intptrType);
+    Value *mask = ConstantInt::get(intptrType, (1u << Layout::tagBits) - 1);
+    if (stream) {
+      //a producer is run once, then it is the value it made
+      Function *force = module->getFunction("estlc_force");
+      if (force == NULL)
+        force = Function::Create(FunctionType::get(refType, {refType}, false), Function::ExternalLinkage,
+                                 "estlc_force", module);
+      Function *f = builder.GetInsertBlock()->getParent();
+      BasicBlock *entry = builder.GetInsertBlock();
+      BasicBlock *lazy = BasicBlock::Create(context, "", f);
+      BasicBlock *done = BasicBlock::Create(context, "", f);
+      Value *lazy_c = ConstantInt::get(intptrType, ESTLC_LAZY);
+      builder.CreateCondBr(builder.CreateICmpEQ(builder.CreateAnd(sum_i, mask), lazy_c), lazy, done);
+      builder.SetInsertPoint(lazy);
+      Value *forced = builder.CreatePtrToInt(builder.CreateCall(force, {sum}), intptrType);
+      builder.CreateBr(done);
+      builder.SetInsertPoint(done);
+      PHINode *phi = builder.CreatePHI(intptrType, 2);
+      phi->addIncoming(sum_i, entry);
+      phi->addIncoming(forced, lazy);
+      sum_i = phi;
+    }
+    Value *idx = builder.CreateIntCast(builder.CreateAnd(sum_i, mask), indexType, false);
+    Value *ref = builder.CreateIntToPtr(builder.CreateAnd(sum_i, builder.CreateNot(mask)), refType);
+    return std::make_pair(idx, ref);
+  }
+
+  Value *value = builder.CreateBitCast(sum, PointerType::get(sumType, 0));
+
+  //read the first 4 bytes of index
+  Value *index[2];
+  index[0] = ConstantInt::get(context, APInt(32, 0));
+  index[1] = ConstantInt::get(context, APInt(32, 0));
+  Value *idx_p = builder.CreateGEP(value, index);
+  index[1] = ConstantInt::get(context, APInt(32, 1));
+  Value *ref_p = builder.CreateGEP(value, index);
+
+  Value *idx = builder.CreateLoad(indexType, idx_p);
+  Value *ref = builder.CreateLoad(refType, ref_p);
+  return std::make_pair(idx, ref);
+}
+
+Value *Codegen::generateToRef(Value *value, const ast::Type *type) {
+  if (abi.getPrimitiveWidth(type) == 0)
+    return value;
+  //the primitive is carried in the bits of the ref, never boxed
+  Value *value_i = builder.CreateZExt(value, layout.getIntPtrType(context));
+  return builder.CreateIntToPtr(value_i, refType);
+}
+
+Value *Codegen::generateFromRef(Value *ref, const ast::Type *type) {
+  unsigned width = abi.getPrimitiveWidth(type);
+  if (width == 0)
+    return ref;
+  Value *ref_i = builder.CreatePtrToInt(ref, layout.getIntPtrType(context));
+  return builder.CreateTrunc(ref_i, IntegerType::get(context, width));
+}
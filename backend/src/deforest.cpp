@@ -0,0 +1,681 @@
+#include "deforest.hpp"
+#include "analysis.hpp"
+#include "exception.hpp"
+#include "flow.hpp"
+
+Deforester::Deforester(const Options &options, Report &report)
+  :options(options), report(report), fresh(0) {}
+
+const ast::Program *Deforester::run(const ast::Program &prog) {
+  if (!options.deforest)
+    return &prog;
+  types.insert(prog.types.begin(), prog.types.end());
+  for (auto pair : prog.types) {
+    if (auto sum = dynamic_cast<const ast::SumType *>(pair.second)) {
+      for (size_t i = 0; i < sum->types.size(); ++i) {
+        constructors[sum->types[i].second] = std::make_pair(sum, i);
+        if (auto product = dynamic_cast<const ast::ProductType *>(sum->types[i].first))
+          products[product->cons] = product;
+      }
+    } else if (auto product = dynamic_cast<const ast::ProductType *>(pair.second))
+      products[product->cons] = product;
+  }
+  for (auto pair : globalTypes(prog))
+    globals.insert(pair.first);
+
+  auto term = transformBody(prog.term, Traversals(), Locals());
+  return new ast::Program(types, term, prog.externs);
+}
+
+std::string Deforester::getFresh(const std::string &prefix) {
+  //'#' starts a comment in the source, no user name has one
+  return "#" + prefix + std::to_string(fresh++);
+}
+
+/* the term with references to from renamed to, NULL stays NULL */
+static const ast::Term *rename(const ast::Term *term, const std::string &from, const std::string &to) {
+  if (term == NULL)
+    return NULL;
+  return substitute(term, from, new ast::Reference(to));
+}
+
+static const ast::Term *apply(const ast::Term *func, const std::vector<const ast::Term *> &args,
+                              const ast::Term *from) {
+  for (auto arg : args)
+    func = at(new ast::Application(func, arg), from);
+  return func;
+}
+
+static const ast::Term *makeFunction(const std::string &name, const std::vector<std::pair<std::string, const ast::Type *> > &params,
+                                     const ast::Type *result, const ast::Term *body, const ast::Term *from) {
+  const ast::Type *type = result;
+  for (size_t j = params.size(); j-- > 0; ) {
+    body = at(new ast::Abstraction(params[j].first, params[j].second, body), from);
+    type = new ast::FunctionType(params[j].second, type);
+  }
+  return at(new ast::Fixpoint(at(new ast::Abstraction(name, type, body), from)), from);
+}
+
+static const ast::Type *getType(const ast::Term *fix) {
+  return static_cast<const ast::Abstraction *>(static_cast<const ast::Fixpoint *>(fix)->term)->type;
+}
+
+static bool contains(const ast::Term *term, const ast::Term *node) {
+  if (term == node)
+    return true;
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    return contains(abs->term, node);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    return contains(app->func, node) || contains(app->arg, node);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    if (contains(des->sum, node))
+      return true;
+    for (auto pair : des->cases)
+      if (contains(pair.second, node))
+        return true;
+    return false;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    return contains(dep->product, node) || contains(dep->term, node);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    return contains(fix->term, node);
+  }
+  return false;
+}
+
+bool Deforester::getTraversal(const std::string &name, const ast::Fixpoint *fix, Traversal &t) {
+  auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+  auto params = Flow::getParams(fix);
+  if (abs == NULL || params.empty())
+    return false;
+  auto body = dynamic_cast<const ast::Desum *>(params.back()->term);
+  auto ref = body == NULL ? NULL : dynamic_cast<const ast::Reference *>(body->sum);
+  if (ref == NULL)
+    return false;
+
+  //parameters are told apart by their names
+  std::set<std::string> names;
+  names.insert(abs->arg);
+  for (auto param : params)
+    if (!names.insert(param->arg).second)
+      return false;
+  size_t k = 0;
+  while (k < params.size() && params[k]->arg != ref->name)
+    ++k;
+  if (k == params.size())
+    return false;
+  auto sum = dynamic_cast<const ast::SumType *>(params[k]->type);
+  if (sum == NULL || sum->types.size() != body->cases.size())
+    return false;
+  const ast::Type *result = abs->type;
+  for (size_t j = 0; j < params.size(); ++j) {
+    auto func_type = dynamic_cast<const ast::FunctionType *>(result);
+    if (func_type == NULL)
+      return false;
+    result = func_type->right;
+  }
+  t = Traversal{name, abs, params, k, sum, body, result};
+
+  //each case recurses on one field of what it matched, if at all
+  std::vector<std::string> statics;
+  for (auto param : params)
+    statics.push_back(param->arg);
+  for (auto pair : body->cases) {
+    bool under;
+    if (pair.first == abs->arg || countUses(pair.second, abs->arg, under) == 0)
+      continue;
+    auto dep = dynamic_cast<const ast::Deproduct *>(pair.second);
+    auto ref0 = dep == NULL ? NULL : dynamic_cast<const ast::Reference *>(dep->product);
+    if (ref0 == NULL || ref0->name != pair.first)
+      return false;
+    bool found = false;
+    for (auto field : dep->names) {
+      Locals bound(dep->names.begin(), dep->names.end());
+      bound.insert(pair.first);
+      bound.erase(field);
+      if (replaceCalls(dep->term, t, field, statics, "#", true, bound) != NULL) {
+        found = true;
+        break;
+      }
+    }
+    if (!found)
+      return false;
+  }
+  return true;
+}
+
+bool Deforester::getCall(const ast::Term *term, const Traversals &ts, Call &call) {
+  std::vector<const ast::Term *> args;
+  const ast::Term *head = term;
+  while (auto app = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app->arg);
+    head = app->func;
+  }
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  if (ref == NULL)
+    return false;
+  auto it = ts.find(ref->name);
+  if (it == ts.end() || args.size() != it->second->params.size())
+    return false;
+  call.term = term;
+  call.t = it->second;
+  call.args = args;
+  return true;
+}
+
+const ast::Term *Deforester::replaceCalls(const ast::Term *term, const Traversal &t, const std::string &field,
+                                          const std::vector<std::string> &statics, const std::string &name,
+                                          bool strict, Locals bound) {
+  /* the calls of t on field with the static parameters unchanged become
+     references to name; if strict, NULL when t is used any other way */
+  const std::string &self = t.abs->arg;
+  if (bound.count(self))
+    return copyTerm(term);
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (strict && ref->name == self)
+      return NULL;
+    return copyTerm(term);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    bound.insert(abs->arg);
+    auto body = replaceCalls(abs->term, t, field, statics, name, strict, bound);
+    return body == NULL ? NULL : at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    std::vector<const ast::Term *> args;
+    const ast::Term *head = term;
+    while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+      args.insert(args.begin(), app0->arg);
+      head = app0->func;
+    }
+    auto ref = dynamic_cast<const ast::Reference *>(head);
+    if (ref != NULL && ref->name == self && args.size() == t.params.size()) {
+      bool matches = true;
+      for (size_t j = 0; j < args.size() && matches; ++j) {
+        auto arg = dynamic_cast<const ast::Reference *>(args[j]);
+        const std::string &expected = j == t.k ? field : statics[j];
+        matches = arg != NULL && arg->name == expected && !bound.count(expected);
+      }
+      if (matches)
+        return at(new ast::Reference(name), term);
+    }
+    auto func = replaceCalls(app->func, t, field, statics, name, strict, bound);
+    auto arg = replaceCalls(app->arg, t, field, statics, name, strict, bound);
+    if (func == NULL || arg == NULL)
+      return NULL;
+    return at(new ast::Application(func, arg), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto sum = replaceCalls(des->sum, t, field, statics, name, strict, bound);
+    if (sum == NULL)
+      return NULL;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      Locals bound0(bound);
+      bound0.insert(pair.first);
+      auto term0 = replaceCalls(pair.second, t, field, statics, name, strict, bound0);
+      if (term0 == NULL)
+        return NULL;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return at(new ast::Desum(sum, cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto product = replaceCalls(dep->product, t, field, statics, name, strict, bound);
+    bound.insert(dep->names.begin(), dep->names.end());
+    auto body = replaceCalls(dep->term, t, field, statics, name, strict, bound);
+    if (product == NULL || body == NULL)
+      return NULL;
+    return at(new ast::Deproduct(product, dep->names, body), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = replaceCalls(fix->term, t, field, statics, name, strict, bound);
+    return body == NULL ? NULL : at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+bool Deforester::isClosed(const ast::Term *term, const Locals &locals, const std::set<std::string> &allowed) {
+  //a new function may only see what every scope sees, and what it is allowed
+  for (auto name : freeVariables(term)) {
+    if (allowed.count(name))
+      continue;
+    if (globals.count(name) && !locals.count(name))
+      continue;
+    return false;
+  }
+  return true;
+}
+
+const ast::Term *Deforester::transform(const ast::Term *term, Traversals ts, const Locals &locals) {
+  if (dynamic_cast<const ast::Reference *>(term)) {
+    return term;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    ts.erase(abs->arg);
+    Locals locals0(locals);
+    locals0.insert(abs->arg);
+    auto body = transformBody(abs->term, ts, locals0);
+    return body == abs->term ? term : at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    if (auto let = transformLet(app, ts, locals))
+      return let;
+    //a traversal over what another one produces
+    Call consumer, producer;
+    if (getCall(app, ts, consumer) && getCall(consumer.args[consumer.t->k], ts, producer)) {
+      auto term0 = fuse(consumer, producer, locals);
+      if (term0 != NULL)
+        return transform(term0, ts, locals);
+    }
+    auto func = transform(app->func, ts, locals);
+    auto arg = transform(app->arg, ts, locals);
+    if (func == app->func && arg == app->arg)
+      return term;
+    return at(new ast::Application(func, arg), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto sum = transform(des->sum, ts, locals);
+    bool changed = sum != des->sum;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      Traversals ts0(ts);
+      ts0.erase(pair.first);
+      Locals locals0(locals);
+      locals0.insert(pair.first);
+      auto term0 = transformBody(pair.second, ts0, locals0);
+      changed = changed || term0 != pair.second;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return changed ? at(new ast::Desum(sum, cases), term) : term;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto product = transform(dep->product, ts, locals);
+    for (auto name : dep->names)
+      ts.erase(name);
+    Locals locals0(locals);
+    locals0.insert(dep->names.begin(), dep->names.end());
+    auto body = transformBody(dep->term, ts, locals0);
+    if (product == dep->product && body == dep->term)
+      return term;
+    return at(new ast::Deproduct(product, dep->names, body), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = transform(fix->term, ts, locals);
+    return body == fix->term ? term : at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *Deforester::transformBody(const ast::Term *term, const Traversals &ts, const Locals &locals) {
+  //two traversals of the same list, done at once
+  std::vector<Call> calls;
+  collectCalls(term, ts, Locals(), calls);
+  for (size_t i = 0; i < calls.size(); ++i)
+    for (size_t j = i + 1; j < calls.size(); ++j) {
+      const Call &c1 = calls[i], &c2 = calls[j];
+      auto l1 = static_cast<const ast::Reference *>(c1.args[c1.t->k]);
+      auto l2 = static_cast<const ast::Reference *>(c2.args[c2.t->k]);
+      //a call needing the other for its arguments cannot go with it
+      if (l1->name != l2->name || equalTerms(c1.term, c2.term) ||
+          contains(c1.term, c2.term) || contains(c2.term, c1.term))
+        continue;
+      auto term0 = tuple(term, c1, c2, locals);
+      if (term0 != NULL)
+        return transform(term0, ts, locals);
+    }
+  return transform(term, ts, locals);
+}
+
+const ast::Term *Deforester::transformLet(const ast::Application *app, Traversals ts, const Locals &locals) {
+  //(λf. rest) (fix λf. ...), as the frontend writes a Func
+  auto let = dynamic_cast<const ast::Abstraction *>(app->func);
+  auto fix = dynamic_cast<const ast::Fixpoint *>(app->arg);
+  if (let == NULL || fix == NULL)
+    return NULL;
+  auto fix0 = static_cast<const ast::Fixpoint *>(transform(fix, ts, locals));
+
+  ts.erase(let->arg);
+  Traversal t;
+  if (getTraversal(let->arg, fix0, t)) {
+    traversals.push_back(t);
+    ts[let->arg] = &traversals.back();
+  }
+  Locals locals0(locals);
+  locals0.insert(let->arg);
+  auto rest = transformBody(let->term, ts, locals0);
+  if (fix0 == fix && rest == let->term)
+    return app;
+  return at(new ast::Application(at(new ast::Abstraction(let->arg, let->type, rest), let), fix0), app);
+}
+
+void Deforester::collectCalls(const ast::Term *term, const Traversals &ts, Locals bound, std::vector<Call> &calls) {
+  /* the calls evaluated whenever the term is, on a list from outside
+     it; lambdas and the cases of a match may never run */
+  if (dynamic_cast<const ast::Reference *>(term) || dynamic_cast<const ast::Abstraction *>(term) ||
+      dynamic_cast<const ast::Fixpoint *>(term)) {
+    return;
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    Call call;
+    if (getCall(term, ts, call) && !bound.count(call.t->name) &&
+        dynamic_cast<const ast::Reference *>(call.args[call.t->k])) {
+      bool free = true;
+      for (auto name : freeVariables(term))
+        free = free && !bound.count(name);
+      if (free)
+        calls.push_back(call);
+    }
+    //the body of a let runs too
+    if (auto let = dynamic_cast<const ast::Abstraction *>(app->func)) {
+      collectCalls(app->arg, ts, bound, calls);
+      bound.insert(let->arg);
+      collectCalls(let->term, ts, bound, calls);
+      return;
+    }
+    collectCalls(app->func, ts, bound, calls);
+    collectCalls(app->arg, ts, bound, calls);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    collectCalls(des->sum, ts, bound, calls);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    collectCalls(dep->product, ts, bound, calls);
+    bound.insert(dep->names.begin(), dep->names.end());
+    collectCalls(dep->term, ts, bound, calls);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *Deforester::tuple(const ast::Term *body, const Call &c1, const Call &c2, const Locals &locals) {
+  const Traversal &t1 = *c1.t, &t2 = *c2.t;
+  if (*t1.params[t1.k]->type != *t2.params[t2.k]->type)
+    return NULL;
+  std::string name = t1.name + "&" + t2.name;
+
+  //the list, then the other parameters of both
+  std::string list = getFresh("l");
+  std::vector<std::pair<std::string, const ast::Type *> > params;
+  params.push_back(std::make_pair(list, t1.params[t1.k]->type));
+  std::vector<std::string> statics1(t1.params.size(), list), statics2(t2.params.size(), list);
+  for (size_t j = 0; j < t1.params.size(); ++j)
+    if (j != t1.k) {
+      statics1[j] = getFresh("a");
+      params.push_back(std::make_pair(statics1[j], t1.params[j]->type));
+    }
+  for (size_t j = 0; j < t2.params.size(); ++j)
+    if (j != t2.k) {
+      statics2[j] = getFresh("b");
+      params.push_back(std::make_pair(statics2[j], t2.params[j]->type));
+    }
+  auto pair = new ast::ProductType({t1.result, t2.result}, getFresh("pair"));
+  auto makePair = [&](const ast::Term *x, const ast::Term *y) {
+    return apply(at(new ast::Reference(pair->cons), body), {x, y}, body);
+  };
+
+  std::vector<std::pair<const std::string, const ast::Term *> > cases;
+  for (size_t i = 0; i < t1.sum->types.size(); ++i) {
+    //the binder first, it may shadow a parameter
+    std::string binder = getFresh("s");
+    auto b1 = rename(t1.body->cases[i].second, t1.body->cases[i].first, binder);
+    auto b2 = rename(t2.body->cases[i].second, t2.body->cases[i].first, binder);
+    for (size_t j = 0; j < t1.params.size(); ++j)
+      b1 = rename(b1, t1.params[j]->arg, statics1[j]);
+    for (size_t j = 0; j < t2.params.size(); ++j)
+      b2 = rename(b2, t2.params[j]->arg, statics2[j]);
+    if (b1 == NULL || b2 == NULL)
+      return NULL;
+
+    bool under;
+    bool r1 = countUses(b1, t1.abs->arg, under) > 0, r2 = countUses(b2, t2.abs->arg, under) > 0;
+    if (!r1 && !r2) {
+      cases.push_back(std::make_pair(binder, makePair(b1, b2)));
+      continue;
+    }
+
+    //both sides take the fields apart under the same names
+    auto product = dynamic_cast<const ast::ProductType *>(t1.sum->types[i].first);
+    if (product == NULL)
+      return NULL;
+    std::vector<std::string> fields;
+    for (size_t j = 0; j < product->types.size(); ++j)
+      fields.push_back(getFresh("c"));
+    auto open = [&](const ast::Term *b, bool r) -> const ast::Term * {
+      if (!r)
+        return b;
+      auto dep = static_cast<const ast::Deproduct *>(b);
+      if (dep->names.size() != fields.size())
+        return NULL;
+      const ast::Term *inner = dep->term;
+      for (size_t j = 0; j < fields.size(); ++j)
+        inner = rename(inner, dep->names[j], fields[j]);
+      return inner;
+    };
+    auto inner1 = open(b1, r1), inner2 = open(b2, r2);
+    if (inner1 == NULL || inner2 == NULL)
+      return NULL;
+
+    //the recursive calls of both, on the same field, become one
+    std::string res1 = getFresh("r"), res2 = getFresh("r");
+    size_t field = fields.size();
+    for (size_t j = 0; j < fields.size() && field == fields.size(); ++j) {
+      auto x = r1 ? replaceCalls(inner1, t1, fields[j], statics1, res1, true, Locals()) : inner1;
+      auto y = r2 ? replaceCalls(inner2, t2, fields[j], statics2, res2, true, Locals()) : inner2;
+      if (x != NULL && y != NULL) {
+        inner1 = x;
+        inner2 = y;
+        field = j;
+      }
+    }
+    if (field == fields.size())
+      return NULL;
+    std::vector<const ast::Term *> args{at(new ast::Reference(fields[field]), body)};
+    for (auto &param : params)
+      if (param.first != list)
+        args.push_back(at(new ast::Reference(param.first), body));
+    auto rec = apply(at(new ast::Reference(name), body), args, body);
+    auto term = at(new ast::Deproduct(rec, {res1, res2}, makePair(inner1, inner2)), body);
+    term = at(new ast::Deproduct(at(new ast::Reference(binder), body), fields, term), body);
+    cases.push_back(std::make_pair(binder, term));
+  }
+  auto fix = makeFunction(name, params, pair, at(new ast::Desum(at(new ast::Reference(list), body), cases), body), body);
+  if (!isClosed(fix, locals, {pair->cons}))
+    return NULL;
+
+  //the body takes both results apart from one call
+  std::string res1 = getFresh("r"), res2 = getFresh("r");
+  std::vector<const ast::Term *> args{copyTerm(c1.args[t1.k])};
+  for (size_t j = 0; j < c1.args.size(); ++j)
+    if (j != t1.k)
+      args.push_back(copyTerm(c1.args[j]));
+  for (size_t j = 0; j < c2.args.size(); ++j)
+    if (j != t2.k)
+      args.push_back(copyTerm(c2.args[j]));
+  auto call = apply(at(new ast::Reference(name), body), args, body);
+  auto rest = replaceNodes(body, {{c1.term, res1}, {c2.term, res2}});
+  auto let = at(new ast::Abstraction(name, getType(fix), at(new ast::Deproduct(call, {res1, res2}, rest), body)), body);
+
+  types[pair->cons] = pair;
+  products[pair->cons] = pair;
+  globals.insert(pair->cons);
+  report.add("deforest", "tupled " + t1.name + " and " + t2.name + " as " + name);
+  return at(new ast::Application(let, fix), body);
+}
+
+const ast::Term *Deforester::fuse(const Call &consumer, const Call &producer, const Locals &locals) {
+  const Traversal &f = *consumer.t, &g = *producer.t;
+  if (*g.result != *f.params[f.k]->type)
+    return NULL;
+  std::string name = f.name + "@" + g.name;
+
+  //the parameters of g, then the other ones of f
+  std::vector<std::pair<std::string, const ast::Type *> > params;
+  std::vector<std::string> statics(f.params.size());
+  const ast::Term *body = g.body;
+  for (size_t j = 0; j < g.params.size(); ++j) {
+    std::string param = getFresh("a");
+    params.push_back(std::make_pair(param, g.params[j]->type));
+    body = rename(body, g.params[j]->arg, param);
+  }
+  for (size_t j = 0; j < f.params.size(); ++j)
+    if (j != f.k) {
+      statics[j] = getFresh("b");
+      params.push_back(std::make_pair(statics[j], f.params[j]->type));
+    }
+  if (body == NULL)
+    return NULL;
+  body = push(body, f, g, name, statics, Locals());
+  //what is left of g calls it by its own name
+  body = rename(body, g.abs->arg, g.name);
+  if (body == NULL)
+    return NULL;
+  auto fix = makeFunction(name, params, f.result, body, consumer.term);
+  if (!isClosed(fix, locals, {f.name, g.name}))
+    return NULL;
+
+  std::vector<const ast::Term *> args;
+  for (auto arg : producer.args)
+    args.push_back(copyTerm(arg));
+  for (size_t j = 0; j < consumer.args.size(); ++j)
+    if (j != f.k)
+      args.push_back(copyTerm(consumer.args[j]));
+  auto call = apply(at(new ast::Reference(name), consumer.term), args, consumer.term);
+  report.add("deforest", "fused " + f.name + " over " + g.name + " as " + name);
+  return at(new ast::Application(at(new ast::Abstraction(name, getType(fix), call), consumer.term), fix), consumer.term);
+}
+
+const ast::Term *Deforester::push(const ast::Term *term, const Traversal &f, const Traversal &g, const std::string &name,
+                                  const std::vector<std::string> &statics, Locals bound) {
+  //down to what g returns
+  if (term == NULL)
+    return NULL;
+  if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      Locals bound0(bound);
+      bound0.insert(pair.first);
+      auto term0 = push(pair.second, f, g, name, statics, bound0);
+      if (term0 == NULL)
+        return NULL;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return at(new ast::Desum(copyTerm(des->sum), cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    bound.insert(dep->names.begin(), dep->names.end());
+    auto body = push(dep->term, f, g, name, statics, bound);
+    return body == NULL ? NULL : at(new ast::Deproduct(copyTerm(dep->product), dep->names, body), term);
+  }
+  auto app = dynamic_cast<const ast::Application *>(term);
+  auto let = app == NULL ? NULL : dynamic_cast<const ast::Abstraction *>(app->func);
+  if (let != NULL) {
+    bound.insert(let->arg);
+    auto body = push(let->term, f, g, name, statics, bound);
+    if (body == NULL)
+      return NULL;
+    return at(new ast::Application(at(new ast::Abstraction(let->arg, let->type, body), let), copyTerm(app->arg)), term);
+  }
+
+  bool selfBound = bound.count(g.abs->arg) > 0;
+  auto callFused = [&](const ast::Term *call) -> const ast::Term * {
+    //g calling itself, now the fused function
+    Traversals ts{{g.abs->arg, &g}};
+    Call c;
+    if (selfBound || !getCall(call, ts, c))
+      return NULL;
+    std::vector<const ast::Term *> args;
+    for (auto arg : c.args)
+      args.push_back(copyTerm(arg));
+    for (size_t j = 0; j < statics.size(); ++j)
+      if (j != f.k)
+        args.push_back(at(new ast::Reference(statics[j]), call));
+    return apply(at(new ast::Reference(name), call), args, call);
+  };
+  if (auto call = callFused(term))
+    return call;
+
+  //anything else goes to f as it was
+  auto callF = [&]() -> const ast::Term * {
+    if (bound.count(f.name))
+      return NULL;
+    std::vector<const ast::Term *> args;
+    for (size_t j = 0; j < f.params.size(); ++j)
+      args.push_back(j == f.k ? copyTerm(term) : at(new ast::Reference(statics[j]), term));
+    return apply(at(new ast::Reference(f.name), term), args, term);
+  };
+
+  const ast::Term *payload = NULL;
+  auto ref = dynamic_cast<const ast::Reference *>(term);
+  if (app != NULL) {
+    ref = dynamic_cast<const ast::Reference *>(app->func);
+    payload = app->arg;
+  }
+  auto it = ref == NULL || bound.count(ref->name) ? constructors.end() : constructors.find(ref->name);
+  if (it == constructors.end() || it->second.first->types.size() != f.body->cases.size())
+    return callF();
+
+  //a constructor: the case of f for it, with the payload in place
+  size_t idx = it->second.second;
+  std::string binder = getFresh("s");
+  auto c = rename(f.body->cases[idx].second, f.body->cases[idx].first, binder);
+  for (size_t j = 0; j < f.params.size(); ++j)
+    if (j != f.k)
+      c = rename(c, f.params[j]->arg, statics[j]);
+  bool under;
+  if (c == NULL || countUses(c, f.params[f.k]->arg, under) > 0)
+    return callF();
+  //f's own names must not be caught by the binders of g
+  for (auto name0 : freeVariables(c))
+    if (bound.count(name0))
+      return callF();
+
+  //what is left of f calls it by its own name
+  auto finish = [&](const ast::Term *term0) {
+    return rename(term0, f.abs->arg, f.name);
+  };
+  if (countUses(c, binder, under) == 0) {
+    //the payload is not needed, nothing is lost by not computing it
+    auto c0 = finish(c);
+    return c0 == NULL ? callF() : c0;
+  }
+  if (payload == NULL)
+    return callF();
+
+  //the fields of a built product go straight to the case
+  auto dep = dynamic_cast<const ast::Deproduct *>(c);
+  auto ref0 = dep == NULL ? NULL : dynamic_cast<const ast::Reference *>(dep->product);
+  std::vector<const ast::Term *> fields;
+  const ast::Term *head = payload;
+  while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+    fields.insert(fields.begin(), app0->arg);
+    head = app0->func;
+  }
+  auto cons = dynamic_cast<const ast::Reference *>(head);
+  auto product = cons == NULL || bound.count(cons->name) || !products.count(cons->name) ? NULL : products[cons->name];
+  if (ref0 == NULL || ref0->name != binder || product == NULL ||
+      fields.size() != dep->names.size() || countUses(dep->term, binder, under) > 0) {
+    //bound as it is
+    auto type = it->second.first->types[idx].first;
+    auto c0 = finish(c);
+    if (c0 == NULL)
+      return callF();
+    return at(new ast::Application(at(new ast::Abstraction(binder, type, c0), term), copyTerm(payload)), term);
+  }
+
+  std::vector<std::string> names;
+  const ast::Term *inner = dep->term;
+  for (size_t j = 0; j < fields.size(); ++j) {
+    names.push_back(getFresh("c"));
+    inner = rename(inner, dep->names[j], names.back());
+  }
+  if (inner == NULL)
+    return callF();
+  std::vector<bool> fused(fields.size(), false);
+  for (size_t j = 0; j < fields.size(); ++j) {
+    auto call = callFused(fields[j]);
+    if (call == NULL)
+      continue;
+    std::string placeholder = getFresh("p");
+    auto inner0 = replaceCalls(inner, f, names[j], statics, placeholder, false, Locals());
+    if (inner0 == NULL || countUses(inner0, names[j], under) > 0)
+      continue;
+    inner0 = substitute(inner0, placeholder, call);
+    if (inner0 != NULL) {
+      inner = inner0;
+      fused[j] = true;
+    }
+  }
+  inner = finish(inner);
+  if (inner == NULL)
+    return callF();
+  for (size_t j = fields.size(); j-- > 0; )
+    if (!fused[j])
+      inner = at(new ast::Application(at(new ast::Abstraction(names[j], product->types[j], inner), term),
+                                      copyTerm(fields[j])), term);
+  return inner;
+}
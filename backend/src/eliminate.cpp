@@ -0,0 +1,227 @@
+#include "eliminate.hpp"
+#include "exception.hpp"
+
+#include <algorithm>
+
+/* rewrites of one body before it is left as it is */
+static const unsigned maxRounds = 64;
+
+Eliminator::Eliminator(const Options &options, Report &report)
+  :options(options), report(report), fresh(0), shared(0) {}
+
+const ast::Program *Eliminator::run(const ast::Program &prog) {
+  if (!options.cse)
+    return &prog;
+  auto term = transformBody(prog.term, globalTypes(prog));
+  report.add("cse", std::to_string(shared) + " subterms shared");
+  return new ast::Program(prog.types, term, prog.externs);
+}
+
+std::string Eliminator::getKey(const ast::Term *term, std::vector<std::string> &inner) {
+  /* a name bound inside the term is its distance to the binder, any
+     other one is a binder outside, the same for every occurrence */
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    auto it = std::find(inner.rbegin(), inner.rend(), ref->name);
+    if (it != inner.rend())
+      return "%" + std::to_string(it - inner.rbegin());
+    return "'" + ref->name;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    inner.push_back(abs->arg);
+    std::string key = "(\\" + abs->type->to_string() + " " + getKey(abs->term, inner) + ")";
+    inner.pop_back();
+    return key;
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    return "(" + getKey(app->func, inner) + " " + getKey(app->arg, inner) + ")";
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    std::string key = "(match " + getKey(des->sum, inner);
+    for (auto pair : des->cases) {
+      inner.push_back(pair.first);
+      key += " " + getKey(pair.second, inner);
+      inner.pop_back();
+    }
+    return key + ")";
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    std::string key = "(let" + std::to_string(dep->names.size()) + " " + getKey(dep->product, inner);
+    inner.insert(inner.end(), dep->names.begin(), dep->names.end());
+    key += " " + getKey(dep->term, inner) + ")";
+    inner.resize(inner.size() - dep->names.size());
+    return key;
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    return "(fix " + getKey(fix->term, inner) + ")";
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+void Eliminator::collect(const ast::Term *term, Locals bound, Groups &groups) {
+  /* the applications evaluated whenever the term is, on variables from
+     outside it; lambdas may never run */
+  if (dynamic_cast<const ast::Reference *>(term) || dynamic_cast<const ast::Abstraction *>(term) ||
+      dynamic_cast<const ast::Fixpoint *>(term)) {
+    return;
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    if (auto let = dynamic_cast<const ast::Abstraction *>(app->func)) {
+      collect(app->arg, bound, groups);
+      bound.insert(let->arg);
+      collect(let->term, bound, groups);
+      return;
+    }
+    //only whole calls, a call missing arguments is not one
+    std::vector<const ast::Term *> args;
+    const ast::Term *head = term;
+    while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+      args.push_back(app0->arg);
+      head = app0->func;
+    }
+    bool free = true;
+    for (auto name : freeVariables(term))
+      free = free && !bound.count(name);
+    if (free) {
+      std::vector<std::string> inner;
+      Group &group = groups[getKey(term, inner)];
+      ++group.count;
+      group.terms.push_back(term);
+    }
+    collect(head, bound, groups);
+    for (auto arg : args)
+      collect(arg, bound, groups);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    collect(des->sum, bound, groups);
+    //only one case runs, it counts as little as the case doing least
+    std::vector<Groups> cases;
+    for (auto pair : des->cases) {
+      Locals bound0(bound);
+      bound0.insert(pair.first);
+      cases.push_back(Groups());
+      collect(pair.second, bound0, cases.back());
+    }
+    if (cases.empty())
+      return;
+    for (auto pair : cases[0]) {
+      Group group = pair.second;
+      for (size_t i = 1; i < cases.size() && group.count > 0; ++i) {
+        auto it = cases[i].find(pair.first);
+        if (it == cases[i].end()) {
+          group.count = 0;
+          break;
+        }
+        group.count = std::min(group.count, it->second.count);
+        group.terms.insert(group.terms.end(), it->second.terms.begin(), it->second.terms.end());
+      }
+      if (group.count == 0)
+        continue;
+      Group &group0 = groups[pair.first];
+      group0.count += group.count;
+      group0.terms.insert(group0.terms.end(), group.terms.begin(), group.terms.end());
+    }
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    collect(dep->product, bound, groups);
+    bound.insert(dep->names.begin(), dep->names.end());
+    collect(dep->term, bound, groups);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *Eliminator::transform(const ast::Term *term, const Scope &scope) {
+  if (dynamic_cast<const ast::Reference *>(term)) {
+    return term;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    Scope scope0(scope);
+    scope0[abs->arg] = abs->type;
+    auto body = transformBody(abs->term, scope0);
+    return body == abs->term ? term : at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    const ast::Term *func;
+    auto arg = transform(app->arg, scope);
+    if (auto let = dynamic_cast<const ast::Abstraction *>(app->func)) {
+      Scope scope0(scope);
+      scope0[let->arg] = let->type;
+      auto body = transformBody(let->term, scope0);
+      func = body == let->term ? let : at(new ast::Abstraction(let->arg, let->type, body), let);
+    } else
+      func = transform(app->func, scope);
+    if (func == app->func && arg == app->arg)
+      return term;
+    return at(new ast::Application(func, arg), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto type = dynamic_cast<const ast::SumType *>(typeOf(des->sum, scope));
+    auto sum = transform(des->sum, scope);
+    bool changed = sum != des->sum;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (size_t i = 0; i < des->cases.size(); ++i) {
+      auto pair = des->cases[i];
+      Scope scope0(scope);
+      if (type != NULL && i < type->types.size())
+        scope0[pair.first] = type->types[i].first;
+      else
+        scope0.erase(pair.first);
+      auto term0 = transformBody(pair.second, scope0);
+      changed = changed || term0 != pair.second;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return changed ? at(new ast::Desum(sum, cases), term) : term;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto type = dynamic_cast<const ast::ProductType *>(typeOf(dep->product, scope));
+    auto product = transform(dep->product, scope);
+    Scope scope0(scope);
+    for (size_t i = 0; i < dep->names.size(); ++i)
+      if (type != NULL && i < type->types.size())
+        scope0[dep->names[i]] = type->types[i];
+      else
+        scope0.erase(dep->names[i]);
+    auto body = transformBody(dep->term, scope0);
+    if (product == dep->product && body == dep->term)
+      return term;
+    return at(new ast::Deproduct(product, dep->names, body), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = transform(fix->term, scope);
+    return body == fix->term ? term : at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *Eliminator::transformBody(const ast::Term *term, const Scope &scope) {
+  //the body of a Func memo stays marked, what is shared goes under it
+  if (auto body = getMemo(term)) {
+    auto body0 = transformBody(body, scope);
+    if (body0 == body)
+      return term;
+    auto app = static_cast<const ast::Application *>(term);
+    return at(new ast::Application(app->func, body0), term);
+  }
+  //the largest subterm first, what it contains may be repeated outside
+  std::set<std::string> untyped;
+  for (unsigned i = 0; i < maxRounds; ++i) {
+    Groups groups;
+    collect(term, Locals(), groups);
+    const Group *best = NULL;
+    size_t size = 0;
+    const ast::Type *type = NULL;
+    for (auto &pair : groups) {
+      if (pair.second.count < 2 || untyped.count(pair.first))
+        continue;
+      size_t size0 = termSize(pair.second.terms[0]);
+      if (size0 <= size)
+        continue;
+      auto type0 = typeOf(pair.second.terms[0], scope);
+      if (type0 == NULL) {
+        untyped.insert(pair.first);
+        continue;
+      }
+      best = &pair.second;
+      size = size0;
+      type = type0;
+    }
+    if (best == NULL)
+      break;
+
+    std::string name = "#e" + std::to_string(fresh++);
+    std::map<const ast::Term *, std::string> nodes;
+    for (auto occurrence : best->terms)
+      nodes[occurrence] = name;
+    auto body = replaceNodes(term, nodes);
+    auto value = copyTerm(best->terms[0]);
+    term = at(new ast::Application(at(new ast::Abstraction(name, type, body), term), value), term);
+    shared += best->terms.size() - 1;
+  }
+  return transform(term, scope);
+}
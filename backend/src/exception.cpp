@@ -24,7 +24,15 @@ NumberNotMatch::NumberNotMatch(const TermException &exception,
 TypeException::TypeException(const ast::Type *type)
   :type_(type) {}
 
+PrimitiveException::PrimitiveException(const std::string &prim)
+  :prim_(prim) {}
+
 TermNotMatch::TermNotMatch(const ast::Term *const term,
                            const std::type_info &expect)
   :term_(term), expect_(expect) {}
-   
+
+ExternException::ExternException(const std::string &name, const std::string &symbol)
+  :name_(name), symbol_(symbol) {}
+
+OptionException::OptionException(const std::string &option)
+  :option_(option) {}
@@ -0,0 +1,185 @@
+#include "flow.hpp"
+#include "analysis.hpp"
+#include "exception.hpp"
+
+#include <tuple>
+
+bool Flow::Closure::operator<(const Closure &b) const {
+  return std::tie(term, name, stage) < std::tie(b.term, b.name, b.stage);
+}
+
+Flow::Set::Set()
+  :top(false) {}
+
+Flow::Flow(const ast::Term *term, const std::map<std::string, unsigned> &globals)
+  :globals(globals) {
+  Scope scope;
+  for (auto pair : globals) {
+    Binder binder(NULL, pair.first);
+    scope[pair.first] = binder;
+    if (pair.second > 0)
+      store[binder].closures.insert(Closure{NULL, pair.first, 0});
+  }
+
+  Set top;
+  top.top = true;
+  //iterate until nothing grows any more
+  do {
+    changed = false;
+    //the main term is applied to the input, and its result goes back
+    //to the wrapper
+    Set main = analyze(term, scope);
+    escape(apply(main, top));
+    for (auto clo : std::set<Closure>(escaped)) {
+      //an escaped closure may be called by anyone, with anything
+      if (auto abs = dynamic_cast<const ast::Abstraction *>(clo.term)) {
+        join(store[Binder(abs, abs->arg)], top);
+        escape(results[abs]);
+      } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(clo.term)) {
+        auto params = getParams(fix);
+        for (size_t i = clo.stage; i < params.size(); ++i)
+          join(store[Binder(params[i], params[i]->arg)], top);
+        escape(results[fix]);
+      }
+    }
+  } while (changed);
+}
+
+Flow::Set Flow::callees(const ast::Application *app) const {
+  auto it = sites.find(app);
+  if (it != sites.end())
+    return it->second;
+  //not seen by the analysis, nothing is known
+  Set top;
+  top.top = true;
+  return top;
+}
+
+std::vector<const ast::Abstraction *> Flow::getParams(const ast::Fixpoint *fix) {
+  std::vector<const ast::Abstraction *> params;
+  auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+  if (abs == NULL)
+    return params;
+  const ast::Term *body = abs->term;
+  while (auto abs0 = dynamic_cast<const ast::Abstraction *>(body)) {
+    params.push_back(abs0);
+    body = abs0->term;
+  }
+  return params;
+}
+
+void Flow::merge(Set &dst, const Set &src) {
+  dst.top = dst.top || src.top;
+  dst.closures.insert(src.closures.begin(), src.closures.end());
+}
+
+void Flow::join(Set &dst, const Set &src) {
+  //only the analysis state counts, not sets being built up
+  size_t n = dst.closures.size();
+  bool top = dst.top;
+  merge(dst, src);
+  if (dst.top != top || dst.closures.size() != n)
+    changed = true;
+}
+
+void Flow::escape(const Set &set) {
+  for (auto clo : set.closures)
+    if (escaped.insert(clo).second)
+      changed = true;
+}
+
+Flow::Set Flow::apply(const Set &func, const Set &arg) {
+  Set ret;
+  if (func.top) {
+    //an unknown callee may do anything with the argument
+    ret.top = true;
+    escape(arg);
+  }
+  for (auto clo : func.closures) {
+    if (clo.term == NULL) {
+      //constructors store the argument away, primitives take Ints
+      escape(arg);
+      if (clo.stage + 1 < globals[clo.name])
+        ret.closures.insert(Closure{NULL, clo.name, clo.stage + 1});
+    } else if (auto abs = dynamic_cast<const ast::Abstraction *>(clo.term)) {
+      join(store[Binder(abs, abs->arg)], arg);
+      merge(ret, results[abs]);
+    } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(clo.term)) {
+      auto params = getParams(fix);
+      join(store[Binder(params[clo.stage], params[clo.stage]->arg)], arg);
+      if (clo.stage + 1 < params.size())
+        ret.closures.insert(Closure{fix, "", clo.stage + 1});
+      else
+        merge(ret, results[fix]);
+    }
+  }
+  return ret;
+}
+
+Flow::Set Flow::analyze(const ast::Term *term, Scope &scope) {
+  Set top;
+  top.top = true;
+  int num;
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (isLiteral(ref->name, num))
+      return Set();
+    auto it = scope.find(ref->name);
+    if (it == scope.end())
+      return top;
+    return store[it->second];
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    Scope scope0(scope);
+    scope0[abs->arg] = Binder(abs, abs->arg);
+    join(results[abs], analyze(abs->term, scope0));
+    Set ret;
+    ret.closures.insert(Closure{abs, "", 0});
+    return ret;
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    if (auto arg = getPar(app))
+      return analyze(arg, scope);
+    if (auto body = getMemo(app))
+      return analyze(body, scope);
+    Set func = analyze(app->func, scope);
+    Set arg = analyze(app->arg, scope);
+    join(sites[app], func);
+    return apply(func, arg);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    analyze(des->sum, scope);
+    //whatever comes out of a data structure is unknown
+    Set ret;
+    for (auto pair : des->cases) {
+      Scope scope0(scope);
+      Binder binder(pair.second, pair.first);
+      scope0[pair.first] = binder;
+      join(store[binder], top);
+      merge(ret, analyze(pair.second, scope0));
+    }
+    return ret;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    analyze(dep->product, scope);
+    Scope scope0(scope);
+    for (auto name : dep->names) {
+      Binder binder(dep, name);
+      scope0[name] = binder;
+      join(store[binder], top);
+    }
+    return analyze(dep->term, scope0);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+    auto params = getParams(fix);
+    if (abs == NULL || params.empty())
+      return top;
+    Set ret;
+    ret.closures.insert(Closure{fix, "", 0});
+
+    Scope scope0(scope);
+    Binder self(abs, abs->arg);
+    scope0[abs->arg] = self;
+    join(store[self], ret);
+    for (auto param : params)
+      scope0[param->arg] = Binder(param, param->arg);
+    join(results[fix], analyze(params.back()->term, scope0));
+    return ret;
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
@@ -0,0 +1,65 @@
+#include "layout.hpp"
+
+#include <vector>
+
+using namespace llvm;
+
+Layout::Layout(LLVMContext &context, const DataLayout &layout)
+  :context(context), layout(layout),
+   refType(PointerType::get(IntegerType::get(context, 8), 0)) {}
+
+unsigned Layout::getPrimitiveWidth(const ast::Type *type) const {
+  auto prim = dynamic_cast<const ast::PrimitiveType *>(type);
+  if (prim == NULL)
+    return 0;
+  if (prim->name == "Int")
+    return ESTLC_INT_BITS;
+  //unit and friends carry no data, they stay NULL refs
+  return 0;
+}
+
+Type *Layout::getFieldType(const ast::Type *type) const {
+  unsigned width = getPrimitiveWidth(type);
+  if (width != 0)
+    return IntegerType::get(context, width);
+  return refType;
+}
+
+StructType *Layout::getProductType(const ast::ProductType *product) {
+  auto it = products.find(product);
+  if (it != products.end())
+    return it->second;
+
+  std::vector<Type *> elems;
+  for (auto type : product->types)
+    elems.push_back(getFieldType(type));
+  StructType *type = StructType::get(context, elems);
+  products[product] = type;
+  return type;
+}
+
+bool Layout::isAligned(const ast::Type *type) {
+  //primitives live in the bits of the ref itself
+  if (getPrimitiveWidth(type) != 0)
+    return false;
+  if (auto sum = dynamic_cast<const ast::SumType *>(type))
+    return !isTagged(sum);
+  //everything else is a pointer from malloc, or NULL
+  return true;
+}
+
+bool Layout::isTagged(const ast::SumType *sum) {
+  auto it = tagged.find(sum);
+  if (it != tagged.end())
+    return it->second;
+
+  //while we are looking at the payloads, a recursive occurrence of
+  //this sum counts as tagged, i.e., as an unaligned payload
+  tagged[sum] = true;
+  bool ret = sum->types.size() <= ESTLC_LAZY;
+  for (auto pair : sum->types)
+    if (!isAligned(pair.first))
+      ret = false;
+  tagged[sum] = ret;
+  return ret;
+}
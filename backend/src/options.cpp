@@ -0,0 +1,71 @@
+#include "options.hpp"
+#include "exception.hpp"
+
+#include <stdexcept>
+
+Options::Options()
+  :specializeLimit(200), simplifyBudget(100), deforest(true), cse(true), fold(true), parallel(false), stream(false), chunk(1),
+    memoSize(1 << 20), memoShared(false) {}
+
+static bool getSize(const std::string &arg, const std::string &flag, size_t &value) {
+  //-fflag=N
+  std::string prefix = "-f" + flag + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  size_t idx;
+  try {
+    value = std::stoul(arg.substr(prefix.size()), &idx, 10);
+  } catch (std::logic_error e) {
+    throw OptionException(arg);
+  }
+  if (idx != arg.size() - prefix.size())
+    throw OptionException(arg);
+  return true;
+}
+
+static bool getString(const std::string &arg, const std::string &flag, std::string &value) {
+  //-fflag=text
+  std::string prefix = "-f" + flag + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+static bool getFlag(const std::string &arg, const std::string &flag, bool &value) {
+  //-fflag=0 or 1
+  size_t n;
+  if (!getSize(arg, flag, n))
+    return false;
+  value = n != 0;
+  return true;
+}
+
+void Options::parse(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (getSize(arg, "specialize-limit", specializeLimit))
+      continue;
+    if (getSize(arg, "simplify-budget", simplifyBudget))
+      continue;
+    if (getFlag(arg, "deforest", deforest))
+      continue;
+    if (getFlag(arg, "cse", cse))
+      continue;
+    if (getFlag(arg, "fold", fold))
+      continue;
+    if (getFlag(arg, "parallel", parallel))
+      continue;
+    if (getSize(arg, "chunk", chunk))
+      continue;
+    if (getFlag(arg, "stream", stream))
+      continue;
+    if (getSize(arg, "memo-size", memoSize))
+      continue;
+    if (getFlag(arg, "memo-shared", memoShared))
+      continue;
+    if (getString(arg, "header", header))
+      continue;
+    throw OptionException(arg);
+  }
+}
@@ -0,0 +1,10 @@
+#include "report.hpp"
+
+void Report::add(const std::string &pass, const std::string &line) {
+  lines.push_back(std::make_pair(pass, line));
+}
+
+void Report::print(std::ostream &os) const {
+  for (auto line : lines)
+    os << line.first << ": " << line.second << '\n';
+}
@@ -0,0 +1,268 @@
+#include "simplify.hpp"
+#include "analysis.hpp"
+#include "exception.hpp"
+
+#include <algorithm>
+#include <climits>
+
+/* rounds over the whole program before giving up on a fixed point */
+static const unsigned maxRounds = 16;
+
+Simplifier::Simplifier(const Options &options, Report &report)
+  :options(options), report(report), budget(options.simplifyBudget) {}
+
+const ast::Program *Simplifier::run(const ast::Program &prog) {
+  for (auto pair : prog.types) {
+    if (auto sum = dynamic_cast<const ast::SumType *>(pair.second)) {
+      for (size_t i = 0; i < sum->types.size(); ++i) {
+        constructors[sum->types[i].second] = std::make_pair(sum, i);
+        if (auto product = dynamic_cast<const ast::ProductType *>(sum->types[i].first))
+          products[product->cons] = product;
+      }
+    } else if (auto product = dynamic_cast<const ast::ProductType *>(pair.second))
+      products[product->cons] = product;
+  }
+
+  auto total = [this]() {
+    size_t n = 0;
+    for (auto pair : rewrites)
+      n += pair.second;
+    return n;
+  };
+
+  //each round may uncover new redexes, stop when one finds nothing
+  const ast::Term *term = prog.term;
+  for (unsigned i = 0; i < maxRounds; ++i) {
+    size_t n = total();
+    term = simplify(term, Locals());
+    if (total() == n)
+      break;
+  }
+
+  std::string line = std::to_string(total()) + " rewrites";
+  for (auto pair : rewrites)
+    line += ", " + std::to_string(pair.second) + " " + pair.first;
+  report.add("simplify", line);
+  return new ast::Program(prog.types, term, prog.externs);
+}
+
+void Simplifier::count(const std::string &rule) {
+  ++rewrites[rule];
+}
+
+bool Simplifier::isGlobal(const std::string &name, const Locals &locals) {
+  return locals.find(name) == locals.end();
+}
+
+const ast::Term *Simplifier::simplify(const ast::Term *term, const Locals &locals) {
+  //the children first, a node is only rebuilt if one of them changed
+  if (dynamic_cast<const ast::Reference *>(term)) {
+    return term;
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    Locals locals0(locals);
+    locals0.insert(abs->arg);
+    auto body = simplify(abs->term, locals0);
+    return body == abs->term ? term : at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    auto func = simplify(app->func, locals);
+    auto arg = simplify(app->arg, locals);
+    if (func != app->func || arg != app->arg)
+      app = at(new ast::Application(func, arg), term);
+    auto term0 = simplifyApplication(app, locals);
+    return term0 == NULL ? app : term0;
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto sum = simplify(des->sum, locals);
+    bool changed = sum != des->sum;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      Locals locals0(locals);
+      locals0.insert(pair.first);
+      auto term0 = simplify(pair.second, locals0);
+      changed = changed || term0 != pair.second;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    if (changed)
+      des = at(new ast::Desum(sum, cases), term);
+    auto term0 = simplifyDesum(des, locals);
+    return term0 == NULL ? des : term0;
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto product = simplify(dep->product, locals);
+    Locals locals0(locals);
+    locals0.insert(dep->names.begin(), dep->names.end());
+    auto body = simplify(dep->term, locals0);
+    if (product != dep->product || body != dep->term)
+      dep = at(new ast::Deproduct(product, dep->names, body), term);
+    auto term0 = simplifyDeproduct(dep, locals);
+    return term0 == NULL ? dep : term0;
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = simplify(fix->term, locals);
+    return body == fix->term ? term : at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+const ast::Term *Simplifier::simplifyApplication(const ast::Application *app, const Locals &locals) {
+  //a primitive on two literals
+  auto app0 = dynamic_cast<const ast::Application *>(app->func);
+  auto op = app0 == NULL ? NULL : dynamic_cast<const ast::Reference *>(app0->func);
+  auto x = app0 == NULL ? NULL : dynamic_cast<const ast::Reference *>(app0->arg);
+  auto y = dynamic_cast<const ast::Reference *>(app->arg);
+  int x_v, y_v;
+  if (op != NULL && x != NULL && y != NULL && isGlobal(op->name, locals) &&
+      std::find(primitives.begin(), primitives.end(), op->name) != primitives.end() &&
+      isLiteral(x->name, x_v) && isLiteral(y->name, y_v)) {
+    auto term = fold(op->name, x_v, y_v, locals);
+    if (term != NULL) {
+      count("folded");
+      return at(term, app);
+    }
+    return NULL;
+  }
+
+  auto abs = dynamic_cast<const ast::Abstraction *>(app->func);
+  if (abs == NULL)
+    return NULL;
+  bool under;
+  size_t uses = countUses(abs->term, abs->arg, under);
+
+  /* a variable or literal costs nothing to copy; anything else may be
+     moved to its only use, unless that is inside a lambda where it
+     would be evaluated again and again. Functions stay bound, Codegen
+     knows them better that way */
+  bool isFunction = dynamic_cast<const ast::Abstraction *>(app->arg) != NULL ||
+    dynamic_cast<const ast::Fixpoint *>(app->arg) != NULL;
+  if (dynamic_cast<const ast::Reference *>(app->arg) != NULL || uses == 0 ||
+      (uses == 1 && !under && !isFunction)) {
+    auto term = substitute(abs->term, abs->arg, app->arg);
+    if (term != NULL)
+      count("beta");
+    return term;
+  }
+
+  //a Func not calling itself is just a lambda, copied to each use,
+  //unless it is to remember its results
+  auto fix = dynamic_cast<const ast::Fixpoint *>(app->arg);
+  auto self = fix == NULL || isMemo(fix) ? NULL : dynamic_cast<const ast::Abstraction *>(fix->term);
+  if (self != NULL && freeVariables(self->term).count(self->arg) == 0) {
+    size_t growth = termSize(self->term) * (uses - 1);
+    if (growth > budget)
+      return NULL;
+    auto term = substitute(abs->term, abs->arg, self->term);
+    if (term != NULL) {
+      budget -= growth;
+      count("inlined");
+    }
+    return term;
+  }
+  return NULL;
+}
+
+ast::Reference *Simplifier::fold(const std::string &prim, int x, int y, const Locals &locals) {
+  //Int is unsigned, and a literal has to fit in an int
+  if (x < 0 || y < 0)
+    return NULL;
+  long long a = x, b = y, r;
+  if (prim == "+")
+    r = a + b;
+  else if (prim == "-")
+    r = a - b;
+  else if (prim == "*")
+    r = a * b;
+  else if (prim == "/")
+    r = b == 0 ? 0 : a / b;
+  else {
+    bool res;
+    if (prim == "<")
+      res = a < b;
+    else if (prim == ">")
+      res = a > b;
+    else if (prim == "<=")
+      res = a <= b;
+    else if (prim == ">=")
+      res = a >= b;
+    else if (prim == "=" || prim == "==")
+      res = a == b;
+    else if (prim == "<>")
+      res = a != b;
+    else
+      return NULL;
+    std::string name = res ? "true" : "false";
+    if (!isGlobal(name, locals) || constructors.find(name) == constructors.end())
+      return NULL;
+    return new ast::Reference(name);
+  }
+  if (r < 0 || r > INT_MAX)
+    return NULL;
+  return new ast::Reference(std::to_string(r));
+}
+
+const ast::Term *Simplifier::simplifyDesum(const ast::Desum *des, const Locals &locals) {
+  //a constructor, alone or applied to its payload
+  const ast::Term *payload = NULL;
+  auto ref = dynamic_cast<const ast::Reference *>(des->sum);
+  if (auto app = dynamic_cast<const ast::Application *>(des->sum)) {
+    ref = dynamic_cast<const ast::Reference *>(app->func);
+    payload = app->arg;
+  }
+  if (ref == NULL || !isGlobal(ref->name, locals))
+    return NULL;
+  auto it = constructors.find(ref->name);
+  if (it == constructors.end())
+    return NULL;
+  const ast::SumType *sum = it->second.first;
+  size_t idx = it->second.second;
+  if (des->cases.size() != sum->types.size())
+    return NULL;
+  auto pair = des->cases[idx];
+  const ast::Type *type = sum->types[idx].first;
+
+  auto prim = dynamic_cast<const ast::PrimitiveType *>(type);
+  bool nullary = prim != NULL && (prim->name == "unit" || prim->name == "Unit");
+  if (payload == NULL) {
+    //the case cannot use a payload that is not there
+    bool under;
+    if (!nullary || countUses(pair.second, pair.first, under) > 0)
+      return NULL;
+    count("known case");
+    return pair.second;
+  }
+  if (nullary)
+    return NULL;
+  count("known case");
+  return at(new ast::Application(at(new ast::Abstraction(pair.first, type, pair.second), des), payload), des);
+}
+
+const ast::Term *Simplifier::simplifyDeproduct(const ast::Deproduct *dep, const Locals &locals) {
+  //the fields are right there, bind each one to its name
+  std::vector<const ast::Term *> args;
+  const ast::Term *head = dep->product;
+  while (auto app = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app->arg);
+    head = app->func;
+  }
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  if (ref == NULL || !isGlobal(ref->name, locals))
+    return NULL;
+  auto it = products.find(ref->name);
+  if (it == products.end())
+    return NULL;
+  const ast::ProductType *product = it->second;
+  size_t n = dep->names.size();
+  if (args.size() != n || product->types.size() != n)
+    return NULL;
+
+  //the fields must not see the names they are bound to
+  std::set<std::string> names(dep->names.begin(), dep->names.end());
+  if (names.size() != n)
+    return NULL;
+  for (auto arg : args)
+    for (auto name : freeVariables(arg))
+      if (names.count(name))
+        return NULL;
+
+  const ast::Term *term = dep->term;
+  for (size_t i = n; i-- > 0; )
+    term = at(new ast::Application(at(new ast::Abstraction(dep->names[i], product->types[i], term), dep), args[i]), dep);
+  count("known product");
+  return term;
+}
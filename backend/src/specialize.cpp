@@ -0,0 +1,345 @@
+#include "specialize.hpp"
+#include "exception.hpp"
+#include "flow.hpp"
+
+#include <cstdint>
+
+Specializer::Specializer(const Options &options, Report &report)
+  :options(options), report(report) {}
+
+const ast::Program *Specializer::run(const ast::Program &prog) {
+  if (options.specializeLimit == 0)
+    return &prog;
+  Bindings bindings;
+  for (auto pair : globalTypes(prog))
+    bindings[pair.first] = Binding{pair.second, true, NULL};
+  return new ast::Program(prog.types, transform(prog.term, bindings), prog.externs);
+}
+
+const ast::Term *Specializer::transform(const ast::Term *term, Bindings &bindings) {
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    return at(new ast::Reference(ref->name), term);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    Bindings bindings0(bindings);
+    bindings0[abs->arg] = Binding{abs->type, false, NULL};
+    return at(new ast::Abstraction(abs->arg, abs->type, transform(abs->term, bindings0)), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    if (auto let = transformLet(app, bindings))
+      return let;
+    if (auto call = transformCall(app, bindings))
+      return call;
+    return at(new ast::Application(transform(app->func, bindings), transform(app->arg, bindings)), term);
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto type = dynamic_cast<const ast::SumType *>(typeOf(des->sum, getScope(bindings)));
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (size_t i = 0; i < des->cases.size(); ++i) {
+      auto pair = des->cases[i];
+      Bindings bindings0(bindings);
+      bool known = type != NULL && i < type->types.size();
+      bindings0[pair.first] = Binding{known ? type->types[i].first : NULL, false, NULL};
+      cases.push_back(std::make_pair(pair.first, transform(pair.second, bindings0)));
+    }
+    return at(new ast::Desum(transform(des->sum, bindings), cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto type = dynamic_cast<const ast::ProductType *>(typeOf(dep->product, getScope(bindings)));
+    Bindings bindings0(bindings);
+    for (size_t i = 0; i < dep->names.size(); ++i) {
+      bool known = type != NULL && i < type->types.size();
+      bindings0[dep->names[i]] = Binding{known ? type->types[i] : NULL, false, NULL};
+    }
+    return at(new ast::Deproduct(transform(dep->product, bindings), dep->names, transform(dep->term, bindings0)), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    return at(new ast::Fixpoint(transform(fix->term, bindings)), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
+
+Scope Specializer::getScope(const Bindings &bindings) {
+  Scope scope;
+  for (auto pair : bindings)
+    if (pair.second.type != NULL)
+      scope[pair.first] = pair.second.type;
+  return scope;
+}
+
+const ast::Term *Specializer::transformLet(const ast::Application *app, Bindings &bindings) {
+  //(\f. rest) (fix \f. \p1 ... \pn. body), as Func definitions are
+  auto let = dynamic_cast<const ast::Abstraction *>(app->func);
+  if (let == NULL || dynamic_cast<const ast::Fixpoint *>(app->arg) == NULL)
+    return NULL;
+  auto fix = dynamic_cast<const ast::Fixpoint *>(transform(app->arg, bindings));
+  auto abs = dynamic_cast<const ast::Abstraction *>(fix->term);
+  auto params = Flow::getParams(fix);
+  Bindings bindings0(bindings);
+  bindings0[let->arg] = Binding{let->type, false, NULL};
+  if (abs == NULL || params.empty() || freeVariables(fix).count(let->arg)) {
+    auto rest = transform(let->term, bindings0);
+    return at(new ast::Application(at(new ast::Abstraction(let->arg, let->type, rest), let), fix), app);
+  }
+
+  functions.push_back(Function{let->arg, abs, params, {}, {}, {}});
+  Function &func = functions.back();
+  bool any = false;
+  for (size_t i = 0; i < params.size(); ++i) {
+    //a function parameter every recursive call passes along as it is
+    bool isStatic = dynamic_cast<const ast::FunctionType *>(params[i]->type) != NULL &&
+      rewriteCalls(params.back()->term, &abs->arg, &params[i]->arg, "", params.size(), i,
+                   std::vector<std::string>()) != NULL;
+    func.statics.push_back(isStatic);
+    any = any || isStatic;
+  }
+
+  if (any)
+    bindings0[let->arg].func = &func;
+  const ast::Term *rest = transform(let->term, bindings0);
+
+  //the clones are bound right inside the let, where the original is
+  //in scope with everything it refers to
+  for (auto it = func.order.rbegin(); it != func.order.rend(); ++it) {
+    const Clone &clone = func.clones[*it];
+    if (clone.name.empty())
+      continue;
+    rest = at(new ast::Application(at(new ast::Abstraction(clone.name, clone.type, rest), let), clone.term), app);
+  }
+  return at(new ast::Application(at(new ast::Abstraction(let->arg, let->type, rest), let), fix), app);
+}
+
+const ast::Term *Specializer::transformCall(const ast::Application *app, Bindings &bindings) {
+  std::vector<const ast::Term *> args;
+  const ast::Term *head = app;
+  while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app0->arg);
+    head = app0->func;
+  }
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  if (ref == NULL)
+    return NULL;
+  auto it = bindings.find(ref->name);
+  if (it == bindings.end() || it->second.func == NULL)
+    return NULL;
+  Function &func = *it->second.func;
+  size_t n = func.params.size();
+  if (args.size() < n)
+    return NULL;
+
+  for (size_t i = 0; i < n; ++i) {
+    Template t;
+    if (!func.statics[i] || !getTemplate(args[i], func.params[i]->arg, bindings, t))
+      continue;
+    const Clone &clone = getClone(func, i, t);
+    if (clone.name.empty())
+      continue;
+
+    //the static argument goes, what it captured comes after the rest
+    const ast::Term *term = at(new ast::Reference(clone.name), head);
+    for (size_t j = 0; j < n; ++j)
+      if (j != i)
+        term = at(new ast::Application(term, transform(args[j], bindings)), app);
+    for (auto dynamic : t.dynamics)
+      term = at(new ast::Application(term, transform(dynamic, bindings)), app);
+    for (size_t j = n; j < args.size(); ++j)
+      term = at(new ast::Application(term, transform(args[j], bindings)), app);
+    return term;
+  }
+  return NULL;
+}
+
+bool Specializer::getTemplate(const ast::Term *arg, const std::string &prefix, Bindings &bindings, Template &t) {
+  //the extra parameters cannot clash with anything from the source
+  auto extra = [&](size_t j) {
+    return prefix + "#" + std::to_string(j);
+  };
+
+  if (auto abs = dynamic_cast<const ast::Abstraction *>(arg)) {
+    //a lambda, its local free variables are passed along
+    const ast::Term *term = abs;
+    for (auto name : freeVariables(abs)) {
+      auto it = bindings.find(name);
+      if (it == bindings.end())
+        return false;
+      if (it->second.global)
+        continue;
+      if (it->second.type == NULL)
+        return false;
+      std::string name0 = extra(t.dynamics.size());
+      term = substitute(term, name, new ast::Reference(name0));
+      if (term == NULL)
+        return false;
+      t.dynamics.push_back(at(new ast::Reference(name), arg));
+      t.types.push_back(it->second.type);
+    }
+    t.term = term;
+    t.key = "\\" + std::to_string(reinterpret_cast<uintptr_t>(abs));
+    t.desc = "\\" + abs->arg + " at " + std::to_string(abs->nrow) + ":" + std::to_string(abs->ncol);
+    return true;
+  }
+
+  //a global short of some of its arguments, they are passed along
+  std::vector<const ast::Term *> args;
+  const ast::Term *head = arg;
+  while (auto app = dynamic_cast<const ast::Application *>(head)) {
+    args.insert(args.begin(), app->arg);
+    head = app->func;
+  }
+  auto ref = dynamic_cast<const ast::Reference *>(head);
+  if (ref == NULL)
+    return false;
+  auto it = bindings.find(ref->name);
+  if (it == bindings.end() || !it->second.global)
+    return false;
+
+  const ast::Type *type = it->second.type;
+  const ast::Term *term = at(new ast::Reference(ref->name), head);
+  t.desc = "(" + ref->name;
+  for (size_t j = 0; j < args.size(); ++j) {
+    auto func_type = dynamic_cast<const ast::FunctionType *>(type);
+    if (func_type == NULL)
+      return false;
+    term = at(new ast::Application(term, new ast::Reference(extra(j))), arg);
+    t.dynamics.push_back(args[j]);
+    t.types.push_back(func_type->left);
+    t.desc += " _";
+    type = func_type->right;
+  }
+  if (dynamic_cast<const ast::FunctionType *>(type) == NULL)
+    return false;
+  t.term = term;
+  t.key = ref->name + "/" + std::to_string(args.size());
+  t.desc += ")";
+  return true;
+}
+
+const Specializer::Clone &Specializer::getClone(Function &func, const size_t i, const Template &t) {
+  std::string key = std::to_string(i) + ":" + t.key;
+  auto it = func.clones.find(key);
+  if (it != func.clones.end())
+    return it->second;
+  func.order.push_back(key);
+  Clone &clone = func.clones[key];
+
+  const ast::Term *body = func.params.back()->term;
+  size_t size = termSize(body);
+  if (size > options.specializeLimit) {
+    report.add("specialize", func.name + " not on " + t.desc + ", body of " + std::to_string(size) +
+               " terms is over the limit of " + std::to_string(options.specializeLimit));
+    return clone;
+  }
+
+  std::string name = func.name + "#" + std::to_string(func.order.size());
+  std::vector<std::string> extras;
+  for (size_t j = 0; j < t.dynamics.size(); ++j)
+    extras.push_back(func.params[i]->arg + "#" + std::to_string(j));
+
+  //recursive calls go to the clone, then the argument is put in
+  body = rewriteCalls(body, &func.abs->arg, &func.params[i]->arg, name, func.params.size(), i, extras);
+  if (body != NULL)
+    body = substitute(body, func.params[i]->arg, t.term);
+  if (body == NULL)
+    return clone;
+
+  const ast::Type *result = func.abs->type;
+  for (size_t j = 0; j < func.params.size(); ++j)
+    result = dynamic_cast<const ast::FunctionType *>(result)->right;
+  const ast::Type *type = result;
+  for (size_t j = extras.size(); j-- > 0; ) {
+    body = at(new ast::Abstraction(extras[j], t.types[j], body), func.params[i]);
+    type = new ast::FunctionType(t.types[j], type);
+  }
+  for (size_t j = func.params.size(); j-- > 0; ) {
+    if (j == i)
+      continue;
+    body = at(new ast::Abstraction(func.params[j]->arg, func.params[j]->type, body), func.params[j]);
+    type = new ast::FunctionType(func.params[j]->type, type);
+  }
+
+  clone.name = name;
+  clone.type = type;
+  clone.term = at(new ast::Fixpoint(at(new ast::Abstraction(name, type, body), func.abs)), func.abs);
+  report.add("specialize", func.name + " on " + t.desc + " as " + name);
+  return clone;
+}
+
+const ast::Term *Specializer::rewriteCalls(const ast::Term *term, const std::string *name, const std::string *param,
+                                           const std::string &clone, const size_t n, const size_t i,
+                                           const std::vector<std::string> &extras) {
+  /* name is the function and param its static parameter, each NULL
+     once shadowed; a use of the function other than a call passing
+     param along gives NULL */
+  if (name == NULL)
+    return copyTerm(term);
+  auto shadow = [](const std::string *name, const std::string &arg) {
+    return name != NULL && *name == arg ? NULL : name;
+  };
+  auto rewrite = [&](const ast::Term *term0) {
+    return rewriteCalls(term0, name, param, clone, n, i, extras);
+  };
+
+  if (auto ref = dynamic_cast<const ast::Reference *>(term)) {
+    if (ref->name == *name)
+      return (const ast::Term *)NULL;
+    return (const ast::Term *)at(new ast::Reference(ref->name), term);
+  } else if (auto abs = dynamic_cast<const ast::Abstraction *>(term)) {
+    auto body = rewriteCalls(abs->term, shadow(name, abs->arg), shadow(param, abs->arg), clone, n, i, extras);
+    return body == NULL ? NULL : (const ast::Term *)at(new ast::Abstraction(abs->arg, abs->type, body), term);
+  } else if (auto app = dynamic_cast<const ast::Application *>(term)) {
+    std::vector<const ast::Term *> args;
+    const ast::Term *head = app;
+    while (auto app0 = dynamic_cast<const ast::Application *>(head)) {
+      args.insert(args.begin(), app0->arg);
+      head = app0->func;
+    }
+    auto ref = dynamic_cast<const ast::Reference *>(head);
+    if (ref == NULL || ref->name != *name) {
+      auto func = rewrite(app->func);
+      auto arg = rewrite(app->arg);
+      return func == NULL || arg == NULL ? NULL : (const ast::Term *)at(new ast::Application(func, arg), term);
+    }
+
+    auto ref0 = args.size() < n ? NULL : dynamic_cast<const ast::Reference *>(args[i]);
+    if (ref0 == NULL || param == NULL || ref0->name != *param)
+      return (const ast::Term *)NULL;
+    std::vector<const ast::Term *> args0;
+    for (size_t j = 0; j < args.size(); ++j) {
+      auto arg = j == i ? NULL : rewrite(args[j]);
+      if (j != i && arg == NULL)
+        return (const ast::Term *)NULL;
+      if (j != i)
+        args0.push_back(arg);
+      //what the static argument captured comes right after the
+      //parameters
+      if (j + 1 == n)
+        for (auto extra : extras)
+          args0.push_back(at(new ast::Reference(extra), args[i]));
+    }
+    const ast::Term *term0 = at(new ast::Reference(clone), head);
+    for (auto arg : args0)
+      term0 = at(new ast::Application(term0, arg), term);
+    return term0;
+  } else if (auto des = dynamic_cast<const ast::Desum *>(term)) {
+    auto sum = rewrite(des->sum);
+    if (sum == NULL)
+      return (const ast::Term *)NULL;
+    std::vector<std::pair<const std::string, const ast::Term *> > cases;
+    for (auto pair : des->cases) {
+      auto term0 = rewriteCalls(pair.second, shadow(name, pair.first), shadow(param, pair.first), clone, n, i, extras);
+      if (term0 == NULL)
+        return (const ast::Term *)NULL;
+      cases.push_back(std::make_pair(pair.first, term0));
+    }
+    return (const ast::Term *)at(new ast::Desum(sum, cases), term);
+  } else if (auto dep = dynamic_cast<const ast::Deproduct *>(term)) {
+    auto product = rewrite(dep->product);
+    const std::string *name0 = name, *param0 = param;
+    for (auto arg : dep->names) {
+      name0 = shadow(name0, arg);
+      param0 = shadow(param0, arg);
+    }
+    auto body = rewriteCalls(dep->term, name0, param0, clone, n, i, extras);
+    return product == NULL || body == NULL ? NULL :
+      (const ast::Term *)at(new ast::Deproduct(product, dep->names, body), term);
+  } else if (auto fix = dynamic_cast<const ast::Fixpoint *>(term)) {
+    auto body = rewrite(fix->term);
+    return body == NULL ? NULL : (const ast::Term *)at(new ast::Fixpoint(body), term);
+  } else
+    throw TermNotMatch(term, typeid(ast::Term));
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# bench-batch.sh [NAME] [RECORDS] [LENGTH]: records per second of a
+# sample run over RECORDS random lists of LENGTH numbers, with 1 to
+# the number of cores workers; run from backend/test
+NAME=${1:-map}
+RECORDS=${2:-1000000}
+LENGTH=${3:-16}
+make ll/$NAME.batch >/dev/null || exit 1
+input=$(mktemp)
+awk -v r=$RECORDS -v n=$LENGTH 'BEGIN { srand(1); for (i = 0; i < r; ++i) { s = int(rand() * 1000); for (j = 1; j < n; ++j) s = s " " int(rand() * 1000); print s } }' >$input
+cores=$(nproc)
+w=1
+while [ $w -le $cores ]; do
+  s=$(date +%s%N)
+  ESTLC_WORKERS=$w ./ll/$NAME.batch $input >/dev/null || exit 1
+  e=$(date +%s%N)
+  echo "$w workers: $(( RECORDS * 1000000000 / (e - s) )) records/s"
+  w=$(( w * 2 ))
+done
+rm -f $input
@@ -0,0 +1,20 @@
+#!/bin/sh
+# bench-chunk.sh [NAME] [N]: a sample over N random numbers with list
+# cells allocated one at a time and in chunks of 16: compute time,
+# peak memory per element and, when perf is there, cache misses; run
+# from backend/test
+NAME=${1:-map}
+N=${2:-1000000}
+input=$(mktemp)
+awk -v n=$N 'BEGIN { srand(1); print n; for (i = 0; i < n; ++i) print int(rand() * 100000) }' >$input
+for c in 1 16; do
+  rm -f ll/$NAME.ll
+  make ll/$NAME.out BACKENDFLAGS=-fchunk=$c >/dev/null || exit 1
+  compute=$(./ll/$NAME.out -t $input 2>&1 >/dev/null | awk '/^compute/ { print $2 }')
+  kb=$( { /usr/bin/time -f %M ./ll/$NAME.out $input >/dev/null; } 2>&1 | tail -1)
+  echo "chunk=$c compute ${compute}s, $(( kb * 1024 / N )) bytes per element"
+  if command -v perf >/dev/null; then
+    perf stat -e cache-misses ./ll/$NAME.out $input 2>&1 >/dev/null | awk '/cache-misses/ { print "  cache misses " $1 }'
+  fi
+done
+rm -f $input
@@ -0,0 +1,15 @@
+#!/bin/sh
+# bench-par.sh [N]: time the par sample sorting N random numbers with
+# 1 to 32 workers; run from backend/test
+N=${1:-10000000}
+rm -f ll/par.ll
+make ll/par.out BACKENDFLAGS=-fparallel=1 >/dev/null || exit 1
+input=$(mktemp)
+awk -v n=$N 'BEGIN { srand(1); print n; for (i = 0; i < n; ++i) print int(rand() * 4294967295) }' >$input
+for w in 1 2 4 8 16 32; do
+  s=$(date +%s%N)
+  ESTLC_WORKERS=$w ./ll/par.out <$input >/dev/null || exit 1
+  e=$(date +%s%N)
+  echo "$w workers: $(( (e - s) / 1000000 )) ms"
+done
+rm -f $input
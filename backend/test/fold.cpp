@@ -0,0 +1,16 @@
+#include <ast.hpp>
+#include <lexicalAnalyzer.h>
+#include <syntaxAnalyzer.h>
+#include <fstream>
+
+using namespace ast;
+
+Program *getProgram() {
+  std::ifstream ifs("fold.estlc");
+  LexicalAnalyzer la;
+  TokenStream ts(la.parse(ifs));
+  
+  SyntaxAnalyzer *sa = new SyntaxAnalyzer(ts);
+  return sa->getProgram();
+}
+
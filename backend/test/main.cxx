@@ -1,18 +1,55 @@
 #include <ast.hpp>
+#include <fstream>
 #include <string>
+#include <cheader.hpp>
 #include <codegen.hpp>
+#include <deforest.hpp>
+#include <eliminate.hpp>
 #include <exception.hpp>
+#include <options.hpp>
+#include <report.hpp>
+#include <simplify.hpp>
+#include <specialize.hpp>
 #include <iostream>
 
 using namespace ast;
 
 extern Program *getProgram();
 
-int main() {
-  Program *program = getProgram();
+int main(int argc, char **argv) {
+  Options options;
+  try {
+    options.parse(argc, argv);
+  } catch (OptionException e) {
+    std::cerr << "unknown option " << e.option_ << '\n';
+    return 1;
+  }
 
-  Codegen codegen;
+  //the IR goes to stderr, the report to stdout
+  Report report;
+  const Program *program = getProgram();
+  program = Simplifier(options, report).run(*program);
+  program = Specializer(options, report).run(*program);
+  //what is shared is not fused away
+  program = Eliminator(options, report).run(*program);
+  program = Deforester(options, report).run(*program);
+  //the fused functions leave lets behind
+  program = Simplifier(options, report).run(*program);
+
+  Codegen codegen(options);
   Codegen::Term v = codegen.generate(*program);
   (void)v;
+  report.add("codegen", std::to_string(codegen.reused) + " functions reused");
+  if (codegen.memoized > 0)
+    report.add("codegen", std::to_string(codegen.memoized) + " functions memoized");
+  for (auto why : codegen.unmemoized)
+    report.add("codegen", why);
+  if (options.fold)
+    report.add("codegen", std::to_string(codegen.fold()) + " functions folded");
+  if (!options.header.empty()) {
+    std::ofstream os(options.header);
+    CHeader(codegen.getLayout()).write(*program, "_ESTLC_TYPES_H_", os);
+  }
   codegen.dump();
+  report.print(std::cout);
 }
@@ -0,0 +1,198 @@
+#define GC_THREADS
+#include <gc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <abi.h>
+#include <lazy.h>
+#include <par.h>
+#include <run.h>
+
+#include "list.h"
+
+/*
+  Runs the program once per line of the input, a list of numbers, on a
+  pool of threads, and writes one line per result in the order of the
+  input. Usage: batch [file], stdin without one; ESTLC_WORKERS threads,
+  one per core by default.
+*/
+
+/* records a thread takes at a time */
+#define CHUNK 256
+#define MAX_WORKERS 256
+/* stack of a thread when the main thread has no limit */
+#define WORKER_STACK ((size_t)256 << 20)
+
+struct record {
+  const char *begin, *end;
+  char *out;
+  size_t len;
+  atomic_int done;
+};
+
+static struct record *records;
+static size_t nrecords;
+static atomic_size_t next;
+
+static void *parse(const char *p, const char *end) {
+  void *arg;
+  struct list_nat **cur = (struct list_nat **)&arg;
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      ++p;
+    if (p == end || *p < '0' || *p > '9')
+      break;
+    estlc_int x = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+      x = x * 10 + (estlc_int)(*p++ - '0');
+
+    struct list_nat_y *y = (struct list_nat_y *)GC_MALLOC(sizeof(struct list_nat_y));
+    y->x = x;
+    *cur = (struct list_nat *)ESTLC_MKTAG(y, 1);
+    cur = &y->next;
+  }
+  *cur = (struct list_nat *)ESTLC_MKTAG(NULL, 0);
+  return arg;
+}
+
+static void outOfMemory(void) {
+  fputs("batch: out of memory\n", stderr);
+  exit(1);
+}
+
+static void print(struct record *r, struct list_nat *l) {
+  size_t size = 64, len = 0;
+  char *out = malloc(size);
+  if (out == NULL)
+    outOfMemory();
+  while (ESTLC_TAG(l = estlc_force(l)) != 0) {
+    struct list_nat_y *y = (struct list_nat_y *)ESTLC_UNTAG(l);
+    if (size - len < 16 && (out = realloc(out, size *= 2)) == NULL)
+      outOfMemory();
+    len += sprintf(out + len, len == 0 ? "%u" : " %u", y->x);
+    l = y->next;
+  }
+  out[len++] = '\n';
+  r->out = out;
+  r->len = len;
+}
+
+/* runs the next chunk, 0 when none is left */
+static int runChunk(void) {
+  size_t first = atomic_fetch_add(&next, CHUNK);
+  if (first >= nrecords)
+    return 0;
+  size_t last = first + CHUNK < nrecords ? first + CHUNK : nrecords;
+  for (size_t i = first; i < last; ++i) {
+    struct record *r = &records[i];
+    print(r, (struct list_nat *)umain(parse(r->begin, r->end)));
+    atomic_store_explicit(&r->done, 1, memory_order_release);
+  }
+  return 1;
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  while (runChunk())
+    ;
+  return NULL;
+}
+
+/* NULL if there is no room for it */
+static char *readAll(FILE *f, size_t *len) {
+  size_t size = 1 << 20;
+  char *buf = malloc(size);
+  if (buf == NULL)
+    return NULL;
+  *len = 0;
+  size_t n;
+  while ((n = fread(buf + *len, 1, size - *len, f)) > 0) {
+    *len += n;
+    if (*len == size) {
+      char *more = realloc(buf, size *= 2);
+      if (more == NULL) {
+        free(buf);
+        return NULL;
+      }
+      buf = more;
+    }
+  }
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  estlc_init();
+  //spawned work runs in place, the records are the parallelism
+  estlc_par_init(1);
+
+  FILE *f = argc > 1 ? fopen(argv[1], "r") : stdin;
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  size_t len;
+  char *buf = readAll(f, &len);
+  if (buf == NULL) {
+    perror(argc > 1 ? argv[1] : "stdin");
+    return 1;
+  }
+
+  size_t size = 1024;
+  records = malloc(size * sizeof(struct record));
+  if (records == NULL)
+    outOfMemory();
+  for (const char *p = buf, *end = buf + len; p < end;) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    if (nrecords == size && (records = realloc(records, (size *= 2) * sizeof(struct record))) == NULL)
+      outOfMemory();
+    records[nrecords].begin = p;
+    records[nrecords].end = eol;
+    atomic_init(&records[nrecords].done, 0);
+    ++nrecords;
+    p = eol + 1;
+  }
+
+  const char *env = getenv("ESTLC_WORKERS");
+  long workers = env == NULL ? 0 : atol(env);
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > MAX_WORKERS)
+    workers = MAX_WORKERS;
+
+  //a record may recurse as deep as on the main thread
+  struct rlimit limit;
+  size_t stack = WORKER_STACK;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    stack = limit.rlim_cur;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack);
+  pthread_t threads[MAX_WORKERS];
+  for (long i = 1; i < workers; ++i)
+    pthread_create(&threads[i], &attr, worker, NULL);
+  pthread_attr_destroy(&attr);
+
+  //the main thread writes in order, and runs records while it waits
+  for (size_t i = 0; i < nrecords; ++i) {
+    while (!atomic_load_explicit(&records[i].done, memory_order_acquire))
+      if (!runChunk())
+        sched_yield();
+    fwrite(records[i].out, 1, records[i].len, stdout);
+    free(records[i].out);
+  }
+
+  for (long i = 1; i < workers; ++i)
+    pthread_join(threads[i], NULL);
+  estlc_par_exit();
+  free(records);
+  free(buf);
+  return 0;
+}
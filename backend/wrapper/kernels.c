@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+#include "kernels.h"
+
+/* below this a range is sorted by insertion */
+#define SMALL 16
+
+enum { SCALAR, SSSE3, AVX2 };
+static int level;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* Ints are unsigned, as the comparisons of the language are */
+static int holds(unsigned op, estlc_int x, estlc_int y) {
+  switch (op) {
+  case ESTLC_VEC_LT: return x < y;
+  case ESTLC_VEC_GT: return x > y;
+  case ESTLC_VEC_LE: return x <= y;
+  case ESTLC_VEC_GE: return x >= y;
+  case ESTLC_VEC_EQ: return x == y;
+  default: return x != y;
+  }
+}
+
+static size_t filterScalar(const estlc_int *xs, size_t n, unsigned op, estlc_int x, estlc_int *out) {
+  //written whether kept or not, a branch would be a coin flip
+  size_t k = 0;
+  for (size_t i = 0; i < n; ++i) {
+    estlc_int y = xs[i];
+    out[k] = y;
+    k += holds(op, x, y);
+  }
+  return k;
+}
+
+static void mapScalar(estlc_int *xs, size_t n, unsigned op, estlc_int x) {
+  if (op == ESTLC_VEC_ADD)
+    for (size_t i = 0; i < n; ++i)
+      xs[i] = x + xs[i];
+  else
+    for (size_t i = 0; i < n; ++i)
+      xs[i] = x - xs[i];
+}
+
+#ifdef KERNELS_X86
+/*
+  A filter compares a block of lanes at once and compresses those kept
+  to the front of the block by a shuffle from a table, indexed by the
+  mask of the comparison; it then stores the whole block and moves on
+  by as many as were kept. The compare is signed, so both sides have
+  their sign bit flipped first. GT and LE are LT and GE with the
+  operands swapped, GE, LE and NE the others negated.
+*/
+static uint32_t compress8[256][8];
+static uint8_t compress4[16][16];
+
+static void initTables(void) {
+  for (unsigned mask = 0; mask < 256; ++mask) {
+    unsigned k = 0;
+    for (unsigned i = 0; i < 8; ++i)
+      if (mask & (1u << i))
+        compress8[mask][k++] = i;
+    while (k < 8)
+      compress8[mask][k++] = 0;
+  }
+  for (unsigned mask = 0; mask < 16; ++mask) {
+    unsigned k = 0;
+    for (unsigned i = 0; i < 4; ++i)
+      if (mask & (1u << i))
+        for (unsigned b = 0; b < 4; ++b)
+          compress4[mask][k++] = 4 * i + b;
+    while (k < 16)
+      compress4[mask][k++] = 0x80;
+  }
+}
+
+/* the mask bits to flip after the compare */
+static unsigned negated(unsigned op, unsigned all) {
+  return op == ESTLC_VEC_GE || op == ESTLC_VEC_LE || op == ESTLC_VEC_NE ? all : 0;
+}
+
+__attribute__((target("avx2")))
+static size_t filterAvx2(const estlc_int *xs, size_t n, unsigned op, estlc_int x, estlc_int *out) {
+  const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+  const __m256i xv = _mm256_xor_si256(_mm256_set1_epi32((int32_t)x), sign);
+  const unsigned flip = negated(op, 0xff);
+  size_t k = 0, i = 0;
+  //the block stored reaches no further than the one just read
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(xs + i));
+    __m256i y = _mm256_xor_si256(v, sign);
+    __m256i c;
+    if (op == ESTLC_VEC_EQ || op == ESTLC_VEC_NE)
+      c = _mm256_cmpeq_epi32(y, xv);
+    else if (op == ESTLC_VEC_LT || op == ESTLC_VEC_GE)
+      c = _mm256_cmpgt_epi32(y, xv);
+    else
+      c = _mm256_cmpgt_epi32(xv, y);
+    unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(c)) ^ flip;
+    __m256i perm = _mm256_loadu_si256((const __m256i *)compress8[mask]);
+    _mm256_storeu_si256((__m256i *)(out + k), _mm256_permutevar8x32_epi32(v, perm));
+    k += __builtin_popcount(mask);
+  }
+  return k + filterScalar(xs + i, n - i, op, x, out + k);
+}
+
+__attribute__((target("ssse3")))
+static size_t filterSsse3(const estlc_int *xs, size_t n, unsigned op, estlc_int x, estlc_int *out) {
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  const __m128i xv = _mm_xor_si128(_mm_set1_epi32((int32_t)x), sign);
+  const unsigned flip = negated(op, 0xf);
+  size_t k = 0, i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(xs + i));
+    __m128i y = _mm_xor_si128(v, sign);
+    __m128i c;
+    if (op == ESTLC_VEC_EQ || op == ESTLC_VEC_NE)
+      c = _mm_cmpeq_epi32(y, xv);
+    else if (op == ESTLC_VEC_LT || op == ESTLC_VEC_GE)
+      c = _mm_cmpgt_epi32(y, xv);
+    else
+      c = _mm_cmpgt_epi32(xv, y);
+    unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(c)) ^ flip;
+    __m128i shuffle = _mm_loadu_si128((const __m128i *)compress4[mask]);
+    _mm_storeu_si128((__m128i *)(out + k), _mm_shuffle_epi8(v, shuffle));
+    k += __builtin_popcount(mask);
+  }
+  return k + filterScalar(xs + i, n - i, op, x, out + k);
+}
+
+__attribute__((target("avx2")))
+static void mapAvx2(estlc_int *xs, size_t n, unsigned op, estlc_int x) {
+  const __m256i xv = _mm256_set1_epi32((int32_t)x);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i y = _mm256_loadu_si256((const __m256i *)(xs + i));
+    y = op == ESTLC_VEC_ADD ? _mm256_add_epi32(xv, y) : _mm256_sub_epi32(xv, y);
+    _mm256_storeu_si256((__m256i *)(xs + i), y);
+  }
+  mapScalar(xs + i, n - i, op, x);
+}
+
+__attribute__((target("ssse3")))
+static void mapSsse3(estlc_int *xs, size_t n, unsigned op, estlc_int x) {
+  const __m128i xv = _mm_set1_epi32((int32_t)x);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i y = _mm_loadu_si128((const __m128i *)(xs + i));
+    y = op == ESTLC_VEC_ADD ? _mm_add_epi32(xv, y) : _mm_sub_epi32(xv, y);
+    _mm_storeu_si128((__m128i *)(xs + i), y);
+  }
+  mapScalar(xs + i, n - i, op, x);
+}
+#endif
+
+static void init(void) {
+  level = SCALAR;
+#ifdef KERNELS_X86
+  initTables();
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    level = AVX2;
+  else if (__builtin_cpu_supports("ssse3"))
+    level = SSSE3;
+  //asked for by hand, never more than the CPU has
+  const char *env = getenv("ESTLC_SIMD");
+  if (env != NULL && strcmp(env, "scalar") == 0)
+    level = SCALAR;
+  else if (env != NULL && strcmp(env, "ssse3") == 0 && level > SSSE3)
+    level = SSSE3;
+#endif
+}
+
+size_t estlc_kfilter(const estlc_int *xs, size_t n, unsigned op, estlc_int x, estlc_int *out) {
+  pthread_once(&once, init);
+#ifdef KERNELS_X86
+  if (level == AVX2)
+    return filterAvx2(xs, n, op, x, out);
+  if (level == SSSE3)
+    return filterSsse3(xs, n, op, x, out);
+#endif
+  return filterScalar(xs, n, op, x, out);
+}
+
+void estlc_kmap(estlc_int *xs, size_t n, unsigned op, estlc_int x) {
+  pthread_once(&once, init);
+#ifdef KERNELS_X86
+  if (level == AVX2) {
+    mapAvx2(xs, n, op, x);
+    return;
+  }
+  if (level == SSSE3) {
+    mapSsse3(xs, n, op, x);
+    return;
+  }
+#endif
+  mapScalar(xs, n, op, x);
+}
+
+static void insertion(estlc_int *xs, size_t n) {
+  for (size_t i = 1; i < n; ++i) {
+    estlc_int y = xs[i];
+    size_t j = i;
+    for (; j > 0 && xs[j - 1] > y; --j)
+      xs[j] = xs[j - 1];
+    xs[j] = y;
+  }
+}
+
+static estlc_int median(estlc_int a, estlc_int b, estlc_int c) {
+  if (a > b) {
+    estlc_int t = a;
+    a = b;
+    b = t;
+  }
+  return c < a ? a : c > b ? b : c;
+}
+
+/*
+  A quicksort partitioning by the filter kernels: those below the pivot
+  go to tmp, those above are filtered in place, and those equal, which
+  neither kept, are the pivot again. The smaller side is sorted first,
+  so the stack stays logarithmic.
+*/
+static void sort(estlc_int *xs, estlc_int *tmp, size_t n) {
+  while (n > SMALL) {
+    estlc_int p = median(xs[0], xs[n / 2], xs[n - 1]);
+    size_t below = estlc_kfilter(xs, n, ESTLC_VEC_GT, p, tmp);
+    size_t above = estlc_kfilter(xs, n, ESTLC_VEC_LT, p, xs);
+    memmove(xs + n - above, xs, above * sizeof(estlc_int));
+    for (size_t i = below; i < n - above; ++i)
+      xs[i] = p;
+    memcpy(xs, tmp, below * sizeof(estlc_int));
+    if (below < above) {
+      sort(xs, tmp, below);
+      xs += n - above;
+      n = above;
+    } else {
+      sort(xs + n - above, tmp, above);
+      n = below;
+    }
+  }
+  insertion(xs, n);
+}
+
+void estlc_ksort(estlc_int *xs, size_t n) {
+  if (n <= SMALL) {
+    insertion(xs, n);
+    return;
+  }
+  estlc_int *tmp = malloc(n * sizeof(estlc_int));
+  if (tmp == NULL) {
+    fprintf(stderr, "sort of %zu elements: out of memory\n", n);
+    exit(1);
+  }
+  sort(xs, tmp, n);
+  free(tmp);
+}
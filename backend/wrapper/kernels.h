@@ -0,0 +1,23 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <stddef.h>
+
+#include <vec.h>
+
+/*
+  Bulk kernels over Ints in a row, for the vector operations of vec.c;
+  op is an estlc_vec_op and (op x y) is what the language computes.
+  Each runs the widest code the CPU has, AVX2, SSSE3 or plain C, picked
+  on first use; ESTLC_SIMD=avx2, ssse3 or scalar asks for one, so they
+  can be checked against each other.
+*/
+
+/* the y of xs for which (op x y) holds, in order, into out; out may be
+   xs, else it has room for n. Returns how many */
+size_t estlc_kfilter(const estlc_int *xs, size_t n, unsigned op, estlc_int x, estlc_int *out);
+/* each y of xs replaced by (op x y) */
+void estlc_kmap(estlc_int *xs, size_t n, unsigned op, estlc_int x);
+void estlc_ksort(estlc_int *xs, size_t n);
+
+#endif
@@ -0,0 +1,32 @@
+#define GC_THREADS
+#include <gc.h>
+#include <sched.h>
+
+#include <abi.h>
+#include <lazy.h>
+
+void *estlc_lazy(void *(*produce)(void *env), void *env) {
+  struct estlc_lazy *cell = GC_MALLOC(sizeof(struct estlc_lazy));
+  atomic_init(&cell->state, 0);
+  cell->produce = produce;
+  cell->env = env;
+  return ESTLC_MKTAG(cell, ESTLC_LAZY);
+}
+
+void *estlc_force(void *ref) {
+  //a value made by a producer may be lazy again at its head
+  while (ESTLC_TAG(ref) == ESTLC_LAZY) {
+    struct estlc_lazy *cell = ESTLC_UNTAG(ref);
+    int state = 0;
+    if (atomic_compare_exchange_strong(&cell->state, &state, 1)) {
+      cell->value = cell->produce(cell->env);
+      cell->env = NULL;
+      atomic_store_explicit(&cell->state, 2, memory_order_release);
+    } else
+      //another task got there first
+      while (atomic_load_explicit(&cell->state, memory_order_acquire) != 2)
+        sched_yield();
+    ref = cell->value;
+  }
+  return ref;
+}
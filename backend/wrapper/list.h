@@ -0,0 +1,29 @@
+#ifndef _LIST_H_
+#define _LIST_H_
+
+#include <stdint.h>
+
+#include <abi.h>
+
+/* list_nat has two constructors, so the codegen keeps the index in
+   the low bits of the payload pointer: nil is 0, cons is y | 1. This
+   is what -fheader writes for it, kept by hand as the wrapper serves
+   every program over a list of Int */
+struct list_nat;
+
+/* the Int field is stored inline, see Layout::getProductType */
+struct list_nat_y {
+  estlc_int x;
+  struct list_nat *next;
+};
+
+/* a packed list: the magic, the count, then the elements, all little
+   endian; what main.c reads from a file and writes with -o */
+#define ESTLC_LIST_MAGIC "ESTL"
+struct list_header {
+  char magic[4];
+  uint32_t reserved;
+  uint64_t n;
+};
+
+#endif
@@ -1,51 +1,329 @@
+#define _POSIX_C_SOURCE 200809L
+#define GC_THREADS
+#include <gc.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-extern void *umain(void *arg);
+#include <abi.h>
+#include <lazy.h>
+#include <memo.h>
+#include <par.h>
+#include <run.h>
 
-struct list_nat;
-  
-struct list_nat_y {
-  uint32_t *x;
-  struct list_nat *next;
+#include "list.h"
+
+/*
+  Usage: main [-t] [-s] [-o file] [file]. The input, stdin without a
+  file, is either text, the count then the numbers, or a packed list
+  (see list.h). The result is printed one number per line, or packed
+  into the file of -o. -t reports input, compute and output time, and
+  the hits and misses of each memo table, on stderr. -s reads the
+  input as the program walks it, for a program compiled with
+  -fstream=1, and writes the result as it is made; what was read or
+  written can be collected.
+*/
+
+struct input {
+  const char *data;
+  size_t len;
+  int mapped;
 };
-  
-struct list_nat {
-  uint32_t idx; //fuck
-  void *y;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int readInput(int fd, struct input *in) {
+  //a regular file is mapped, anything else read whole
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+      in->data = p;
+      in->len = st.st_size;
+      in->mapped = 1;
+      return 0;
+    }
+  }
+  size_t size = 1 << 20, len = 0;
+  char *buf = malloc(size);
+  if (buf == NULL)
+    return -1;
+  ssize_t n;
+  while ((n = read(fd, buf + len, size - len)) > 0)
+    if ((len += n) == size) {
+      char *more = realloc(buf, size *= 2);
+      if (more == NULL) {
+        free(buf);
+        return -1;
+      }
+      buf = more;
+    }
+  if (n < 0) {
+    free(buf);
+    return -1;
+  }
+  in->data = buf;
+  in->len = len;
+  in->mapped = 0;
+  return 0;
+}
+
+/* NULL if there is no number left */
+static const char *parseInt(const char *p, const char *end, uint64_t *x) {
+  while (p < end && (*p < '0' || *p > '9'))
+    ++p;
+  if (p == end)
+    return NULL;
+  *x = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    *x = *x * 10 + (uint64_t)(*p++ - '0');
+  return p;
+}
+
+/* where the numbers start and how many there are at most: the count
+   given, but no more than the rest of the data can hold */
+static const char *getCount(const struct input *in, int *packed, uint64_t *n) {
+  const char *p = in->data, *end = in->data + in->len;
+  struct list_header header;
+  *packed = in->len >= sizeof(header) && memcmp(p, ESTLC_LIST_MAGIC, 4) == 0;
+  if (!*packed) {
+    if ((p = parseInt(p, end, n)) == NULL) {
+      *n = 0;
+      return end;
+    }
+    //a digit and a separator each
+    if ((size_t)(end - p) / 2 < *n)
+      *n = (end - p) / 2;
+    return p;
+  }
+  memcpy(&header, p, sizeof(header));
+  *n = header.n;
+  p += sizeof(header);
+  if ((size_t)(end - p) / sizeof(estlc_int) < *n)
+    *n = (end - p) / sizeof(estlc_int);
+  return p;
+}
+
+/* the cells of the whole list come in one block, linked in order;
+   -1 if there is no room for it */
+static int load(const struct input *in, void **list) {
+  const char *end = in->data + in->len;
+  int packed;
+  uint64_t n;
+  const char *p = getCount(in, &packed, &n);
+
+  struct list_nat_y *cells = NULL;
+  if (n != 0 && (n > SIZE_MAX / sizeof(struct list_nat_y) ||
+                 (cells = (struct list_nat_y *)malloc(n * sizeof(struct list_nat_y))) == NULL)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  //text may end before the count does, the list is what was there
+  for (uint64_t i = 0; i < n; ++i) {
+    if (packed) {
+      memcpy(&cells[i].x, p, sizeof(estlc_int));
+      p += sizeof(estlc_int);
+    } else {
+      uint64_t x;
+      if ((p = parseInt(p, end, &x)) == NULL) {
+        n = i;
+        break;
+      }
+      cells[i].x = (estlc_int)x;
+    }
+  }
+  for (uint64_t i = 0; i < n; ++i)
+    cells[i].next = (struct list_nat *)(i + 1 < n ? ESTLC_MKTAG(&cells[i + 1], 1) : ESTLC_MKTAG(NULL, 0));
+  *list = n == 0 ? ESTLC_MKTAG(NULL, 0) : ESTLC_MKTAG(cells, 1);
+  return 0;
+}
+
+/* the rest of a streamed input, one per cell */
+struct reader {
+  const char *p;
+  uint64_t left;
 };
+static const char *streamEnd;
+static int streamPacked;
+
+static void *readNext(void *env) {
+  const struct reader *r = env;
+  uint64_t x;
+  const char *p = NULL;
+  if (r->left == 0 || (!streamPacked && (p = parseInt(r->p, streamEnd, &x)) == NULL))
+    return ESTLC_MKTAG(NULL, 0);
+  struct list_nat_y *y = (struct list_nat_y *)GC_MALLOC(sizeof(struct list_nat_y));
+  struct reader *next = (struct reader *)GC_MALLOC_ATOMIC(sizeof(struct reader));
+  if (streamPacked) {
+    memcpy(&y->x, r->p, sizeof(estlc_int));
+    next->p = r->p + sizeof(estlc_int);
+  } else {
+    next->p = p;
+    y->x = (estlc_int)x;
+  }
+  next->left = r->left - 1;
+  y->next = (struct list_nat *)estlc_lazy(readNext, next);
+  return ESTLC_MKTAG(y, 1);
+}
+
+static void *stream(const struct input *in) {
+  struct reader *r = (struct reader *)GC_MALLOC_ATOMIC(sizeof(struct reader));
+  r->p = getCount(in, &streamPacked, &r->left);
+  streamEnd = in->data + in->len;
+  return estlc_lazy(readNext, r);
+}
+
+/* the output is formatted into a buffer written whenever it is full;
+   the result of a streamed program is made as it is forced here, and
+   what was written can be collected */
+#define OUTPUT (1 << 16)
+
+static size_t dumpText(struct list_nat *l, FILE *f) {
+  static char buf[OUTPUT];
+  size_t len = 0, written = 0;
+  for (; ESTLC_TAG(l = estlc_force(l)) != 0; l = ((struct list_nat_y *)ESTLC_UNTAG(l))->next) {
+    if (OUTPUT - len < 16) {
+      fwrite(buf, 1, len, f);
+      written += len;
+      len = 0;
+    }
+    char digits[12];
+    int k = 0;
+    estlc_int x = ((struct list_nat_y *)ESTLC_UNTAG(l))->x;
+    do
+      digits[k++] = '0' + x % 10;
+    while ((x /= 10) != 0);
+    while (k > 0)
+      buf[len++] = digits[--k];
+    buf[len++] = '\n';
+  }
+  buf[len++] = '\n';
+  fwrite(buf, 1, len, f);
+  return written + len;
+}
+
+/* the count is only known at the end, the header is written again
+   then */
+static size_t dumpPacked(struct list_nat *l, FILE *f) {
+  static estlc_int xs[OUTPUT / sizeof(estlc_int)];
+  size_t len = 0;
+  struct list_header header = { ESTLC_LIST_MAGIC, 0, 0 };
+  fwrite(&header, sizeof(header), 1, f);
+  for (; ESTLC_TAG(l = estlc_force(l)) != 0; l = ((struct list_nat_y *)ESTLC_UNTAG(l))->next) {
+    if (len == OUTPUT / sizeof(estlc_int)) {
+      fwrite(xs, sizeof(estlc_int), len, f);
+      len = 0;
+    }
+    xs[len++] = ((struct list_nat_y *)ESTLC_UNTAG(l))->x;
+    ++header.n;
+  }
+  fwrite(xs, sizeof(estlc_int), len, f);
+  if (fseek(f, 0, SEEK_SET) == 0)
+    fwrite(&header, sizeof(header), 1, f);
+  return sizeof(header) + header.n * sizeof(estlc_int);
+}
+
+/* the input, until umain takes it: a global rather than a local of
+   main, so that once taken nothing here points to the head of a
+   streamed list */
+static void *volatile input;
+
+static void *take(void) {
+  void *arg = input;
+  input = NULL;
+  return arg;
+}
+
+int main(int argc, char **argv) {
+  int timing = 0, streaming = 0;
+  const char *output = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "tso:")) != -1) {
+    if (opt == 't')
+      timing = 1;
+    else if (opt == 's')
+      streaming = 1;
+    else if (opt == 'o')
+      output = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-t] [-s] [-o file] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  estlc_init();
+  /* one worker unless asked, 0 is one per core */
+  const char *workers = getenv("ESTLC_WORKERS");
+  estlc_par_init(workers == NULL ? 1 : (unsigned)atoi(workers));
+
+  double t0 = now();
+  int fd = optind < argc ? open(argv[optind], O_RDONLY) : 0;
+  struct input in;
+  if (fd < 0 || readInput(fd, &in) != 0) {
+    perror(optind < argc ? argv[optind] : "stdin");
+    return 1;
+  }
+  FILE *f = output == NULL ? stdout : fopen(output, "wb");
+  if (f == NULL) {
+    perror(output);
+    return 1;
+  }
+  //a streamed input is read while computing, and has to stay around
+  void *list = NULL;
+  if (streaming)
+    input = stream(&in);
+  else if (load(&in, &list) != 0) {
+    perror(optind < argc ? argv[optind] : "stdin");
+    return 1;
+  } else
+    input = list;
+  if (!streaming) {
+    if (in.mapped)
+      munmap((void *)in.data, in.len);
+    else
+      free((void *)in.data);
+  }
+
+  /* a streamed program is run as its result is written, from input to
+     output in one pass */
+  double t1 = now();
+  struct list_nat *l = streaming ? NULL : (struct list_nat *)umain(take());
+  double t2 = now();
+  size_t written;
+  if (streaming)
+    written = output == NULL ? dumpText(umain(take()), f) : dumpPacked(umain(take()), f);
+  else
+    written = output == NULL ? dumpText(l, f) : dumpPacked(l, f);
+  if (f != stdout)
+    fclose(f);
+  else
+    fflush(f);
 
-int main() {
-
-  void *arg;
-  unsigned n;
-  scanf("%u", &n);
-  struct list_nat **cur = (struct list_nat **)&arg;
-  for (unsigned i = 0; i < n; ++i) {
-    unsigned x;
-    scanf("%u", &x);
-    
-    struct list_nat_y *y = (struct list_nat_y *)malloc(sizeof(struct list_nat_y));
-    y->x = (unsigned *)malloc(sizeof(unsigned));
-    *y->x = x;
-    y->next = NULL;
-    
-    *cur = (struct list_nat *)malloc(sizeof(struct list_nat));
-    (*cur)->idx = 1;
-    (*cur)->y = y;
-    cur = &y->next;
-  }
-  *cur = (struct list_nat *)malloc(sizeof(struct list_nat));
-  (*cur)->idx = 0;
-  (*cur)->y = NULL;
-  
-  struct list_nat *l = (struct list_nat *)umain(arg);
-  while (l->idx != 0) {
-    struct list_nat_y *y = (struct list_nat_y *)l->y;
-    printf("%p %u\n", y->x, *(y->x));
-    l = y->next;
-  }
-  printf("\n");
+  double t3 = now();
+  if (timing && streaming)
+    fprintf(stderr, "input, compute and output %.3f s, %.1f MB/s in, %.1f MB/s out\n",
+            t3 - t0, in.len / (t3 - t0) / 1e6, written / (t3 - t0) / 1e6);
+  else if (timing)
+    fprintf(stderr, "input %.3f s, %.1f MB/s\ncompute %.3f s\noutput %.3f s, %.1f MB/s\n",
+            t1 - t0, in.len / (t1 - t0) / 1e6, t2 - t1, t3 - t2, written / (t3 - t2) / 1e6);
+  if (timing)
+    estlc_memo_report(stderr);
+  if (streaming && in.mapped)
+    munmap((void *)in.data, in.len);
+  else if (streaming)
+    free((void *)in.data);
+  estlc_par_exit();
   return 0;
 }
@@ -0,0 +1,216 @@
+#define GC_THREADS
+#include <gc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <memo.h>
+
+/* buckets of a new part, doubled whenever there are more entries */
+#define BUCKETS 64
+
+/* an entry is in the chain of its bucket and in the order of use,
+   newest first */
+struct entry {
+  struct entry *chain;
+  struct entry *newer, *older;
+  uint64_t hash;
+  void *value;
+  void *args[];
+};
+
+/* the entries of one thread, or of all with a shared table */
+struct part {
+  struct entry **buckets;
+  size_t nbuckets, count;
+  struct entry *newest, *oldest;
+  uint64_t hits, misses;
+  struct part *next;
+};
+
+struct table {
+  const char *name;
+  unsigned arity;
+  estlc_memo_equal equal;
+  uint64_t size;
+  int shared;
+  /* guards the part of a shared table, the list of parts otherwise */
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  struct part *parts;
+  struct table *next;
+};
+
+static struct table *tables;
+static pthread_mutex_t tablesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct part *newPart(void) {
+  struct part *p = GC_MALLOC(sizeof(struct part));
+  p->nbuckets = BUCKETS;
+  p->buckets = GC_MALLOC(BUCKETS * sizeof(struct entry *));
+  return p;
+}
+
+void *estlc_memo_table(void **slot, const char *name, unsigned arity, estlc_memo_equal equal,
+                       uint64_t size, int shared) {
+  struct table *t = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (t != NULL)
+    return t;
+  pthread_mutex_lock(&tablesLock);
+  if ((t = *slot) == NULL) {
+    t = GC_MALLOC(sizeof(struct table));
+    t->name = name;
+    t->arity = arity;
+    t->equal = equal;
+    t->size = size;
+    t->shared = shared;
+    pthread_mutex_init(&t->lock, NULL);
+    if (shared)
+      t->parts = newPart();
+    else
+      pthread_key_create(&t->key, NULL);
+    //the list keeps the tables and their parts alive for the collector
+    t->next = tables;
+    tables = t;
+    __atomic_store_n(slot, t, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&tablesLock);
+  return t;
+}
+
+static struct part *getPart(struct table *t) {
+  if (t->shared)
+    return t->parts;
+  struct part *p = pthread_getspecific(t->key);
+  if (p == NULL) {
+    p = newPart();
+    pthread_mutex_lock(&t->lock);
+    p->next = t->parts;
+    t->parts = p;
+    pthread_mutex_unlock(&t->lock);
+    pthread_setspecific(t->key, p);
+  }
+  return p;
+}
+
+static size_t bucket(const struct part *p, uint64_t hash) {
+  //the generated hash is a plain combination, mix it first
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash & (p->nbuckets - 1);
+}
+
+static struct entry *find(const struct table *t, const struct part *p, uint64_t hash, void *const *args) {
+  for (struct entry *e = p->buckets[bucket(p, hash)]; e != NULL; e = e->chain)
+    if (e->hash == hash && t->equal(e->args, args))
+      return e;
+  return NULL;
+}
+
+static void unlinkUse(struct part *p, struct entry *e) {
+  if (e->newer != NULL)
+    e->newer->older = e->older;
+  else
+    p->newest = e->older;
+  if (e->older != NULL)
+    e->older->newer = e->newer;
+  else
+    p->oldest = e->newer;
+}
+
+static void linkUse(struct part *p, struct entry *e) {
+  e->newer = NULL;
+  e->older = p->newest;
+  if (p->newest != NULL)
+    p->newest->newer = e;
+  else
+    p->oldest = e;
+  p->newest = e;
+}
+
+static void evict(struct part *p) {
+  struct entry *e = p->oldest;
+  unlinkUse(p, e);
+  struct entry **link = &p->buckets[bucket(p, e->hash)];
+  while (*link != e)
+    link = &(*link)->chain;
+  *link = e->chain;
+  --p->count;
+}
+
+static void grow(struct part *p) {
+  struct entry **old = p->buckets;
+  size_t n = p->nbuckets;
+  p->nbuckets = 2 * n;
+  p->buckets = GC_MALLOC(p->nbuckets * sizeof(struct entry *));
+  for (size_t i = 0; i < n; ++i)
+    for (struct entry *e = old[i], *next; e != NULL; e = next) {
+      next = e->chain;
+      size_t b = bucket(p, e->hash);
+      e->chain = p->buckets[b];
+      p->buckets[b] = e;
+    }
+}
+
+int estlc_memo_get(void *table, uint64_t hash, void *const *args, void **value) {
+  struct table *t = table;
+  if (t->shared)
+    pthread_mutex_lock(&t->lock);
+  struct part *p = getPart(t);
+  struct entry *e = find(t, p, hash, args);
+  if (e != NULL) {
+    ++p->hits;
+    *value = e->value;
+    //only a bounded table cares which was used last
+    if (t->size != 0) {
+      unlinkUse(p, e);
+      linkUse(p, e);
+    }
+  } else
+    ++p->misses;
+  if (t->shared)
+    pthread_mutex_unlock(&t->lock);
+  return e != NULL;
+}
+
+void estlc_memo_put(void *table, uint64_t hash, void *const *args, void *value) {
+  struct table *t = table;
+  if (t->shared)
+    pthread_mutex_lock(&t->lock);
+  struct part *p = getPart(t);
+  //another thread may have made it meanwhile, it is the same value
+  struct entry *e = find(t, p, hash, args);
+  if (e == NULL) {
+    e = GC_MALLOC(sizeof(struct entry) + t->arity * sizeof(void *));
+    e->hash = hash;
+    memcpy(e->args, args, t->arity * sizeof(void *));
+    size_t b = bucket(p, hash);
+    e->chain = p->buckets[b];
+    p->buckets[b] = e;
+    linkUse(p, e);
+    if (++p->count > t->size && t->size != 0)
+      evict(p);
+    if (p->count > p->nbuckets)
+      grow(p);
+  }
+  e->value = value;
+  if (t->shared)
+    pthread_mutex_unlock(&t->lock);
+}
+
+void estlc_memo_report(FILE *f) {
+  pthread_mutex_lock(&tablesLock);
+  for (struct table *t = tables; t != NULL; t = t->next) {
+    uint64_t hits = 0, misses = 0;
+    pthread_mutex_lock(&t->lock);
+    for (struct part *p = t->parts; p != NULL; p = p->next) {
+      hits += p->hits;
+      misses += p->misses;
+    }
+    pthread_mutex_unlock(&t->lock);
+    fprintf(f, "memo %s: %llu hits, %llu misses\n", t->name, (unsigned long long)hits,
+            (unsigned long long)misses);
+  }
+  pthread_mutex_unlock(&tablesLock);
+}
@@ -0,0 +1,210 @@
+#define GC_THREADS
+#include <gc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <par.h>
+
+/* a worker with this many tasks queued runs what it spawns at once, the
+   queue is deep enough to keep the others busy; so does one with any
+   task queued while no worker is idle, the task would only wait */
+#define MAX_QUEUED 64
+#define MAX_WORKERS 256
+/* stack of a worker when the main thread has no limit */
+#define WORKER_STACK ((size_t)256 << 20)
+
+/* a closure is its frame, the code pointer first; see Codegen */
+typedef void *(*estlc_code)(void *frame, void *arg);
+
+struct task {
+  void *clo;
+  void *value;
+  atomic_int done;
+};
+
+/* the owner pushes and pops at the bottom, thieves take the top, the
+   oldest and so likely the largest task */
+struct deque {
+  pthread_mutex_t lock;
+  struct task **tasks;
+  size_t top, bottom, size;
+};
+
+static struct deque deques[MAX_WORKERS];
+static pthread_t threads[MAX_WORKERS];
+static unsigned nworkers = 1;
+static atomic_int stopping;
+static _Thread_local unsigned self;
+static _Thread_local unsigned seed;
+
+/* a worker finding nothing to run sleeps until a task is queued:
+   queued counts the tasks ever queued, idle the workers looking for
+   one or asleep, asleep those only */
+static pthread_mutex_t parkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parked = PTHREAD_COND_INITIALIZER;
+static atomic_ulong queued;
+static atomic_int idle, asleep;
+
+static void run(struct task *task) {
+  estlc_code code = *(estlc_code *)task->clo;
+  task->value = code(task->clo, NULL);
+  atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+static int push(struct deque *d, struct task *task) {
+  pthread_mutex_lock(&d->lock);
+  size_t n = d->bottom - d->top;
+  if (n >= MAX_QUEUED || (n > 0 && atomic_load(&idle) == 0)) {
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+  }
+  if (d->bottom == d->size) {
+    //the stolen slots at the front are reused before growing
+    size_t n = d->bottom - d->top;
+    if (d->top > 0)
+      memmove(d->tasks, d->tasks + d->top, n * sizeof(struct task *));
+    else {
+      struct task **tasks = GC_MALLOC_UNCOLLECTABLE(2 * d->size * sizeof(struct task *));
+      memcpy(tasks, d->tasks, n * sizeof(struct task *));
+      GC_FREE(d->tasks);
+      d->tasks = tasks;
+      d->size *= 2;
+    }
+    d->top = 0;
+    d->bottom = n;
+  }
+  d->tasks[d->bottom++] = task;
+  pthread_mutex_unlock(&d->lock);
+  //a worker still looking will find it, wake one only if none is
+  atomic_fetch_add(&queued, 1);
+  int sleeping = atomic_load(&asleep);
+  if (sleeping > 0 && atomic_load(&idle) == sleeping) {
+    pthread_mutex_lock(&parkLock);
+    pthread_cond_signal(&parked);
+    pthread_mutex_unlock(&parkLock);
+  }
+  return 1;
+}
+
+static struct task *pop(struct deque *d) {
+  struct task *task = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top)
+    task = d->tasks[--d->bottom];
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static struct task *steal(void) {
+  //a victim picked at random, then the rest in turn
+  seed = seed * 1103515245 + 12345;
+  unsigned first = (seed >> 16) % nworkers;
+  for (unsigned i = 0; i < nworkers; ++i) {
+    struct deque *d = &deques[(first + i) % nworkers];
+    if (d == &deques[self])
+      continue;
+    struct task *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+      task = d->tasks[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    if (task != NULL)
+      return task;
+  }
+  return NULL;
+}
+
+static void *worker(void *arg) {
+  self = (unsigned)(size_t)arg;
+  seed = self;
+  atomic_fetch_add(&idle, 1);
+  while (!atomic_load(&stopping)) {
+    //a task queued after this is seen, or wakes us
+    unsigned long seen = atomic_load(&queued);
+    struct task *task = pop(&deques[self]);
+    if (task == NULL)
+      task = steal();
+    if (task != NULL) {
+      atomic_fetch_sub(&idle, 1);
+      run(task);
+      atomic_fetch_add(&idle, 1);
+      continue;
+    }
+    pthread_mutex_lock(&parkLock);
+    atomic_fetch_add(&asleep, 1);
+    while (atomic_load(&queued) == seen && !atomic_load(&stopping))
+      pthread_cond_wait(&parked, &parkLock);
+    atomic_fetch_sub(&asleep, 1);
+    pthread_mutex_unlock(&parkLock);
+  }
+  atomic_fetch_sub(&idle, 1);
+  return NULL;
+}
+
+void estlc_par_init(unsigned workers) {
+  if (workers == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = n > 0 ? (unsigned)n : 1;
+  }
+  nworkers = workers < MAX_WORKERS ? workers : MAX_WORKERS;
+  for (unsigned i = 0; i < nworkers; ++i) {
+    pthread_mutex_init(&deques[i].lock, NULL);
+    deques[i].size = MAX_QUEUED;
+    deques[i].tasks = GC_MALLOC_UNCOLLECTABLE(deques[i].size * sizeof(struct task *));
+    deques[i].top = deques[i].bottom = 0;
+  }
+  self = 0;
+  seed = 0;
+  atomic_store(&stopping, 0);
+  //a stolen task may recurse as deep as on the main thread
+  struct rlimit limit;
+  size_t stack = WORKER_STACK;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    stack = limit.rlim_cur;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack);
+  for (unsigned i = 1; i < nworkers; ++i)
+    pthread_create(&threads[i], &attr, worker, (void *)(size_t)i);
+  pthread_attr_destroy(&attr);
+}
+
+void estlc_par_exit(void) {
+  pthread_mutex_lock(&parkLock);
+  atomic_store(&stopping, 1);
+  pthread_cond_broadcast(&parked);
+  pthread_mutex_unlock(&parkLock);
+  for (unsigned i = 1; i < nworkers; ++i)
+    pthread_join(threads[i], NULL);
+  nworkers = 1;
+}
+
+void *estlc_spawn(void *clo) {
+  struct task *task = GC_MALLOC(sizeof(struct task));
+  task->clo = clo;
+  atomic_init(&task->done, 0);
+  if (nworkers == 1 || !push(&deques[self], task))
+    run(task);
+  return task;
+}
+
+void *estlc_join(void *p) {
+  //tasks left in our deque are ours to run, spawned after this one;
+  //once it is empty this one was stolen and we help others meanwhile
+  struct task *task = p;
+  while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+    struct task *next = pop(&deques[self]);
+    if (next == NULL)
+      next = steal();
+    if (next != NULL)
+      run(next);
+    else
+      sched_yield();
+  }
+  return task->value;
+}
@@ -0,0 +1,19 @@
+#define GC_THREADS
+#include <gc.h>
+
+#include <run.h>
+
+void estlc_init(void) {
+  GC_INIT();
+  GC_allow_register_threads();
+}
+
+void estlc_thread_enter(void) {
+  struct GC_stack_base base;
+  GC_get_stack_base(&base);
+  GC_register_my_thread(&base);
+}
+
+void estlc_thread_leave(void) {
+  GC_unregister_my_thread();
+}
@@ -0,0 +1,447 @@
+#define GC_THREADS
+#include <gc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vec.h>
+
+#include "kernels.h"
+
+#define W ESTLC_VEC_WIDTH
+#define BITS ESTLC_VEC_BITS
+/* nodes a level may have more than the fewest its slots fit in, after
+   a concatenation; fewer means more copying, more a taller tree */
+#define EXTRAS 2
+
+struct leaf {
+  unsigned n;
+  estlc_int xs[W];
+};
+
+/* every node counts what its kids hold: sizes[k] is the elements of
+   kids 0 to k. A kid of a node of height shift holds at most
+   1 << shift elements, whether the tree is balanced or not */
+struct node {
+  unsigned n;
+  estlc_int sizes[W];
+  void *kids[W];
+};
+
+static void outOfRange(const char *op, estlc_int i, estlc_int len) {
+  fprintf(stderr, "%s: index %u out of range, length %u\n", op, (unsigned)i, (unsigned)len);
+  exit(1);
+}
+
+static struct estlc_vec *newVec(estlc_int len, unsigned shift, void *root) {
+  struct estlc_vec *v = GC_MALLOC(sizeof(struct estlc_vec));
+  v->len = len;
+  v->shift = shift;
+  v->root = root;
+  return v;
+}
+
+static struct leaf *newLeaf(unsigned n) {
+  struct leaf *l = GC_MALLOC_ATOMIC(sizeof(struct leaf));
+  l->n = n;
+  return l;
+}
+
+static struct node *newNode(unsigned n) {
+  struct node *node = GC_MALLOC(sizeof(struct node));
+  node->n = n;
+  return node;
+}
+
+/* elements under t, of height shift */
+static estlc_int count(const void *t, unsigned shift) {
+  if (shift == 0)
+    return ((const struct leaf *)t)->n;
+  const struct node *node = t;
+  return node->sizes[node->n - 1];
+}
+
+/* kids of a node, elements of a leaf */
+static unsigned slots(const void *t, unsigned shift) {
+  return shift == 0 ? ((const struct leaf *)t)->n : ((const struct node *)t)->n;
+}
+
+static void fixSizes(struct node *node, unsigned shift) {
+  estlc_int sum = 0;
+  for (unsigned k = 0; k < node->n; ++k)
+    node->sizes[k] = sum += count(node->kids[k], shift - BITS);
+}
+
+static struct node *nodeOf(void *const *kids, unsigned n, unsigned shift) {
+  struct node *node = newNode(n);
+  memcpy(node->kids, kids, n * sizeof(void *));
+  fixSizes(node, shift);
+  return node;
+}
+
+/* the kid holding element i, i made relative to it; as no kid holds
+   more than 1 << shift, it is never left of the radix guess */
+static unsigned findKid(const struct node *node, unsigned shift, estlc_int *i) {
+  unsigned k = shift < 32 ? *i >> shift : 0;
+  while (node->sizes[k] <= *i)
+    ++k;
+  if (k > 0)
+    *i -= node->sizes[k - 1];
+  return k;
+}
+
+estlc_int estlc_vlen(struct estlc_vec *v) {
+  return v == NULL ? 0 : v->len;
+}
+
+estlc_int estlc_vget(struct estlc_vec *v, estlc_int i) {
+  if (i >= estlc_vlen(v))
+    outOfRange("vget", i, estlc_vlen(v));
+  void *t = v->root;
+  for (unsigned shift = v->shift; shift > 0; shift -= BITS) {
+    const struct node *node = t;
+    t = node->kids[findKid(node, shift, &i)];
+  }
+  return ((const struct leaf *)t)->xs[i];
+}
+
+static void *set(const void *t, unsigned shift, estlc_int i, estlc_int x) {
+  if (shift == 0) {
+    struct leaf *l = newLeaf(0);
+    memcpy(l, t, sizeof(struct leaf));
+    l->xs[i] = x;
+    return l;
+  }
+  struct node *node = newNode(0);
+  memcpy(node, t, sizeof(struct node));
+  unsigned k = findKid(node, shift, &i);
+  node->kids[k] = set(node->kids[k], shift - BITS, i, x);
+  return node;
+}
+
+struct estlc_vec *estlc_vset(struct estlc_vec *v, estlc_int i, estlc_int x) {
+  if (i >= estlc_vlen(v))
+    outOfRange("vset", i, estlc_vlen(v));
+  return newVec(v->len, v->shift, set(v->root, v->shift, i, x));
+}
+
+/* a path of height shift down to a leaf of x alone */
+static void *single(unsigned shift, estlc_int x) {
+  struct leaf *l = newLeaf(1);
+  l->xs[0] = x;
+  void *t = l;
+  for (unsigned s = BITS; s <= shift; s += BITS)
+    t = nodeOf(&t, 1, s);
+  return t;
+}
+
+/* t with x after its last element, NULL if its right edge is full */
+static void *push(const void *t, unsigned shift, estlc_int x) {
+  if (shift == 0) {
+    const struct leaf *l = t;
+    if (l->n == W)
+      return NULL;
+    struct leaf *l0 = newLeaf(0);
+    memcpy(l0, l, sizeof(struct leaf));
+    l0->xs[l0->n++] = x;
+    return l0;
+  }
+  const struct node *node = t;
+  void *kid = push(node->kids[node->n - 1], shift - BITS, x);
+  if (kid == NULL && node->n == W)
+    return NULL;
+  struct node *node0 = newNode(0);
+  memcpy(node0, node, sizeof(struct node));
+  if (kid != NULL)
+    node0->kids[node0->n - 1] = kid;
+  else {
+    node0->kids[node0->n] = single(shift - BITS, x);
+    node0->sizes[node0->n] = node0->sizes[node0->n - 1];
+    ++node0->n;
+  }
+  ++node0->sizes[node0->n - 1];
+  return node0;
+}
+
+struct estlc_vec *estlc_vpush(struct estlc_vec *v, estlc_int x) {
+  if (estlc_vlen(v) == 0)
+    return newVec(1, 0, single(0, x));
+  void *root = push(v->root, v->shift, x);
+  if (root != NULL)
+    return newVec(v->len + 1, v->shift, root);
+  //the tree is full, it grows a level
+  void *kids[2] = { v->root, single(v->shift, x) };
+  return newVec(v->len + 1, v->shift + BITS, nodeOf(kids, 2, v->shift + BITS));
+}
+
+/* the first k elements of t, 0 < k */
+static void *take(const void *t, unsigned shift, estlc_int k) {
+  if (k == count(t, shift))
+    return (void *)t;
+  if (shift == 0) {
+    struct leaf *l = newLeaf(k);
+    memcpy(l->xs, ((const struct leaf *)t)->xs, k * sizeof(estlc_int));
+    return l;
+  }
+  const struct node *node = t;
+  estlc_int i = k - 1;
+  unsigned j = findKid(node, shift, &i);
+  struct node *node0 = newNode(j + 1);
+  memcpy(node0->kids, node->kids, j * sizeof(void *));
+  memcpy(node0->sizes, node->sizes, j * sizeof(estlc_int));
+  node0->kids[j] = take(node->kids[j], shift - BITS, i + 1);
+  node0->sizes[j] = k;
+  return node0;
+}
+
+/* all but the first k elements of t, k below its count */
+static void *drop(const void *t, unsigned shift, estlc_int k) {
+  if (k == 0)
+    return (void *)t;
+  if (shift == 0) {
+    const struct leaf *l = t;
+    struct leaf *l0 = newLeaf(l->n - k);
+    memcpy(l0->xs, l->xs + k, l0->n * sizeof(estlc_int));
+    return l0;
+  }
+  const struct node *node = t;
+  estlc_int i = k;
+  unsigned j = findKid(node, shift, &i);
+  struct node *node0 = newNode(node->n - j);
+  node0->kids[0] = drop(node->kids[j], shift - BITS, i);
+  for (unsigned m = 1; m < node0->n; ++m)
+    node0->kids[m] = node->kids[j + m];
+  for (unsigned m = 0; m < node0->n; ++m)
+    node0->sizes[m] = node->sizes[j + m] - k;
+  return node0;
+}
+
+/* the tree without the roots of one kid on top */
+static struct estlc_vec *shrink(estlc_int len, unsigned shift, void *root) {
+  while (shift > 0 && ((const struct node *)root)->n == 1) {
+    root = ((const struct node *)root)->kids[0];
+    shift -= BITS;
+  }
+  return newVec(len, shift, root);
+}
+
+struct estlc_vec *estlc_vslice(struct estlc_vec *v, estlc_int i, estlc_int j) {
+  if (j > estlc_vlen(v))
+    outOfRange("vslice", j, estlc_vlen(v));
+  if (i > j)
+    outOfRange("vslice", i, j);
+  if (i == j)
+    return NULL;
+  return shrink(j - i, v->shift, drop(take(v->root, v->shift, j), v->shift, i));
+}
+
+/*
+  Concatenation merges the right edge of the one tree with the left
+  edge of the other, level by level from the leaves up. At each level
+  the kids met there are redistributed, so that there are at most
+  EXTRAS more of them than needed: this keeps the tree about as low as
+  a balanced one, and most of both trees is shared as it is.
+*/
+
+/* left, centre and right of height shift, centre made from the edges
+   below; left or right may be NULL. A node one higher comes out */
+static struct node *rebalance(const struct node *left, const struct node *centre, const struct node *right,
+                              unsigned shift) {
+  void *all[2 * W];
+  unsigned n = 0;
+  if (left != NULL)
+    for (unsigned k = 0; k + 1 < left->n; ++k)
+      all[n++] = left->kids[k];
+  for (unsigned k = 0; k < centre->n; ++k)
+    all[n++] = centre->kids[k];
+  if (right != NULL)
+    for (unsigned k = 1; k < right->n; ++k)
+      all[n++] = right->kids[k];
+
+  //how many slots each new kid gets: a kid short of full is spread over
+  //those after it, until few enough are left
+  unsigned plan[2 * W + 1], total = 0;
+  for (unsigned k = 0; k < n; ++k)
+    total += plan[k] = slots(all[k], shift - BITS);
+  plan[n] = 0;
+  unsigned m = n;
+  for (unsigned k = 0; m > (total + W - 1) / W + EXTRAS; --k) {
+    while (plan[k] >= W - EXTRAS / 2)
+      ++k;
+    unsigned rest = plan[k];
+    do {
+      unsigned size = rest + plan[k + 1] < W ? rest + plan[k + 1] : W;
+      rest = rest + plan[k + 1] - size;
+      plan[k++] = size;
+    } while (rest > 0);
+    for (unsigned j = k; j < m; ++j)
+      plan[j] = plan[j + 1];
+    --m;
+  }
+
+  //the kids as planned, the old one where it fits as it is
+  void *kids[2 * W];
+  unsigned src = 0, off = 0, child = shift - BITS;
+  for (unsigned k = 0; k < m; ++k) {
+    if (off == 0 && slots(all[src], child) == plan[k]) {
+      kids[k] = all[src++];
+      continue;
+    }
+    struct leaf *l = child == 0 ? newLeaf(0) : NULL;
+    struct node *node = child == 0 ? NULL : newNode(0);
+    unsigned *filled = child == 0 ? &l->n : &node->n;
+    while (*filled < plan[k]) {
+      unsigned have = slots(all[src], child) - off;
+      unsigned moved = have < plan[k] - *filled ? have : plan[k] - *filled;
+      if (child == 0)
+        memcpy(l->xs + *filled, ((const struct leaf *)all[src])->xs + off, moved * sizeof(estlc_int));
+      else
+        memcpy(node->kids + *filled, ((const struct node *)all[src])->kids + off, moved * sizeof(void *));
+      *filled += moved;
+      if ((off += moved) == slots(all[src], child)) {
+        ++src;
+        off = 0;
+      }
+    }
+    if (child != 0)
+      fixSizes(node, child);
+    kids[k] = child == 0 ? (void *)l : (void *)node;
+  }
+
+  if (m <= W) {
+    void *top = nodeOf(kids, m, shift);
+    return nodeOf(&top, 1, shift + BITS);
+  }
+  void *tops[2] = { nodeOf(kids, W, shift), nodeOf(kids + W, m - W, shift) };
+  return nodeOf(tops, 2, shift + BITS);
+}
+
+/* a of height sa after b of height sb, as a node one higher than the
+   higher of them */
+static struct node *concat(const void *a, unsigned sa, const void *b, unsigned sb) {
+  if (sa > sb) {
+    const struct node *left = a;
+    return rebalance(left, concat(left->kids[left->n - 1], sa - BITS, b, sb), NULL, sa);
+  }
+  if (sa < sb) {
+    const struct node *right = b;
+    return rebalance(NULL, concat(a, sa, right->kids[0], sb - BITS), right, sb);
+  }
+  if (sa == 0) {
+    const struct leaf *left = a, *right = b;
+    if (left->n + right->n > W) {
+      void *kids[2] = { (void *)a, (void *)b };
+      return nodeOf(kids, 2, BITS);
+    }
+    struct leaf *l = newLeaf(left->n + right->n);
+    memcpy(l->xs, left->xs, left->n * sizeof(estlc_int));
+    memcpy(l->xs + left->n, right->xs, right->n * sizeof(estlc_int));
+    void *kid = l;
+    return nodeOf(&kid, 1, BITS);
+  }
+  const struct node *left = a, *right = b;
+  struct node *centre = concat(left->kids[left->n - 1], sa - BITS, right->kids[0], sb - BITS);
+  return rebalance(left, centre, right, sa);
+}
+
+struct estlc_vec *estlc_vconcat(struct estlc_vec *a, struct estlc_vec *b) {
+  if (estlc_vlen(a) == 0)
+    return b;
+  if (estlc_vlen(b) == 0)
+    return a;
+  unsigned shift = (a->shift > b->shift ? a->shift : b->shift) + BITS;
+  return shrink(a->len + b->len, shift, concat(a->root, a->shift, b->root, b->shift));
+}
+
+/*
+  The bulk operations copy the elements out in a row, run a kernel on
+  them, and build a balanced tree of the result.
+*/
+
+/* a closure is its frame, the code pointer first; see Codegen */
+typedef void *(*estlc_code)(void *frame, void *arg);
+
+static void flatten(const void *t, unsigned shift, estlc_int *out) {
+  if (shift == 0) {
+    const struct leaf *l = t;
+    memcpy(out, l->xs, l->n * sizeof(estlc_int));
+    return;
+  }
+  const struct node *node = t;
+  for (unsigned k = 0; k < node->n; ++k)
+    flatten(node->kids[k], shift - BITS, out + (k == 0 ? 0 : node->sizes[k - 1]));
+}
+
+static estlc_int *toArray(struct estlc_vec *v) {
+  estlc_int *xs = malloc((estlc_vlen(v) + 1) * sizeof(estlc_int));
+  if (xs == NULL) {
+    fprintf(stderr, "vector of length %u: out of memory\n", (unsigned)estlc_vlen(v));
+    exit(1);
+  }
+  if (estlc_vlen(v) > 0)
+    flatten(v->root, v->shift, xs);
+  return xs;
+}
+
+/* takes xs over */
+static struct estlc_vec *fromArray(estlc_int *xs, size_t n) {
+  if (n == 0) {
+    free(xs);
+    return NULL;
+  }
+  //a level of the tree at a time, each node full but the last; the
+  //collector has to see the level while the next one is made
+  size_t m = (n + W - 1) / W;
+  void **level = GC_MALLOC(m * sizeof(void *));
+  for (size_t i = 0; i < m; ++i) {
+    struct leaf *l = newLeaf(n - i * W < W ? n - i * W : W);
+    memcpy(l->xs, xs + i * W, l->n * sizeof(estlc_int));
+    level[i] = l;
+  }
+  free(xs);
+  unsigned shift = 0;
+  while (m > 1) {
+    shift += BITS;
+    size_t m0 = (m + W - 1) / W;
+    for (size_t j = 0; j < m0; ++j)
+      level[j] = nodeOf(level + j * W, m - j * W < W ? m - j * W : W, shift);
+    m = m0;
+  }
+  return newVec(n, shift, level[0]);
+}
+
+struct estlc_vec *estlc_vfilter(void *clo, struct estlc_vec *v) {
+  estlc_int *xs = toArray(v);
+  estlc_code code = *(estlc_code *)clo;
+  size_t k = 0;
+  //bool is a tagged sum, true its second constructor
+  for (size_t i = 0; i < estlc_vlen(v); ++i)
+    if (ESTLC_TAG(code(clo, ESTLC_REF(xs[i]))) == 1)
+      xs[k++] = xs[i];
+  return fromArray(xs, k);
+}
+
+struct estlc_vec *estlc_vmap(void *clo, struct estlc_vec *v) {
+  estlc_int *xs = toArray(v);
+  estlc_code code = *(estlc_code *)clo;
+  for (size_t i = 0; i < estlc_vlen(v); ++i)
+    xs[i] = ESTLC_INT(code(clo, ESTLC_REF(xs[i])));
+  return fromArray(xs, estlc_vlen(v));
+}
+
+struct estlc_vec *estlc_vsort(struct estlc_vec *v) {
+  estlc_int *xs = toArray(v);
+  estlc_ksort(xs, estlc_vlen(v));
+  return fromArray(xs, estlc_vlen(v));
+}
+
+struct estlc_vec *estlc_vfilter_op(unsigned op, estlc_int x, struct estlc_vec *v) {
+  estlc_int *xs = toArray(v);
+  return fromArray(xs, estlc_kfilter(xs, estlc_vlen(v), op, x, xs));
+}
+
+struct estlc_vec *estlc_vmap_op(unsigned op, estlc_int x, struct estlc_vec *v) {
+  estlc_int *xs = toArray(v);
+  estlc_kmap(xs, estlc_vlen(v), op, x);
+  return fromArray(xs, estlc_vlen(v));
+}
@@ -106,10 +106,18 @@ namespace ast{
     Fixpoint(const Term *term);
   };
 
+  /* a function written in C: its type, and the symbol to call */
+  struct Extern {
+    const Type *type;
+    std::string symbol;
+  };
+
   struct Program {
     const std::map<const std::string, const Type *> types;
     const Term *term;
-    Program(const std::map<const std::string, const Type *> types, const Term *term);
+    const std::map<const std::string, Extern> externs;
+    Program(const std::map<const std::string, const Type *> types, const Term *term,
+            const std::map<const std::string, Extern> externs = std::map<const std::string, Extern>());
   };
 }
 
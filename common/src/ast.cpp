@@ -165,6 +165,7 @@ Fixpoint::Fixpoint(const Term *term)
   :term(term)
 {}
    
-Program::Program(const std::map<const std::string, const Type *> types, const Term *term)
-  :types(types), term(term)
+Program::Program(const std::map<const std::string, const Type *> types, const Term *term,
+                 const std::map<const std::string, Extern> externs)
+  :types(types), term(term), externs(externs)
 {}
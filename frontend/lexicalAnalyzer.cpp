@@ -66,6 +66,16 @@ TokenStream LexicalAnalyzer::parse(istream& is){
 			nrow++;
 			ncol = 0;
 			break;
+		case '"':
+			while ((ch = is.get()) != '"'){
+				if (ch == EOF || ch == '\n'){
+					throw lexical_error(nrow, '"');
+				}
+				buffer += ch;
+			}
+			tokenStream.append(Token(Token::STRING, buffer, nrow, ncol));
+			buffer.clear();
+			break;
 		case '\t':
 		case ' ':
 			break;
@@ -94,7 +104,7 @@ TokenStream LexicalAnalyzer::parse(istream& is){
 				tokenStream.append(Token(Token::CMPLE, "<=", nrow, ncol));
 			}
 			else if (ch == '>'){
-				tokenStream.append(Token(Token::CMPNE, ">=", nrow, ncol));
+				tokenStream.append(Token(Token::CMPNE, "<>", nrow, ncol));
 			}
 			else{
 				is.putback(ch);
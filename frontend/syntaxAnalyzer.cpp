@@ -1,8 +1,45 @@
 #include "syntaxAnalyzer.h"
 #include "myException.h"
 #include <iostream>
+#include <algorithm>
+#include <set>
 
 
+// set the position of a new node
+static ast::Term* locate(ast::Term* term, unsigned nrow, unsigned ncol){
+	term->nrow = nrow;
+	term->ncol = ncol;
+	return term;
+}
+
+// copy of a term, sharing its types
+static ast::Term* copyTerm(const ast::Term* term){
+	ast::Term* copy = NULL;
+	if (const ast::Reference* ref = dynamic_cast<const ast::Reference*>(term)){
+		copy = new ast::Reference(ref->name);
+	}
+	else if (const ast::Abstraction* abs = dynamic_cast<const ast::Abstraction*>(term)){
+		copy = new ast::Abstraction(abs->arg, abs->type, copyTerm(abs->term));
+	}
+	else if (const ast::Application* app = dynamic_cast<const ast::Application*>(term)){
+		copy = new ast::Application(copyTerm(app->func), copyTerm(app->arg));
+	}
+	else if (const ast::Desum* des = dynamic_cast<const ast::Desum*>(term)){
+		vector<pair<const string, const ast::Term*>> cases;
+		for (unsigned i = 0; i < des->cases.size(); i++){
+			cases.push_back(pair<const string, const ast::Term*>(des->cases[i].first, copyTerm(des->cases[i].second)));
+		}
+		copy = new ast::Desum(copyTerm(des->sum), cases);
+	}
+	else if (const ast::Deproduct* dep = dynamic_cast<const ast::Deproduct*>(term)){
+		copy = new ast::Deproduct(copyTerm(dep->product), dep->names, copyTerm(dep->term));
+	}
+	else{
+		copy = new ast::Fixpoint(copyTerm(dynamic_cast<const ast::Fixpoint*>(term)->term));
+	}
+	return locate(copy, term->nrow, term->ncol);
+}
+
 // generate random string with length=len
 string rands(const unsigned len) {
 	static const char alphanum[] =
@@ -25,7 +62,14 @@ SyntaxAnalyzer::SyntaxAnalyzer(TokenStream& stream)
 	vector<pair<const ast::Type *, const string>> bools;
 	bools.push_back(pair<const ast::Type *, const string>(getType("unit"), "false"));
 	bools.push_back(pair<const ast::Type *, const string>(getType("unit"), "true"));
-	types["bool"] = new ast::SumType(bools);
+	ast::SumType* boolType = new ast::SumType(bools);
+	types["bool"] = boolType;
+	constructors["false"].push_back(boolType);
+	constructors["true"].push_back(boolType);
+
+	// the persistent vector of Ints is built in as well, its operations
+	// (vget, vpush, ...) are bound by the backend
+	getType("Vec");
 
 	root = buildBlock(stream);
 
@@ -42,7 +86,7 @@ SyntaxAnalyzer::~SyntaxAnalyzer()
 }
 
 ast::Program* SyntaxAnalyzer::getProgram()const{
-	return new ast::Program(types, root);
+	return new ast::Program(types, root, externs);
 }
 
 const ast::Type* SyntaxAnalyzer::getType(const string& s){
@@ -59,6 +103,9 @@ ast::Term* SyntaxAnalyzer::buildBlock(TokenStream& stream){
 		case Token::TYPE:
 			buildTypeDef(stream);
 			break;
+		case Token::EXTERN:
+			buildExtern(stream);
+			break;
 		case Token::FUNC:
 			return buildFuncDef(stream);
 		case Token::COM:
@@ -100,6 +147,7 @@ void SyntaxAnalyzer::buildTypeDef(TokenStream& stream){
 			throw syntax_error(token.name, token.nrow, "Expected nil or identifier");
 		}
 		string cons = token.name;
+		constructors[cons].push_back(sumType);
 
 		token = stream.next();
 		if (token.type != Token::COLON){
@@ -138,6 +186,36 @@ void SyntaxAnalyzer::buildTypeDef(TokenStream& stream){
 
 }
 
+// Extern name : type = "symbol", a function written in C; the types
+// it mentions are to be defined before it
+void SyntaxAnalyzer::buildExtern(TokenStream& stream){
+	Token token = stream.next();	// extern id
+	if (token.type != Token::ID){
+		throw syntax_error(token.name, token.nrow, "Should be an ID");
+	}
+	string externId = token.name;
+	unsigned nrow = token.nrow;
+
+	token = stream.next();
+	if (token.type != Token::COLON){
+		throw syntax_error(token.name, token.nrow, "Should be ':'");
+	}
+	const ast::Type* type = buildFuncType(stream);
+	if (dynamic_cast<const ast::FunctionType*>(type) == NULL){
+		throw syntax_error(externId, nrow, "Extern should be a function");
+	}
+
+	token = stream.next();
+	if (token.type != Token::EQL){
+		throw syntax_error(token.name, token.nrow, "Should be '='");
+	}
+	token = stream.next();
+	if (token.type != Token::STRING || token.name.empty()){
+		throw syntax_error(token.name, token.nrow, "Expected the C symbol as a string");
+	}
+	externs[externId] = ast::Extern{type, token.name};
+}
+
 const ast::Type* SyntaxAnalyzer::buildFuncType(TokenStream& stream){
 	Token token = stream.next();	// type id
 	if (token.type != Token::ID && token.type != Token::NAT && token.type != Token::BOOL){
@@ -154,6 +232,11 @@ const ast::Type* SyntaxAnalyzer::buildFuncType(TokenStream& stream){
 
 ast::Term* SyntaxAnalyzer::buildFuncDef(TokenStream& stream){
 	Token token = stream.next();	// func id
+	// Func memo f ..., f remembers its results; its body becomes (memo body)
+	bool memo = token.type == Token::MEMO;
+	if (memo){
+		token = stream.next();
+	}
 	if (token.type != Token::ID){
 		throw syntax_error(token.name, token.nrow, "Should be an ID");
 	}
@@ -204,6 +287,14 @@ ast::Term* SyntaxAnalyzer::buildFuncDef(TokenStream& stream){
 
 	// func definition expression
 	term = buildExpr(stream);
+	if (memo && funcId != "main"){
+		ast::Term* mark = new ast::Reference("memo");
+		mark->nrow = nrow;
+		mark->ncol = ncol;
+		term = new ast::Application(mark, term);
+		term->nrow = nrow;
+		term->ncol = ncol;
+	}
 
 	// special case for main function
 	if (funcId == "main"){
@@ -315,8 +406,8 @@ ast::Term* SyntaxAnalyzer::buildTerm(TokenStream& stream){
 		return arg;
 	}
 	Token token = stream.next();
-	unsigned nrow = token.nrow, ncol = token.ncol;
 	while (token.type == Token::MUL || token.type == Token::DIV){
+		unsigned nrow = token.nrow, ncol = token.ncol;
 		func = new ast::Reference(token.name);
 		func->nrow = nrow;
 		func->ncol = ncol;
@@ -326,6 +417,10 @@ ast::Term* SyntaxAnalyzer::buildTerm(TokenStream& stream){
 		arg = new ast::Application(func, buildFactor(stream));
 		arg->nrow = nrow;
 		arg->ncol = ncol;
+		if (!stream.hasNext()){
+			return arg;
+		}
+		token = stream.next();
 	}
 	stream.back();
 	return arg;
@@ -408,7 +503,8 @@ ast::Term* SyntaxAnalyzer::buildMatchExpr(TokenStream& stream){
 		throw syntax_error(token.name, token.nrow, "Expected match");
 	}
 	ast::Term* expr = buildExpr(stream);
-	vector<pair<const string, const ast::Term*>> cases;
+	vector<Pattern> patterns;
+	vector<ast::Term*> bodies;
 
 	while (stream.hasNext()){
 		token = stream.next();
@@ -416,37 +512,271 @@ ast::Term* SyntaxAnalyzer::buildMatchExpr(TokenStream& stream){
 			stream.back();
 			break;
 		}
+		Pattern pattern = buildPattern(stream);
 		token = stream.next();
-		string cons = token.name + '_' + rands(10);
-		unsigned crow = token.nrow, ccol = token.ncol;
-
-		token = stream.next();
-		bool is_product = false;
-		vector<string> names;
 		while (token.type != Token::CHOICE){
-			// if token is an id?
-			if (token.type != Token::ID){
-				throw syntax_error(token.name, token.nrow, "Expected id");
+			if (!pattern.is_cons){
+				throw syntax_error(token.name, token.nrow, "Should be '=>'");
 			}
-			is_product = true;
-			names.push_back(token.name);
+			stream.back();
+			pattern.args.push_back(buildPattern(stream));
 			token = stream.next();
 		}
-		if (is_product){
-			term = new ast::Reference(cons);
-			term->nrow = crow;
-			term->ncol = ccol;
-			term = new ast::Deproduct(term, names, buildExpr(stream));
-			term->nrow = crow;
-			term->ncol = ccol;
+		patterns.push_back(pattern);
+		bodies.push_back(buildExpr(stream));
+	}
+
+	// each constructor at most once, on variables only: one case for each, as written
+	bool flat = true;
+	set<string> conses;
+	for (unsigned i = 0; i < patterns.size(); i++){
+		flat = flat && patterns[i].is_cons && conses.insert(patterns[i].name).second;
+		for (unsigned j = 0; j < patterns[i].args.size(); j++){
+			flat = flat && !patterns[i].args[j].is_cons && !patterns[i].args[j].name.empty();
+		}
+	}
+	if (flat){
+		vector<pair<const string, const ast::Term*>> cases;
+		for (unsigned i = 0; i < patterns.size(); i++){
+			string cons = patterns[i].name + '_' + rands(10);
+			if (patterns[i].args.empty()){
+				cases.push_back(pair<const string, const ast::Term*>(cons, bodies[i]));
+				continue;
+			}
+			vector<string> names;
+			for (unsigned j = 0; j < patterns[i].args.size(); j++){
+				names.push_back(patterns[i].args[j].name);
+			}
+			term = locate(new ast::Reference(cons), patterns[i].nrow, patterns[i].ncol);
+			term = locate(new ast::Deproduct(term, names, bodies[i]), patterns[i].nrow, patterns[i].ncol);
 			cases.push_back(pair<const string, const ast::Term*>(cons, term));
 		}
-		else{
-			cases.push_back(pair<const string, const ast::Term*>(cons, buildExpr(stream)));
+		return locate(new ast::Desum(expr, cases), nrow, ncol);
+	}
+
+	// else compile the cases to a decision tree, on the type all constructors on top belong to
+	vector<const ast::SumType*> sums;
+	bool first = true;
+	for (unsigned i = 0; i < patterns.size(); i++){
+		if (!patterns[i].is_cons){
+			continue;
+		}
+		if (constructors.find(patterns[i].name) == constructors.end()){
+			throw syntax_error(patterns[i].name, patterns[i].nrow, "Unknown constructor");
+		}
+		const vector<const ast::SumType*>& sums0 = constructors[patterns[i].name];
+		if (first){
+			sums = sums0;
+			first = false;
+			continue;
+		}
+		vector<const ast::SumType*> common;
+		for (unsigned j = 0; j < sums.size(); j++){
+			if (find(sums0.begin(), sums0.end(), sums[j]) != sums0.end()){
+				common.push_back(sums[j]);
+			}
+		}
+		sums = common;
+	}
+	if (sums.size() != 1){
+		throw syntax_error("match", nrow, first ? "Expected a constructor" :
+			sums.empty() ? "Constructors of different types" : "Cannot tell the type matched on");
+	}
+
+	Match match;
+	match.bodies = bodies;
+	match.used.assign(bodies.size(), false);
+	match.nrow = nrow;
+	match.ncol = ncol;
+	// a variable matching the whole value needs it bound, unless it is one already
+	bool bound = false;
+	for (unsigned i = 0; i < patterns.size(); i++){
+		bound = bound || (!patterns[i].is_cons && !patterns[i].name.empty());
+	}
+	ast::Reference* ref = dynamic_cast<ast::Reference*>(expr);
+	if (ref != NULL){
+		match.root = ref->name;
+		bound = false;
+	}
+	else{
+		match.root = "match_" + rands(10);
+	}
+	match.expr = bound ? NULL : expr;
+
+	vector<Row> rows;
+	for (unsigned i = 0; i < patterns.size(); i++){
+		Row row;
+		row.patterns.push_back(patterns[i]);
+		row.body = i;
+		rows.push_back(row);
+	}
+	term = compileMatch(Occurrences(1, make_pair(match.root, sums[0])), rows, match);
+	if (bound){
+		term = locate(new ast::Abstraction(match.root, sums[0], term), nrow, ncol);
+		term = locate(new ast::Application(term, expr), nrow, ncol);
+	}
+	else if (match.expr != NULL){	// never tested
+		delete match.expr;
+	}
+	for (unsigned i = 0; i < bodies.size(); i++){
+		if (!match.used[i]){		// no value reaches the case
+			delete bodies[i];
 		}
 	}
-	term = new ast::Desum(expr, cases);
-	term->nrow = nrow;
-	term->ncol = ncol;
 	return term;
 }
+
+SyntaxAnalyzer::Pattern SyntaxAnalyzer::buildPattern(TokenStream& stream){
+	Token token = stream.next();
+	Pattern pattern;
+	pattern.is_cons = false;
+	pattern.nrow = token.nrow;
+	pattern.ncol = token.ncol;
+	switch (token.type){
+	case Token::LPAR:
+		pattern = buildPattern(stream);
+		if (!pattern.is_cons){
+			throw syntax_error(pattern.name, pattern.nrow, "Expected constructor");
+		}
+		token = stream.next();
+		while (token.type != Token::RPAR){
+			stream.back();
+			pattern.args.push_back(buildPattern(stream));
+			token = stream.next();
+		}
+		break;
+	case Token::OTHER:
+		break;
+	case Token::NIL:
+	case Token::TRUE:
+	case Token::FALSE:
+		pattern.name = token.name;
+		pattern.is_cons = true;
+		break;
+	case Token::ID:
+		pattern.name = token.name;
+		pattern.is_cons = constructors.find(token.name) != constructors.end();
+		break;
+	default:
+		throw syntax_error(token.name, token.nrow, "Expected a pattern");
+	}
+	return pattern;
+}
+
+ast::Term* SyntaxAnalyzer::compileMatch(const Occurrences& occs, const vector<Row>& rows, Match& match){
+	if (rows.empty()){
+		throw syntax_error("match", match.nrow, "Patterns not exhaustive");
+	}
+	const Row& row = rows[0];
+	unsigned k = 0;
+	while (k < occs.size() && !row.patterns[k].is_cons){
+		k++;
+	}
+	if (k == occs.size()){
+		// the first case matches whatever is left
+		vector<Bind> binds = row.binds;
+		for (unsigned i = 0; i < occs.size(); i++){
+			if (!row.patterns[i].name.empty()){
+				Bind bind = { row.patterns[i].name, occs[i].first, occs[i].second };
+				binds.push_back(bind);
+			}
+		}
+		ast::Term* term = match.bodies[row.body];
+		if (match.used[row.body]){	// the tree owns its nodes
+			term = copyTerm(term);
+		}
+		match.used[row.body] = true;
+		for (int i = binds.size() - 1; i >= 0; i--){
+			term = locate(new ast::Abstraction(binds[i].name, binds[i].type, term), match.nrow, match.ncol);
+			term = locate(new ast::Application(term, locate(new ast::Reference(binds[i].occ), match.nrow, match.ncol)),
+				match.nrow, match.ncol);
+		}
+		return term;
+	}
+
+	// test the tag of a value the first case needs a constructor of, once for all cases
+	const Pattern& head = row.patterns[k];
+	const ast::SumType* sum = dynamic_cast<const ast::SumType*>(occs[k].second);
+	if (sum == NULL){
+		throw syntax_error(head.name, head.nrow, "Cannot match " + occs[k].second->to_string() + " on a constructor");
+	}
+	for (unsigned i = 0; i < rows.size(); i++){
+		const Pattern& pattern = rows[i].patterns[k];
+		if (pattern.is_cons){
+			const vector<const ast::SumType*>& sums = constructors[pattern.name];
+			if (find(sums.begin(), sums.end(), sum) == sums.end()){
+				throw syntax_error(pattern.name, pattern.nrow, "Constructor of another type");
+			}
+		}
+	}
+
+	vector<pair<const string, const ast::Term*>> cases;
+	for (unsigned i = 0; i < sum->types.size(); i++){
+		const ast::ProductType* product = dynamic_cast<const ast::ProductType*>(sum->types[i].first);
+		string cons = product != NULL ? product->cons : sum->types[i].second;
+		string name = cons + '_' + rands(10);
+
+		// the fields take the place of the value
+		Occurrences occs0(occs.begin(), occs.begin() + k);
+		vector<string> names;
+		if (product != NULL){
+			for (unsigned j = 0; j < product->types.size(); j++){
+				names.push_back(cons + '_' + rands(10));
+				occs0.push_back(make_pair(names.back(), product->types[j]));
+			}
+		}
+		occs0.insert(occs0.end(), occs.begin() + k + 1, occs.end());
+
+		// and the cases which may still match, their patterns of the fields
+		vector<Row> rows0;
+		for (unsigned j = 0; j < rows.size(); j++){
+			const Pattern& pattern = rows[j].patterns[k];
+			if (pattern.is_cons && pattern.name != cons){
+				continue;
+			}
+			Row row0;
+			row0.binds = rows[j].binds;
+			row0.body = rows[j].body;
+			row0.patterns.assign(rows[j].patterns.begin(), rows[j].patterns.begin() + k);
+			if (pattern.is_cons){
+				if (pattern.args.size() != names.size()){
+					throw syntax_error(pattern.name, pattern.nrow, "Expected " + to_string(names.size()) + " patterns");
+				}
+				row0.patterns.insert(row0.patterns.end(), pattern.args.begin(), pattern.args.end());
+			}
+			else{
+				Pattern any;
+				any.is_cons = false;
+				any.nrow = pattern.nrow;
+				any.ncol = pattern.ncol;
+				row0.patterns.insert(row0.patterns.end(), names.size(), any);
+				if (!pattern.name.empty()){
+					Bind bind = { pattern.name, occs[k].first, occs[k].second };
+					row0.binds.push_back(bind);
+				}
+			}
+			row0.patterns.insert(row0.patterns.end(), rows[j].patterns.begin() + k + 1, rows[j].patterns.end());
+			rows0.push_back(row0);
+		}
+		if (rows0.empty()){
+			throw syntax_error(cons, match.nrow, "Patterns not exhaustive");
+		}
+
+		ast::Term* term = compileMatch(occs0, rows0, match);
+		if (product != NULL){
+			term = locate(new ast::Deproduct(locate(new ast::Reference(name), head.nrow, head.ncol), names, term),
+				head.nrow, head.ncol);
+		}
+		cases.push_back(pair<const string, const ast::Term*>(name, term));
+	}
+
+	ast::Term* value = NULL;
+	if (occs[k].first == match.root && match.expr != NULL){
+		value = match.expr;
+		match.expr = NULL;
+	}
+	else{
+		value = locate(new ast::Reference(occs[k].first), head.nrow, head.ncol);
+	}
+	return locate(new ast::Desum(value, cases), head.nrow, head.ncol);
+}
@@ -11,9 +11,38 @@ public:
 	ast::Program* getProgram()const;
 
 private:
+	// a pattern of a match case, a constructor applied to patterns or a variable
+	struct Pattern{
+		string name;		// empty for other
+		bool is_cons;
+		vector<Pattern> args;
+		unsigned nrow, ncol;
+	};
+	// a value a case binds to a variable once it is chosen
+	struct Bind{
+		string name;
+		string occ;
+		const ast::Type* type;
+	};
+	// a case still to be told apart from the others
+	struct Row{
+		vector<Pattern> patterns;
+		vector<Bind> binds;
+		unsigned body;
+	};
+	// values the patterns of a row are matched against
+	typedef vector<pair<string, const ast::Type*>> Occurrences;
+	struct Match{
+		vector<ast::Term*> bodies;
+		vector<bool> used;
+		string root;
+		ast::Term* expr;	// what root stands for, until tested
+		unsigned nrow, ncol;
+	};
 
 	ast::Term* buildBlock(TokenStream& stream);
 	void buildTypeDef(TokenStream& stream);
+	void buildExtern(TokenStream& stream);
 	const ast::Type* buildFuncType(TokenStream& stream);
 	ast::Term* buildFuncDef(TokenStream& stream);
 	ast::Term* buildFuncDesig(TokenStream& stream);
@@ -22,11 +51,15 @@ private:
 	ast::Term* buildExpr(TokenStream& stream);
 	ast::Term* buildSimExpr(TokenStream& stream);
 	ast::Term* buildMatchExpr(TokenStream& stream);
+	Pattern buildPattern(TokenStream& stream);
+	ast::Term* compileMatch(const Occurrences& occs, const vector<Row>& rows, Match& match);
 
 	const ast::Type* getType(const std::string&);
 
 	ast::Term* root;
 	map<const string, const ast::Type*> types;
 	map<string, string> casts;
+	map<string, vector<const ast::SumType*>> constructors;
+	map<const string, ast::Extern> externs;
 };
 
@@ -16,10 +16,14 @@ struct Token{
 		BOOL,	// bool
 		TRUE,	// true
 		FALSE,	// false
+		PAR,	// par
+		MEMO,	// memo
+		EXTERN,	// Extern
 
 		ID,		// identifier
 		INT,	// integer
 		COM,	// comment, start with #, end with \n
+		STRING,	// "...", the name of a C symbol
 		// operators
 		ADD,	// +
 		SUB,	// -
@@ -61,9 +65,13 @@ const string TokenName[] = {
 	"bool",		// bool
 	"true",		// true
 	"false",	// false
+	"par",		// par
+	"memo",		// memo
+	"Extern",	// Extern
 	"id",		// identifier
 	"int",		// integer
 	"comment",	// comment, start with #, end with \n
+	"string",	// "..."
 	// operators
 	"+",	// +
 	"-",	// -